@@ -0,0 +1,936 @@
+/*
+Spartan 6 bitstream formats. See bitstream.h.
+*/
+
+#include "bitstream.h"
+
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// idcodes from the Spartan 6 configuration user guide (UG380), with the
+// version bits clear
+const struct bit_part bit_parts[] = {
+	{"6slx4",    0x04000093},
+	{"6slx9",    0x04001093},
+	{"6slx16",   0x04002093},
+	{"6slx25",   0x04004093},
+	{"6slx25t",  0x04024093},
+	{"6slx45",   0x04008093},
+	{"6slx45t",  0x04028093},
+	{"6slx75",   0x0400e093},
+	{"6slx75t",  0x0402e093},
+	{"6slx100",  0x04011093},
+	{"6slx100t", 0x04031093},
+	{"6slx150",  0x0401d093},
+	{"6slx150t", 0x0403d093},
+	{NULL, 0}
+};
+
+static const unsigned char bit_preamble[13] = {
+	0x00, 0x09, 0x0f, 0xf0, 0x0f, 0xf0, 0x0f, 0xf0, 0x0f, 0xf0, 0x00, 0x00, 0x01
+};
+
+const struct bit_part * bit_part_by_idcode(uint32_t idcode)
+{
+	const struct bit_part * part;
+	
+	for(part = bit_parts; part->name != NULL; part++)
+		if((part->idcode & BIT_IDCODE_MASK) == (idcode & BIT_IDCODE_MASK))
+			return part;
+	
+	return NULL;
+}
+
+// the part field runs the package on after the part name, so the part
+// is the longest name the field starts with ("6slx45t" rather than
+// "6slx45" for "6slx45tfgg484")
+const struct bit_part * bit_part_by_name(const char * name)
+{
+	const struct bit_part * part, * best = NULL;
+	
+	for(part = bit_parts; part->name != NULL; part++)
+		if((strncmp(name, part->name, strlen(part->name)) == 0) &&
+			((best == NULL) || (strlen(part->name) > strlen(best->name))))
+			best = part;
+	
+	return best;
+}
+
+int bit_is_bit_file(const unsigned char * p, size_t n)
+{
+	return (n >= sizeof(bit_preamble)) && (memcmp(p, bit_preamble, sizeof(bit_preamble)) == 0);
+}
+
+int bit_parse_header(const unsigned char * p, size_t n, struct bit_header * hdr)
+{
+	size_t i = sizeof(bit_preamble), length;
+	char * field;
+	
+	if(!bit_is_bit_file(p, n))
+		return 1;
+	
+	memset(hdr, 0, sizeof(struct bit_header));
+	
+	while(i + 3 <= n)
+	{
+		switch(p[i])
+		{
+		case 'a':
+			field = hdr->design;
+			break;
+		case 'b':
+			field = hdr->part;
+			break;
+		case 'c':
+			field = hdr->date;
+			break;
+		case 'd':
+			field = hdr->time;
+			break;
+		case 'e':
+			if(i + 5 > n)
+				return 1;
+			hdr->data_length = ((size_t)p[i + 1] << 24) | (p[i + 2] << 16) | (p[i + 3] << 8) | p[i + 4];
+			hdr->data_offset = i + 5;
+			return 0;
+		default:
+			printf("error: bit_parse_header: unknown field '%c'\n", p[i]);
+			return 1;
+		}
+		
+		length = (p[i + 1] << 8) | p[i + 2];
+		i += 3;
+		if(i + length > n)
+			return 1;
+		
+		// the strings are nul terminated in the file, but do not rely on it
+		snprintf(field, BIT_FIELD_SIZE, "%.*s", (int)length, (const char *)&p[i]);
+		i += length;
+	}
+	
+	return 1;
+}
+
+static const char * const bit_register_names[BIT_NUM_REGS] = {
+	[0x00] = "crc",
+	[0x01] = "far_maj",
+	[0x02] = "far_min",
+	[0x03] = "fdri",
+	[0x04] = "fdro",
+	[0x05] = "cmd",
+	[0x06] = "ctl",
+	[0x07] = "mask",
+	[0x08] = "stat",
+	[0x09] = "lout",
+	[0x0a] = "cor1",
+	[0x0b] = "cor2",
+	[0x0c] = "pwrdn_reg",
+	[0x0d] = "flr",
+	[0x0e] = "idcode",
+	[0x0f] = "cwdt",
+	[0x10] = "hc_opt_reg",
+	[0x12] = "csbo",
+	[0x13] = "general1",
+	[0x14] = "general2",
+	[0x15] = "general3",
+	[0x16] = "general4",
+	[0x17] = "general5",
+	[0x18] = "mode_reg",
+	[0x19] = "pu_gwe",
+	[0x1a] = "pu_gts",
+	[0x1b] = "mfwr",
+	[0x1c] = "cclk_freq",
+	[0x1d] = "seu_opt",
+	[0x1e] = "exp_sign",
+	[0x1f] = "rdbk_sign",
+	[0x20] = "bootsts",
+	[0x21] = "eye_mask",
+	[0x22] = "cbc_reg",
+};
+
+const char * bit_register_name(int reg)
+{
+	if((reg < 0) || (reg >= BIT_NUM_REGS))
+		return NULL;
+	return bit_register_names[reg];
+}
+
+static unsigned int bit_word(const unsigned char * p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+// the sync word can be at any byte offset (a .bit header has an odd
+// length), so each of its four bytes is compared at every position of
+// a 16 byte window at once, and the positions where all four match are
+// where it starts
+size_t bit_find_sync(const unsigned char * p, size_t n)
+{
+	size_t i = 0;
+	
+#ifdef __SSE2__
+	const __m128i s0 = _mm_set1_epi8((char)0xaa), s1 = _mm_set1_epi8((char)0x99);
+	const __m128i s2 = _mm_set1_epi8((char)0x55), s3 = _mm_set1_epi8((char)0x66);
+	unsigned int m;
+	
+	for(; i + 16 + 3 <= n; i += 16)
+	{
+		m = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)&p[i]), s0));
+		if(m == 0)
+			continue;
+		m &= _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)&p[i + 1]), s1));
+		m &= _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)&p[i + 2]), s2));
+		m &= _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)&p[i + 3]), s3));
+		if(m != 0)
+			return i + __builtin_ctz(m);
+	}
+#endif
+	
+	for(; i + 4 <= n; i++)
+		if((p[i] == 0xaa) && (p[i + 1] == 0x99) && (p[i + 2] == 0x55) && (p[i + 3] == 0x66))
+			return i;
+	
+	return n;
+}
+
+int bit_parser_init(struct bit_parser * bp, const unsigned char * p, size_t n)
+{
+	bp->p = p;
+	bp->n = n;
+	bp->reg = -1;
+	
+	if((bp->i = bit_find_sync(p, n)) == n)
+		return 1;
+	bp->i += 4;
+	
+	return 0;
+}
+
+int bit_next_packet(struct bit_parser * bp, struct bit_packet * pkt)
+{
+	const unsigned char * p = bp->p;
+	unsigned int hdr;
+	size_t i = bp->i;
+	
+	if(i + 2 > bp->n)
+		return 0;
+	
+	hdr = bit_word(&p[i]);
+	pkt->offset = i;
+	pkt->op = (hdr >> 11) & 3;
+	pkt->reg = (hdr >> 5) & 0x3f;
+	pkt->words = 0;
+	i += 2;
+	
+	switch(hdr >> 13)
+	{
+	case 1:
+		pkt->words = hdr & 0x1f;
+		bp->reg = pkt->reg;
+		break;
+	case 2:
+		if(i + 4 > bp->n)
+			return -2;
+		pkt->words = ((size_t)bit_word(&p[i]) << 16) | bit_word(&p[i + 2]);
+		if(pkt->reg == 0)
+			pkt->reg = bp->reg;
+		i += 4;
+		break;
+	default:
+		return -1;
+	}
+	
+	pkt->data = &p[i];
+	if(pkt->words > (bp->n - i) / 2)
+		return -2;
+	bp->i = i + pkt->words * 2;
+	
+	return 1;
+}
+
+int bit_check_packets(const unsigned char * p, size_t n, int partial, struct bit_summary * sum)
+{
+	struct bit_parser bp;
+	struct bit_packet pkt;
+	unsigned int cmd;
+	int ret;
+	
+	memset(sum, 0, sizeof(struct bit_summary));
+	sum->end_offset = n;
+	
+	if(bit_parser_init(&bp, p, n))
+	{
+		printf("error: bit_check_packets: no sync word, this is not configuration data\n");
+		return 1;
+	}
+	sum->sync_offset = bp.i - 4;
+	
+	while((ret = bit_next_packet(&bp, &pkt)) > 0)
+	{
+		sum->packets++;
+		if(pkt.op != BIT_OP_WRITE)
+			continue;
+		
+		switch(pkt.reg)
+		{
+		case BIT_REG_IDCODE:
+			if(pkt.words == 2)
+			{
+				sum->has_idcode = 1;
+				sum->idcode = (bit_word(pkt.data) << 16) | bit_word(pkt.data + 2);
+			}
+			break;
+		case BIT_REG_FDRI:
+			sum->fdri_words += pkt.words;
+			break;
+		case BIT_REG_CRC:
+			sum->crc_writes++;
+			break;
+		case BIT_REG_CMD:
+			if(pkt.words < 1)
+				break;
+			cmd = bit_word(pkt.data) & 0x1f;
+			sum->commands |= 1u << cmd;
+			if(cmd == BIT_CMD_DESYNC)
+			{
+				sum->end_offset = bp.i;
+				return 0;
+			}
+			break;
+		}
+	}
+	
+	if(ret == -1)
+	{
+		printf("error: bit_check_packets: bad packet header 0x%04x at byte %zu\n",
+			bit_word(&p[pkt.offset]), pkt.offset);
+		return 1;
+	}
+	
+	// if only the start of the data is here the packet may well go on
+	if((ret == -2) && !partial)
+	{
+		printf("error: bit_check_packets: %s packet at byte %zu runs past the end of the data\n",
+			(bit_register_name(pkt.reg) != NULL) ? bit_register_name(pkt.reg) : "a", pkt.offset);
+		return 1;
+	}
+	
+	return 0;
+}
+
+// copy p[from, to) to out[*o] when trimming into 'out'
+static void bit_trim_copy(const unsigned char * p, size_t from, size_t to, unsigned char * out, size_t * o)
+{
+	if(out != NULL)
+		memcpy(&out[*o], &p[from], to - from);
+	*o += to - from;
+}
+
+size_t bit_trim(const unsigned char * p, size_t n, const struct bit_summary * sum,
+	struct bit_trim * t, unsigned char * out)
+{
+	struct bit_parser bp;
+	struct bit_packet pkt;
+	size_t i, o = 0;
+	int run = 0;
+	
+	t->start = sum->sync_offset - ((sum->sync_offset < BIT_TRIM_DUMMY_BYTES) ? sum->sync_offset : BIT_TRIM_DUMMY_BYTES);
+	t->end = n;
+	t->cut = 0;
+	if((sum->commands & (1u << BIT_CMD_DESYNC)) && (n - sum->end_offset > BIT_TRIM_NOOPS * 2))
+		t->end = sum->end_offset + BIT_TRIM_NOOPS * 2;
+	
+	// the packets were checked, so the parse can not fail up to the end
+	// of them. each NOOP past the first BIT_TRIM_NOOPS of a run is cut,
+	// copying what comes before it.
+	bit_parser_init(&bp, p, sum->end_offset);
+	i = t->start;
+	while(bit_next_packet(&bp, &pkt) > 0)
+	{
+		if((pkt.op != BIT_OP_NOP) || (pkt.words != 0) || (pkt.data != &p[pkt.offset + 2]))
+		{
+			run = 0;
+			continue;
+		}
+		
+		if(++run <= BIT_TRIM_NOOPS)
+			continue;
+		
+		bit_trim_copy(p, i, pkt.offset, out, &o);
+		i = pkt.offset + 2;
+		t->cut += 2;
+	}
+	bit_trim_copy(p, i, t->end, out, &o);
+	
+	return o;
+}
+
+uint64_t bit_frame_hash(const unsigned char * frame)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	size_t k;
+	
+	for(k = 0; k < BIT_FRAME_BYTES; k++)
+		h = (h ^ frame[k]) * 0x100000001b3ULL;
+	
+	return h;
+}
+
+int bit_frame_hashes(const unsigned char * p, const struct bit_summary * sum, uint64_t ** hashes, size_t * frames)
+{
+	struct bit_parser bp;
+	struct bit_packet pkt;
+	size_t i;
+	
+	*frames = 0;
+	if((*hashes = malloc((sum->fdri_words / BIT_FRAME_WORDS + 1) * sizeof(uint64_t))) == NULL)
+		return 1;
+	
+	bit_parser_init(&bp, p, sum->end_offset);
+	while(bit_next_packet(&bp, &pkt) > 0)
+	{
+		if((pkt.op != BIT_OP_WRITE) || (pkt.reg != BIT_REG_FDRI))
+			continue;
+		for(i = 0; i + 1 < pkt.words / BIT_FRAME_WORDS; i++)
+			(*hashes)[(*frames)++] = bit_frame_hash(&pkt.data[i * BIT_FRAME_BYTES]);
+	}
+	
+	return 0;
+}
+
+size_t bit_frame_diff(const uint64_t * a, size_t na, const uint64_t * b, size_t nb, unsigned char * changed)
+{
+	size_t i, n = 0;
+	
+	for(i = 0; i < nb; i++)
+	{
+		if(changed != NULL)
+			changed[i] = (na != nb) || (a[i] != b[i]);
+		n += (na != nb) || (a[i] != b[i]);
+	}
+	
+	return n;
+}
+
+// the next word of a geometry file line, or NULL at its end
+static char * bit_geometry_token(char ** line)
+{
+	return strtok_r(NULL, " \t\r\n", line);
+}
+
+// parse the column list of a geometry file 'block' line into block type
+// 'block' of 'g'
+static int bit_geometry_minors(struct bit_geometry * g, int block, char ** line)
+{
+	unsigned long minors, count;
+	char * tok, * end;
+	
+	while((tok = bit_geometry_token(line)) != NULL)
+	{
+		minors = strtoul(tok, &end, 0);
+		count = 1;
+		if(*end == '*')
+			count = strtoul(end + 1, &end, 0);
+		if((*end != '\0') || (minors < 1) || (minors > BIT_GEOMETRY_MINORS) ||
+			(count > (unsigned long)(BIT_GEOMETRY_MAJORS - g->majors[block])))
+			return 1;
+		while(count-- > 0)
+			g->minors[block][g->majors[block]++] = minors;
+	}
+	
+	return (g->majors[block] == 0);
+}
+
+int bit_geometry_load(const char * filename, struct bit_geometry * g)
+{
+	char buf[4096], * tok, * line, * end;
+	unsigned long block, rows;
+	int n = 0, ret = 0;
+	FILE * f;
+	
+	memset(g, 0, sizeof(struct bit_geometry));
+	if((f = fopen(filename, "r")) == NULL)
+	{
+		printf("error: bit_geometry_load: could not open %s\n", filename);
+		return 1;
+	}
+	
+	while(!ret && (fgets(buf, sizeof(buf), f) != NULL))
+	{
+		n++;
+		if((end = strchr(buf, '#')) != NULL)
+			*end = '\0';
+		if((tok = strtok_r(buf, " \t\r\n", &line)) == NULL)
+			continue;
+		
+		if(strcmp(tok, "idcode") == 0)
+		{
+			ret = ((tok = bit_geometry_token(&line)) == NULL);
+			if(!ret)
+				g->idcode = strtoul(tok, NULL, 0) & BIT_IDCODE_MASK;
+			continue;
+		}
+		
+		// block <type> rows <rows> minors <columns>
+		ret = (strcmp(tok, "block") != 0) || ((tok = bit_geometry_token(&line)) == NULL) ||
+			((block = strtoul(tok, &end, 0)) >= BIT_GEOMETRY_BLOCKS) || (*end != '\0') ||
+			(g->rows[block] != 0) || ((tok = bit_geometry_token(&line)) == NULL) || (strcmp(tok, "rows") != 0) ||
+			((tok = bit_geometry_token(&line)) == NULL) || ((rows = strtoul(tok, &end, 0)) < 1) || (*end != '\0') ||
+			(rows > BIT_GEOMETRY_ROWS) || ((tok = bit_geometry_token(&line)) == NULL) || (strcmp(tok, "minors") != 0) ||
+			bit_geometry_minors(g, block, &line);
+		if(!ret)
+			g->rows[block] = rows;
+	}
+	fclose(f);
+	
+	if(ret)
+		printf("error: bit_geometry_load: bad line %d in %s\n", n, filename);
+	return ret;
+}
+
+// the minor frames of a column run up, then the columns of a row, the
+// rows of a block type and the block types
+uint32_t bit_far_next(const struct bit_geometry * g, uint32_t far)
+{
+	int block = BIT_FAR_BLOCK(far), row = BIT_FAR_ROW(far), major = BIT_FAR_MAJOR(far);
+	int minor = BIT_FAR_MINOR(far);
+	
+	if((g == NULL) || (row >= g->rows[block]) || (major >= g->majors[block]) ||
+		(minor >= g->minors[block][major]))
+		return far + 1;
+	
+	if(++minor < g->minors[block][major])
+		return BIT_FAR(block, row, major, minor);
+	if(++major < g->majors[block])
+		return BIT_FAR(block, row, major, 0);
+	if(++row < g->rows[block])
+		return BIT_FAR(block, row, 0, 0);
+	
+	for(block++; block < BIT_GEOMETRY_BLOCKS; block++)
+		if(g->rows[block] > 0)
+			return BIT_FAR(block, 0, 0, 0);
+	return far + 1;
+}
+
+// follow FAR through a write packet
+static void bit_follow_far(const struct bit_packet * pkt, uint32_t * far)
+{
+	if((pkt->op != BIT_OP_WRITE) || (pkt->words == 0))
+		return;
+	if(pkt->reg == BIT_REG_FAR_MAJ)
+		*far = ((uint32_t)bit_word(pkt->data) << 16) | ((pkt->words > 1) ? bit_word(&pkt->data[2]) : (*far & 0xffff));
+	else if(pkt->reg == BIT_REG_FAR_MIN)
+		*far = (*far & 0xffff0000) | bit_word(pkt->data);
+}
+
+int bit_frame_addresses(const unsigned char * p, const struct bit_summary * sum, const struct bit_geometry * g,
+	uint32_t ** fars, size_t * frames)
+{
+	struct bit_parser bp;
+	struct bit_packet pkt;
+	uint32_t far = 0;
+	size_t i;
+	
+	*frames = 0;
+	if((*fars = malloc((sum->fdri_words / BIT_FRAME_WORDS + 1) * sizeof(uint32_t))) == NULL)
+		return 1;
+	
+	bit_parser_init(&bp, p, sum->end_offset);
+	while(bit_next_packet(&bp, &pkt) > 0)
+	{
+		bit_follow_far(&pkt, &far);
+		if((pkt.op != BIT_OP_WRITE) || (pkt.reg != BIT_REG_FDRI))
+			continue;
+		for(i = 0; i + 1 < pkt.words / BIT_FRAME_WORDS; i++)
+		{
+			(*fars)[(*frames)++] = far;
+			far = bit_far_next(g, far);
+		}
+	}
+	
+	return 0;
+}
+
+// a distinct frame, how often it occurs, and the copies of it taken out
+// of FDRI, linked through bit_mfwr_state.next from 'first'
+struct bit_frame_slot
+{
+	const unsigned char * frame;
+	size_t count;
+	size_t taken;
+	size_t first;
+	size_t last;
+};
+
+// the slot of 'frame' in an open addressed table of 'mask' + 1 slots,
+// which stays at most half full, or the free one it would go in
+static struct bit_frame_slot * bit_frame_find(struct bit_frame_slot * table, size_t mask, const unsigned char * frame)
+{
+	size_t k;
+	
+	for(k = bit_frame_hash(frame) & mask; table[k].frame != NULL; k = (k + 1) & mask)
+		if(memcmp(table[k].frame, frame, BIT_FRAME_BYTES) == 0)
+			break;
+	
+	return &table[k];
+}
+
+// room to rewrite the largest FDRI write of the data: for each frame,
+// its slot, its address, whether it is taken out and the next copy
+// taken out of the same frame
+struct bit_mfwr_state
+{
+	struct bit_frame_slot * table;
+	size_t mask;
+	struct bit_frame_slot ** slots;
+	uint32_t * far;
+	unsigned char * take;
+	size_t * next;
+};
+
+// append the 16 bit word 'w' to 'out', or only count it if 'out' is NULL
+static void bit_put(unsigned char * out, size_t * o, unsigned int w)
+{
+	if(out != NULL)
+	{
+		out[*o] = w >> 8;
+		out[*o + 1] = w;
+	}
+	*o += 2;
+}
+
+static void bit_put_far(unsigned char * out, size_t * o, uint32_t far)
+{
+	bit_put(out, o, 0x3000 | (BIT_REG_FAR_MAJ << 5) | 2);
+	bit_put(out, o, far >> 16);
+	bit_put(out, o, far);
+}
+
+static void bit_put_cmd(unsigned char * out, size_t * o, int cmd)
+{
+	bit_put(out, o, 0x3000 | (BIT_REG_CMD << 5) | 1);
+	bit_put(out, o, cmd);
+}
+
+// write the 'r' frames at 'frames' from frame address 'far', and a pad
+// frame to push the last of them out
+static void bit_put_frames(unsigned char * out, size_t * o, uint32_t far, const unsigned char * frames, size_t r)
+{
+	size_t words = (r + 1) * BIT_FRAME_WORDS;
+	
+	bit_put_far(out, o, far);
+	bit_put(out, o, 0x5000 | (BIT_REG_FDRI << 5));
+	bit_put(out, o, words >> 16);
+	bit_put(out, o, words);
+	bit_trim_copy(frames, 0, r * BIT_FRAME_BYTES, out, o);
+	if(out != NULL)
+		memset(&out[*o], 0, BIT_FRAME_BYTES);
+	*o += BIT_FRAME_BYTES;
+}
+
+// rewrite the FDRI write 'pkt' of 'k' frames, the first at 'far', into
+// 'out'. st->far is left with the address of each frame and the one
+// after the last. returns 0, writing nothing, if the write is best kept.
+static int bit_mfwr_write(struct bit_mfwr_state * st, const struct bit_packet * pkt, const unsigned char * p,
+	size_t k, uint32_t far, const struct bit_geometry * g, unsigned char * out, size_t * o, struct bit_mfwr * m)
+{
+	struct bit_frame_slot * t;
+	size_t i, j, r, words = 0, loads = 0;
+	
+	memset(st->table, 0, (st->mask + 1) * sizeof(struct bit_frame_slot));
+	for(i = 0; i < k; i++)
+	{
+		st->slots[i] = bit_frame_find(st->table, st->mask, &pkt->data[i * BIT_FRAME_BYTES]);
+		st->slots[i]->frame = &pkt->data[i * BIT_FRAME_BYTES];
+		st->slots[i]->count++;
+		st->far[i] = far;
+		far = bit_far_next(g, far);
+	}
+	st->far[k] = far;
+	
+	// frames with enough copies to pay for their load are taken out
+	// where they run long enough to pay for the break in FDRI
+	for(i = 0, r = 0; i <= k; i++)
+	{
+		st->take[i] = 0;
+		t = (i < k) ? st->slots[i] : NULL;
+		if((t != NULL) && ((t->count - 1) * (BIT_FRAME_WORDS - BIT_MFWR_WORDS) >
+			BIT_MFWR_LOAD_WORDS + 2 * BIT_MFWR_CMD_WORDS))
+		{
+			r++;
+			continue;
+		}
+		if(r * (BIT_FRAME_WORDS - BIT_MFWR_WORDS) > BIT_MFWR_BREAK_WORDS)
+			memset(&st->take[i - r], 1, r);
+		r = 0;
+	}
+	
+	// link the copies taken out of each frame, and count the words of
+	// the kept runs, the loads and the copies
+	for(i = 0, r = 0; i <= k; i++)
+	{
+		if((i < k) && !st->take[i])
+		{
+			r++;
+			continue;
+		}
+		if(r > 0)
+			words += BIT_MFWR_BREAK_WORDS + r * BIT_FRAME_WORDS;
+		r = 0;
+		if(i == k)
+			break;
+		
+		t = st->slots[i];
+		if(t->taken++ == 0)
+		{
+			t->first = i;
+			words += BIT_MFWR_LOAD_WORDS + 2 * BIT_MFWR_CMD_WORDS;
+			loads++;
+		} else {
+			st->next[t->last] = i;
+			words += BIT_MFWR_WORDS;
+		}
+		t->last = i;
+	}
+	
+	// WCFG again, and FAR where the write would have left it
+	words += BIT_MFWR_CMD_WORDS + 3;
+	if((loads == 0) || (words * 2 >= (size_t)(pkt->data - &p[pkt->offset]) + pkt->words * 2))
+		return 0;
+	
+	for(i = 0; i < k; i = j)
+	{
+		for(j = i; (j < k) && !st->take[j]; j++)
+			;
+		if(j > i)
+			bit_put_frames(out, o, st->far[i], &pkt->data[i * BIT_FRAME_BYTES], j - i);
+		else
+			j++;
+	}
+	
+	for(i = 0; i < k; i++)
+	{
+		t = st->slots[i];
+		if(!st->take[i] || (t->first != i))
+			continue;
+		
+		bit_put_cmd(out, o, BIT_CMD_WCFG);
+		bit_put_frames(out, o, st->far[i], t->frame, 1);
+		bit_put_cmd(out, o, BIT_CMD_MFW);
+		for(j = i; j != t->last; )
+		{
+			j = st->next[j];
+			bit_put_far(out, o, st->far[j]);
+			bit_put(out, o, 0x3000 | (BIT_REG_MFWR << 5) | 4);
+			bit_put(out, o, 0);
+			bit_put(out, o, 0);
+			bit_put(out, o, 0);
+			bit_put(out, o, 0);
+		}
+		m->placed += t->taken;
+	}
+	
+	bit_put_cmd(out, o, BIT_CMD_WCFG);
+	bit_put_far(out, o, st->far[k]);
+	m->loads += loads;
+	
+	return 1;
+}
+
+// FAR is followed through the packets, from 0, to know where each FDRI
+// write starts. everything other than the FDRI writes rewritten and the
+// CRC writes is copied as it is.
+int bit_mfwr(const unsigned char * p, size_t n, const struct bit_summary * sum, const struct bit_geometry * g,
+	unsigned char * out, struct bit_mfwr * m)
+{
+	struct bit_mfwr_state st;
+	struct bit_parser bp;
+	struct bit_packet pkt;
+	size_t i = 0, o = 0, end, k, size = 16, nframes;
+	uint32_t far = 0;
+	int ret = 0;
+	
+	memset(m, 0, sizeof(struct bit_mfwr));
+	
+	nframes = sum->fdri_words / BIT_FRAME_WORDS + 1;
+	while(size < 2 * nframes)
+		size *= 2;
+	st.mask = size - 1;
+	st.table = malloc(size * sizeof(struct bit_frame_slot));
+	st.slots = malloc(nframes * sizeof(struct bit_frame_slot *));
+	st.far = malloc((nframes + 1) * sizeof(uint32_t));
+	st.take = malloc(nframes + 1);
+	st.next = malloc(nframes * sizeof(size_t));
+	if((st.table == NULL) || (st.slots == NULL) || (st.far == NULL) || (st.take == NULL) || (st.next == NULL))
+		ret = 1;
+	
+	bit_parser_init(&bp, p, sum->end_offset);
+	while(!ret && (bit_next_packet(&bp, &pkt) > 0))
+	{
+		end = (pkt.data - p) + pkt.words * 2;
+		bit_follow_far(&pkt, &far);
+		if((pkt.op != BIT_OP_WRITE) || (pkt.words == 0))
+			continue;
+		
+		if(pkt.reg == BIT_REG_CRC)
+		{
+			bit_trim_copy(p, i, pkt.offset, out, &o);
+			i = end;
+		} else if((pkt.reg == BIT_REG_FDRI) && (pkt.words >= 2 * BIT_FRAME_WORDS) &&
+			(pkt.words % BIT_FRAME_WORDS == 0))
+		{
+			k = pkt.words / BIT_FRAME_WORDS - 1;
+			bit_trim_copy(p, i, pkt.offset, out, &o);
+			i = bit_mfwr_write(&st, &pkt, p, k, far, g, out, &o, m) ? end : pkt.offset;
+			far = st.far[k];
+		}
+	}
+	bit_trim_copy(p, i, n, out, &o);
+	m->length = o;
+	
+	free(st.table);
+	free(st.slots);
+	free(st.far);
+	free(st.take);
+	free(st.next);
+	
+	return ret;
+}
+
+int bit_partial(const unsigned char * p, size_t n, const struct bit_summary * sum, const struct bit_geometry * g,
+	const unsigned char * changed, unsigned char * out, size_t * length)
+{
+	struct bit_parser bp;
+	struct bit_packet pkt;
+	size_t i = 0, o = 0, j = 0, k, r, c, f;
+	uint32_t far = 0;
+	
+	bit_parser_init(&bp, p, sum->end_offset);
+	while(bit_next_packet(&bp, &pkt) > 0)
+	{
+		bit_follow_far(&pkt, &far);
+		if((pkt.op != BIT_OP_WRITE) || (pkt.words == 0) ||
+			((pkt.reg != BIT_REG_CRC) && (pkt.reg != BIT_REG_FDRI)))
+			continue;
+		
+		bit_trim_copy(p, i, pkt.offset, out, &o);
+		i = (pkt.data - p) + pkt.words * 2;
+		if(pkt.reg == BIT_REG_CRC)
+			continue;
+		
+		// FDRI writes of less than two frames write nothing, and are kept
+		if(pkt.words < 2 * BIT_FRAME_WORDS)
+		{
+			i = pkt.offset;
+			continue;
+		}
+		if(pkt.words % BIT_FRAME_WORDS != 0)
+			return 1;
+		
+		// a run of changed frames is written, an unchanged frame skipped
+		k = pkt.words / BIT_FRAME_WORDS - 1;
+		for(c = 0; c < k; c += r)
+		{
+			for(r = 0; (c + r < k) && changed[j + c + r]; r++)
+				;
+			if(r > 0)
+				bit_put_frames(out, &o, far, &pkt.data[c * BIT_FRAME_BYTES], r);
+			else
+				r = 1;
+			for(f = 0; f < r; f++)
+				far = bit_far_next(g, far);
+		}
+		j += k;
+		bit_put_far(out, &o, far);
+	}
+	bit_trim_copy(p, i, n, out, &o);
+	*length = o;
+	
+	return 0;
+}
+
+// the frames are counted through a table of the first copy of each, and
+// the size with multi-frame writes is what bit_mfwr would write
+int bit_frame_stats(const unsigned char * p, size_t n, const struct bit_summary * sum,
+	struct bit_frame_stats * fs)
+{
+	static const unsigned char zero[BIT_FRAME_BYTES];
+	struct bit_frame_slot * table, * t;
+	const unsigned char * frame;
+	struct bit_parser bp;
+	struct bit_packet pkt;
+	struct bit_mfwr m;
+	size_t i, size = 16;
+	
+	memset(fs, 0, sizeof(struct bit_frame_stats));
+	fs->bytes = n;
+	fs->mfwr_bytes = n;
+	
+	while(size < 2 * (sum->fdri_words / BIT_FRAME_WORDS + 1))
+		size *= 2;
+	if((table = calloc(size, sizeof(struct bit_frame_slot))) == NULL)
+		return 1;
+	
+	bit_parser_init(&bp, p, sum->end_offset);
+	while(bit_next_packet(&bp, &pkt) > 0)
+	{
+		if((pkt.op != BIT_OP_WRITE) || (pkt.reg != BIT_REG_FDRI) || (pkt.words < 2 * BIT_FRAME_WORDS))
+			continue;
+		
+		for(i = 0; i + 1 < pkt.words / BIT_FRAME_WORDS; i++)
+		{
+			frame = &pkt.data[i * BIT_FRAME_BYTES];
+			if(memcmp(frame, zero, BIT_FRAME_BYTES) == 0)
+				fs->zero++;
+			
+			t = bit_frame_find(table, size - 1, frame);
+			if(t->frame == NULL)
+				t->frame = frame;
+			else
+				fs->repeats++;
+			fs->frames++;
+		}
+	}
+	free(table);
+	
+	if(bit_mfwr(p, n, sum, NULL, NULL, &m))
+		return 1;
+	if(m.placed > 0)
+		fs->mfwr_bytes = m.length;
+	
+	return 0;
+}
+
+// readback is compared as it arrives, so the common case of a block with
+// no difference is a single compare against zero
+size_t bit_compare(const unsigned char * a, const unsigned char * b, const unsigned char * mask, size_t n)
+{
+	size_t i = 0, bits = 0;
+	
+#ifdef __SSE2__
+	const __m128i z = _mm_setzero_si128();
+	uint64_t lanes[2];
+	__m128i x;
+	
+	for(; i + 16 <= n; i += 16)
+	{
+		x = _mm_xor_si128(_mm_loadu_si128((const __m128i *)&a[i]), _mm_loadu_si128((const __m128i *)&b[i]));
+		if(mask != NULL)
+			x = _mm_andnot_si128(_mm_loadu_si128((const __m128i *)&mask[i]), x);
+		if(_mm_movemask_epi8(_mm_cmpeq_epi8(x, z)) == 0xffff)
+			continue;
+		_mm_storeu_si128((__m128i *)lanes, x);
+		bits += __builtin_popcountll(lanes[0]) + __builtin_popcountll(lanes[1]);
+	}
+#endif
+	
+	for(; i < n; i++)
+		bits += __builtin_popcount((a[i] ^ b[i]) & ((mask != NULL) ? ~mask[i] : 0xff) & 0xff);
+	
+	return bits;
+}
@@ -0,0 +1,366 @@
+/*
+Spartan 6 bitstream formats: the parts of the family and their idcodes,
+the .bit container ISE wraps the configuration data in, and the packets
+the configuration data itself is made of.
+*/
+
+#ifndef BITSTREAM_H
+#define BITSTREAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// the top four bits of an idcode are the silicon version, which is not
+// part of what a bitstream is built for
+#define BIT_IDCODE_MASK (0x0fffffff)
+
+// longest string kept from each text field of a .bit header
+#define BIT_FIELD_SIZE (128)
+
+struct bit_part
+{
+	// as in a .bit file, without the "xc" prefix
+	const char * name;
+	uint32_t idcode;
+};
+
+// every Spartan 6 part, ending with a NULL name
+extern const struct bit_part bit_parts[];
+
+// the part with 'idcode', ignoring the version bits, or NULL
+const struct bit_part * bit_part_by_idcode(uint32_t idcode);
+
+// the part that a .bit file part field such as "6slx45csg324" is for,
+// or NULL
+const struct bit_part * bit_part_by_name(const char * name);
+
+/*
+ A .bit file starts with a fixed 13 byte preamble followed by fields of
+ a one letter key, a big endian length and the value:
+
+  'a' 16 bit length, design name and options
+  'b' 16 bit length, part and package
+  'c' 16 bit length, date
+  'd' 16 bit length, time
+  'e' 32 bit length, configuration data, the same bytes as a .bin file
+*/
+
+struct bit_header
+{
+	char design[BIT_FIELD_SIZE];
+	char part[BIT_FIELD_SIZE];
+	char date[BIT_FIELD_SIZE];
+	char time[BIT_FIELD_SIZE];
+	
+	// where the configuration data starts in the file, and its length
+	size_t data_offset;
+	size_t data_length;
+};
+
+// non-zero if the 'n' bytes at 'p' start with the .bit preamble
+int bit_is_bit_file(const unsigned char * p, size_t n);
+
+// parse the header of the .bit file whose first 'n' bytes are at 'p',
+// up to the start of the configuration data. the data itself need not
+// be within the 'n' bytes. returns 1 if the header is bad or cut short.
+int bit_parse_header(const unsigned char * p, size_t n, struct bit_header * hdr);
+
+/*
+ The configuration data is a stream of big endian 16 bit words. Dummy
+ words pad it out until the sync word, after which it is packets of a
+ header word and the words written to or read from a register:
+
+  type 1  001 op[12:11] reg[10:5] count[4:0], 'count' words follow
+  type 2  010 op[12:11] reg[10:5] 00000, then a 32 bit count of words,
+          for the bulk frame data
+
+ A type 2 header with no register goes to the register of the type 1
+ packet before it. After a DESYNC command the FPGA ignores everything
+ until the next sync word.
+*/
+
+#define BIT_SYNC_WORD (0xaa995566)
+
+#define BIT_OP_NOP (0)
+#define BIT_OP_READ (1)
+#define BIT_OP_WRITE (2)
+
+#define BIT_REG_CRC (0x00)
+#define BIT_REG_FAR_MAJ (0x01)
+#define BIT_REG_FAR_MIN (0x02)
+#define BIT_REG_FDRI (0x03)
+#define BIT_REG_FDRO (0x04)
+#define BIT_REG_CMD (0x05)
+#define BIT_REG_IDCODE (0x0e)
+#define BIT_REG_MFWR (0x1b)
+#define BIT_NUM_REGS (0x23)
+
+#define BIT_CMD_NULL (0x00)
+#define BIT_CMD_WCFG (0x01)
+#define BIT_CMD_MFW (0x02)
+#define BIT_CMD_LFRM (0x03)
+#define BIT_CMD_RCFG (0x04)
+#define BIT_CMD_START (0x05)
+#define BIT_CMD_RCRC (0x07)
+#define BIT_CMD_DESYNC (0x0d)
+#define BIT_CMD_IPROG (0x0e)
+
+// the name of configuration register 'reg', or NULL
+const char * bit_register_name(int reg);
+
+// the offset of the first sync word in the 'n' bytes at 'p', or 'n' if
+// there is none
+size_t bit_find_sync(const unsigned char * p, size_t n);
+
+struct bit_packet
+{
+	int op;
+	int reg;
+	
+	// where the header starts, and the words after it
+	size_t offset;
+	const unsigned char * data;
+	size_t words;
+};
+
+struct bit_parser
+{
+	const unsigned char * p;
+	size_t n;
+	size_t i;
+	int reg;
+};
+
+// start parsing the 'n' bytes of configuration data at 'p' after its
+// first sync word. returns 1 if there is no sync word.
+int bit_parser_init(struct bit_parser * bp, const unsigned char * p, size_t n);
+
+// the next packet into 'pkt'. returns 1 for a packet, 0 at the end of
+// the data, -1 for a bad header and -2 for a packet that runs past the
+// end (pkt->offset says where the bad packet is).
+int bit_next_packet(struct bit_parser * bp, struct bit_packet * pkt);
+
+// what the configuration data does, as far as checking it goes
+struct bit_summary
+{
+	// where the sync word is, and where the packets end: after the
+	// DESYNC command, or at the end of the data if there is none
+	size_t sync_offset;
+	size_t end_offset;
+	
+	// the idcode written to the IDCODE register, if any
+	int has_idcode;
+	uint32_t idcode;
+	
+	// words written to FDRI, writes to the CRC register and the
+	// commands written, one bit each
+	size_t fdri_words;
+	int crc_writes;
+	uint32_t commands;
+	
+	int packets;
+};
+
+// parse the packets of the 'n' bytes of configuration data at 'p' into
+// 'sum'. if 'partial' is set the bytes are only the start of the data,
+// and a packet running past them ends the parse rather than failing it.
+// returns 1 if the data is not a valid configuration bitstream.
+int bit_check_packets(const unsigned char * p, size_t n, int partial, struct bit_summary * sum);
+
+/*
+ Trimming drops the bytes of checked configuration data that the
+ configuration logic has no use for: the dummy words before the sync
+ word, all but the last BIT_TRIM_DUMMY_BYTES of them, NOOP runs beyond
+ BIT_TRIM_NOOPS words, and everything after the DESYNC command past
+ BIT_TRIM_NOOPS words, which is left to flush it through.
+*/
+
+#define BIT_TRIM_DUMMY_BYTES (4)
+#define BIT_TRIM_NOOPS (8)
+
+struct bit_trim
+{
+	// the data kept runs from 'start' to 'end', less 'cut' bytes of
+	// NOOPs between the two
+	size_t start;
+	size_t end;
+	size_t cut;
+};
+
+// work out how to trim the 'n' bytes of configuration data at 'p',
+// checked into 'sum', and if 'out' is not NULL copy the trimmed data
+// there (t->end - t->start - t->cut bytes). returns the trimmed length.
+size_t bit_trim(const unsigned char * p, size_t n, const struct bit_summary * sum,
+	struct bit_trim * t, unsigned char * out);
+
+/*
+ FDRI data is a run of frames of BIT_FRAME_WORDS words, each written to
+ the frame address after the one before. The last frame of each FDRI
+ write only pushes the one before it out of the frame buffer and is
+ not written anywhere.
+
+ A frame address is FAR_MAJ in its top half, with the block type, row
+ and major column, and FAR_MIN below it, with the minor frame of the
+ column. Which address follows which depends on how many rows each block
+ type has, how many columns each row and how many frames each column,
+ which differ from part to part. A geometry file gives them, one line
+ for each block type and '#' starting a comment:
+
+  idcode 0x04008093
+  block 0 rows 4 minors 2 31*12 30 ...
+
+ where the minors are the frames of each column in turn, with 'n*c'
+ standing for 'c' columns of 'n' frames. The idcode, if given, is the
+ part the layout is for. Without a layout, and past the end of one,
+ addresses simply count up.
+*/
+
+#define BIT_FRAME_WORDS (65)
+#define BIT_FRAME_BYTES (BIT_FRAME_WORDS * 2)
+
+#define BIT_GEOMETRY_BLOCKS (16)
+#define BIT_GEOMETRY_ROWS (16)
+#define BIT_GEOMETRY_MAJORS (256)
+#define BIT_GEOMETRY_MINORS (1024)
+
+#define BIT_FAR(block, row, major, minor) (((uint32_t)(block) << 28) | ((uint32_t)(row) << 24) | \
+	((uint32_t)(major) << 16) | (uint32_t)(minor))
+#define BIT_FAR_BLOCK(far) (((far) >> 28) & 0x0f)
+#define BIT_FAR_ROW(far) (((far) >> 24) & 0x0f)
+#define BIT_FAR_MAJOR(far) (((far) >> 16) & 0xff)
+#define BIT_FAR_MINOR(far) ((far) & 0x3ff)
+
+struct bit_geometry
+{
+	// the part the layout is for, without the version bits, or 0
+	uint32_t idcode;
+	
+	// the rows of each block type (0 for none), the columns in each row
+	// and the frames in each column
+	int rows[BIT_GEOMETRY_BLOCKS];
+	int majors[BIT_GEOMETRY_BLOCKS];
+	uint16_t minors[BIT_GEOMETRY_BLOCKS][BIT_GEOMETRY_MAJORS];
+};
+
+// read the geometry file 'filename' into 'g'. returns 1 if it can not be
+// read or is not valid.
+int bit_geometry_load(const char * filename, struct bit_geometry * g);
+
+// the frame address after 'far' in the layout 'g', which may be NULL
+uint32_t bit_far_next(const struct bit_geometry * g, uint32_t far);
+
+/*
+ A frame repeated elsewhere in an FDRI write (most often all zero, for
+ unused fabric) can instead be placed by a multi-frame write, which
+ copies the frame buffer to the address in FAR: BIT_MFWR_WORDS words to
+ set FAR and write MFWR, in place of the whole frame. Leaving FDRI for a
+ run of them costs BIT_MFWR_BREAK_WORDS more, for the pad frame and the
+ headers to start it again after.
+
+ Each distinct frame placed this way has to be loaded into the frame
+ buffer first, by an FDRI write of its own to the first address it goes
+ to, BIT_MFWR_LOAD_WORDS for FAR and the FDRI headers, the frame and a
+ pad frame. The MFW command then turns the following MFWR writes on,
+ and the WCFG command turns them off again for the next load.
+
+ bit_mfwr rewrites the data so. Within each FDRI write, the frames with
+ enough copies to pay for their load are taken out wherever they run
+ long enough to pay for the break in FDRI. What is left is written in
+ runs by FAR and FDRI, then each frame taken out is loaded once and
+ copied to the rest of its addresses, then FAR is set to where the
+ original write would have left it. A write that would not come out
+ shorter is kept as it is. The CRC writes are dropped, since the
+ registers written are not those the CRC was worked out over.
+*/
+
+#define BIT_MFWR_WORDS (8)
+#define BIT_MFWR_BREAK_WORDS (BIT_FRAME_WORDS + 6)
+#define BIT_MFWR_LOAD_WORDS (2 * BIT_FRAME_WORDS + 6)
+#define BIT_MFWR_CMD_WORDS (2)
+
+struct bit_mfwr
+{
+	// the length of the rewritten data, the frames placed by MFWR and
+	// the distinct frames loaded for them. with none placed the data is
+	// best left as it is.
+	size_t length;
+	size_t placed;
+	size_t loads;
+};
+
+// rewrite the 'n' bytes of configuration data at 'p', checked into
+// 'sum', with multi-frame writes for the frame layout 'g' (NULL for
+// addresses that count up) into 'out', or if 'out' is NULL only work out
+// 'm'. 'out' must have room for m->length bytes, which is never more
+// than 'n'. returns 1 if out of memory.
+int bit_mfwr(const unsigned char * p, size_t n, const struct bit_summary * sum, const struct bit_geometry * g,
+	unsigned char * out, struct bit_mfwr * m);
+
+struct bit_frame_stats
+{
+	// frames written by FDRI, not counting the pad frames, those that
+	// are all zero and those that repeat an earlier frame (zero or not)
+	size_t frames;
+	size_t zero;
+	size_t repeats;
+	
+	// the configuration data as it is, and as bit_mfwr rewrites it
+	size_t bytes;
+	size_t mfwr_bytes;
+};
+
+// the hash of the frame at 'frame'
+uint64_t bit_frame_hash(const unsigned char * frame);
+
+// the hash of each frame in the FDRI writes of the configuration data
+// at 'p', checked into 'sum', in a new array at 'hashes' of 'frames'
+// entries. returns 1 if out of memory.
+int bit_frame_hashes(const unsigned char * p, const struct bit_summary * sum, uint64_t ** hashes, size_t * frames);
+
+// the frame address of each of the same frames in the layout 'g' (NULL
+// for addresses that count up), in a new array at 'fars'. returns 1 if
+// out of memory.
+int bit_frame_addresses(const unsigned char * p, const struct bit_summary * sum, const struct bit_geometry * g,
+	uint32_t ** fars, size_t * frames);
+
+// the number of frames that differ between two lists of frame hashes
+// (all of them if the lists differ in length). if 'changed' is not NULL
+// its 'nb' entries are set to 1 for each frame of 'b' that differs and
+// to 0 for the others.
+size_t bit_frame_diff(const uint64_t * a, size_t na, const uint64_t * b, size_t nb, unsigned char * changed);
+
+/*
+ A partial bitstream writes only some of the frames: each FDRI write of
+ the configuration data is replaced by a FAR and FDRI write for each run
+ of the frames to keep, each with a pad frame, and a FAR write of where
+ the original write would have left it. The rest of the packets are
+ kept, but for the CRC writes, which no longer match.
+*/
+
+// write the 'n' bytes of configuration data at 'p', checked into 'sum',
+// as a partial bitstream of the frames set in 'changed' (one entry for
+// each frame, as bit_frame_hashes lists them) for the layout 'g' into
+// 'out', or only work out its length if 'out' is NULL. returns 1 if an
+// FDRI write is not a whole number of frames.
+int bit_partial(const unsigned char * p, size_t n, const struct bit_summary * sum, const struct bit_geometry * g,
+	const unsigned char * changed, unsigned char * out, size_t * length);
+
+// count the frames in the FDRI writes of the 'n' bytes of configuration
+// data at 'p', checked into 'sum', and the size bit_mfwr rewrites it to.
+// returns 1 if out of memory.
+int bit_frame_stats(const unsigned char * p, size_t n, const struct bit_summary * sum,
+	struct bit_frame_stats * fs);
+
+/*
+ Readback shifts the frames from a frame address out of FDRO, after a
+ pad frame of its own. A mask (the .msk file bitgen writes next to the
+ bitstream) has the same packets as the bitstream, with a 1 in its
+ frame data for each bit that is not expected to read back as written,
+ such as the contents of LUT RAMs and the state of flip flops.
+*/
+
+// the number of bits that differ between the 'n' bytes at 'a' and 'b',
+// leaving out those set in the 'n' bytes at 'mask' if it is not NULL
+size_t bit_compare(const unsigned char * a, const unsigned char * b, const unsigned char * mask, size_t n);
+
+#endif
@@ -0,0 +1,485 @@
+/*
+Compressed bitstreams. See decompress.h.
+
+Each format is built in when HAVE_DECOMPRESS_<FORMAT> is defined, see
+DECOMPRESSORS in the Makefile.
+*/
+
+#include "decompress.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#ifdef HAVE_DECOMPRESS_GZIP
+#include <zlib.h>
+#endif
+#ifdef HAVE_DECOMPRESS_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_DECOMPRESS_LZ4
+#include <lz4frame.h>
+#endif
+
+// read the next piece of compressed input from 'fd' into 'buf', or
+// return 0 if there is no more. -1 on error.
+static ssize_t decompress_input(int fd, unsigned char * buf)
+{
+	ssize_t n;
+	
+	if(fd < 0)
+		return 0;
+	
+	do
+		n = read(fd, buf, DECOMPRESS_IO_SIZE);
+	while((n < 0) && (errno == EINTR));
+	
+	return n;
+}
+
+#ifdef HAVE_DECOMPRESS_GZIP
+
+static int gzip_match(const unsigned char * p, size_t n)
+{
+	return (n >= 2) && (p[0] == 0x1f) && (p[1] == 0x8b);
+}
+
+// concatenated gzip members are decompressed one after another, as
+// gunzip does
+static int gzip_run(int fd, const unsigned char * head, size_t n, decompress_out out, void * arg)
+{
+	unsigned char * in, * buf;
+	int ret = 1, end = 0, z_ret;
+	z_stream z;
+	ssize_t r;
+	
+	in = malloc(DECOMPRESS_IO_SIZE);
+	buf = malloc(DECOMPRESS_IO_SIZE);
+	memset(&z, 0, sizeof(z));
+	if((in == NULL) || (buf == NULL) || (inflateInit2(&z, 16 + MAX_WBITS) != Z_OK))
+	{
+		free(in);
+		free(buf);
+		return 1;
+	}
+	
+	z.next_in = (unsigned char *)head;
+	z.avail_in = n;
+	
+	for(;;)
+	{
+		if(z.avail_in == 0)
+		{
+			if((r = decompress_input(fd, in)) < 0)
+				break;
+			if(r == 0)
+			{
+				// the end of the input must be the end of a member
+				if(end)
+					ret = 0;
+				else
+					printf("error: gzip_run: compressed data is cut short\n");
+				break;
+			}
+			z.next_in = in;
+			z.avail_in = r;
+		}
+		
+		if(end)
+		{
+			inflateReset(&z);
+			end = 0;
+		}
+		
+		z.next_out = buf;
+		z.avail_out = DECOMPRESS_IO_SIZE;
+		z_ret = inflate(&z, Z_NO_FLUSH);
+		if((z_ret != Z_OK) && (z_ret != Z_STREAM_END) && (z_ret != Z_BUF_ERROR))
+		{
+			printf("error: gzip_run: %s\n", (z.msg != NULL) ? z.msg : "bad compressed data");
+			break;
+		}
+		end = (z_ret == Z_STREAM_END);
+		
+		if(out(arg, buf, DECOMPRESS_IO_SIZE - z.avail_out))
+			break;
+	}
+	
+	inflateEnd(&z);
+	free(in);
+	free(buf);
+	
+	return ret;
+}
+
+#endif
+
+#ifdef HAVE_DECOMPRESS_ZSTD
+
+static int zstd_match(const unsigned char * p, size_t n)
+{
+	return (n >= 4) && (p[0] == 0x28) && (p[1] == 0xb5) && (p[2] == 0x2f) && (p[3] == 0xfd);
+}
+
+static int zstd_run(int fd, const unsigned char * head, size_t n, decompress_out out, void * arg)
+{
+	ZSTD_inBuffer zin = {head, n, 0};
+	ZSTD_outBuffer zout;
+	ZSTD_DStream * ds;
+	unsigned char * in, * buf;
+	size_t z_ret = 0;
+	int ret = 1;
+	ssize_t r;
+	
+	in = malloc(DECOMPRESS_IO_SIZE);
+	buf = malloc(DECOMPRESS_IO_SIZE);
+	if((in == NULL) || (buf == NULL) || ((ds = ZSTD_createDStream()) == NULL))
+	{
+		free(in);
+		free(buf);
+		return 1;
+	}
+	ZSTD_initDStream(ds);
+	
+	for(;;)
+	{
+		if(zin.pos == zin.size)
+		{
+			if((r = decompress_input(fd, in)) < 0)
+				break;
+			if(r == 0)
+			{
+				// 0 from ZSTD_decompressStream means a frame was finished
+				if(z_ret == 0)
+					ret = 0;
+				else
+					printf("error: zstd_run: compressed data is cut short\n");
+				break;
+			}
+			zin.src = in;
+			zin.size = r;
+			zin.pos = 0;
+		}
+		
+		zout.dst = buf;
+		zout.size = DECOMPRESS_IO_SIZE;
+		zout.pos = 0;
+		z_ret = ZSTD_decompressStream(ds, &zout, &zin);
+		if(ZSTD_isError(z_ret))
+		{
+			printf("error: zstd_run: %s\n", ZSTD_getErrorName(z_ret));
+			break;
+		}
+		
+		if(out(arg, buf, zout.pos))
+			break;
+	}
+	
+	ZSTD_freeDStream(ds);
+	free(in);
+	free(buf);
+	
+	return ret;
+}
+
+#endif
+
+#ifdef HAVE_DECOMPRESS_LZ4
+
+static int lz4_match(const unsigned char * p, size_t n)
+{
+	return (n >= 4) && (p[0] == 0x04) && (p[1] == 0x22) && (p[2] == 0x4d) && (p[3] == 0x18);
+}
+
+static int lz4_run(int fd, const unsigned char * head, size_t n, decompress_out out, void * arg)
+{
+	LZ4F_dctx * ctx;
+	const unsigned char * src = head;
+	unsigned char * in, * buf;
+	size_t src_left = n, src_size, dst_size, z_ret = 0;
+	int ret = 1;
+	ssize_t r;
+	
+	in = malloc(DECOMPRESS_IO_SIZE);
+	buf = malloc(DECOMPRESS_IO_SIZE);
+	if((in == NULL) || (buf == NULL) || LZ4F_isError(LZ4F_createDecompressionContext(&ctx, LZ4F_VERSION)))
+	{
+		free(in);
+		free(buf);
+		return 1;
+	}
+	
+	for(;;)
+	{
+		if(src_left == 0)
+		{
+			if((r = decompress_input(fd, in)) < 0)
+				break;
+			if(r == 0)
+			{
+				// 0 from LZ4F_decompress means a frame was finished
+				if(z_ret == 0)
+					ret = 0;
+				else
+					printf("error: lz4_run: compressed data is cut short\n");
+				break;
+			}
+			src = in;
+			src_left = r;
+		}
+		
+		src_size = src_left;
+		dst_size = DECOMPRESS_IO_SIZE;
+		z_ret = LZ4F_decompress(ctx, buf, &dst_size, src, &src_size, NULL);
+		if(LZ4F_isError(z_ret))
+		{
+			printf("error: lz4_run: %s\n", LZ4F_getErrorName(z_ret));
+			break;
+		}
+		src += src_size;
+		src_left -= src_size;
+		
+		if(out(arg, buf, dst_size))
+			break;
+	}
+	
+	LZ4F_freeDecompressionContext(ctx);
+	free(in);
+	free(buf);
+	
+	return ret;
+}
+
+#endif
+
+const struct decompressor decompressors[] = {
+#ifdef HAVE_DECOMPRESS_GZIP
+	{"gzip", gzip_match, gzip_run},
+#endif
+#ifdef HAVE_DECOMPRESS_ZSTD
+	{"zstd", zstd_match, zstd_run},
+#endif
+#ifdef HAVE_DECOMPRESS_LZ4
+	{"lz4", lz4_match, lz4_run},
+#endif
+	{NULL, NULL, NULL}
+};
+
+const struct decompressor * decompressor_find(const unsigned char * p, size_t n)
+{
+	const struct decompressor * d;
+	
+	for(d = decompressors; d->name != NULL; d++)
+		if(d->match(p, n))
+			return d;
+	
+	return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////
+// decompression thread
+////////////////////////////////////////////////////////////////////////
+
+/*
+ The thread fills a ring of DECOMPRESS_NUM_BLOCKS blocks and the reader
+ empties them in order. 'filled' and 'consumed' count whole blocks; the
+ block at 'filled' is the one being filled and the block at 'consumed'
+ the one being read, and neither side touches the other's block.
+*/
+
+struct decompress_thread
+{
+	const struct decompressor * d;
+	int fd;
+	unsigned char * head;
+	size_t head_length;
+	
+	unsigned char * block[DECOMPRESS_NUM_BLOCKS];
+	size_t length[DECOMPRESS_NUM_BLOCKS];
+	unsigned int filled;
+	unsigned int consumed;
+	size_t pos;
+	
+	// set by the thread when it has finished, and by the reader to ask
+	// it to give up early
+	int done;
+	int error;
+	int stop;
+	
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+};
+
+// hand the block being filled to the reader and wait for a free one
+static int decompress_publish(struct decompress_thread * t)
+{
+	pthread_mutex_lock(&t->lock);
+	t->filled++;
+	pthread_cond_broadcast(&t->cond);
+	while(!t->stop && (t->filled - t->consumed >= DECOMPRESS_NUM_BLOCKS))
+		pthread_cond_wait(&t->cond, &t->lock);
+	pthread_mutex_unlock(&t->lock);
+	
+	return t->stop;
+}
+
+static int decompress_out_block(void * arg, const unsigned char * buf, size_t n)
+{
+	struct decompress_thread * t = arg;
+	unsigned int i;
+	size_t m;
+	
+	while(n > 0)
+	{
+		i = t->filled % DECOMPRESS_NUM_BLOCKS;
+		m = DECOMPRESS_BLOCK_SIZE - t->length[i];
+		if(m > n)
+			m = n;
+		memcpy(t->block[i] + t->length[i], buf, m);
+		t->length[i] += m;
+		buf += m;
+		n -= m;
+		
+		if((t->length[i] == DECOMPRESS_BLOCK_SIZE) && decompress_publish(t))
+			return 1;
+	}
+	
+	return 0;
+}
+
+static void * decompress_main(void * arg)
+{
+	struct decompress_thread * t = arg;
+	int ret;
+	
+	ret = t->d->run(t->fd, t->head, t->head_length, decompress_out_block, t);
+	
+	// the last block is usually partly filled
+	pthread_mutex_lock(&t->lock);
+	if(t->length[t->filled % DECOMPRESS_NUM_BLOCKS] > 0)
+		t->filled++;
+	
+	// stopping early because the reader asked to is not a failure
+	t->error = ret && !t->stop;
+	t->done = 1;
+	pthread_cond_broadcast(&t->cond);
+	pthread_mutex_unlock(&t->lock);
+	
+	return NULL;
+}
+
+struct decompress_thread * decompress_start(const struct decompressor * d, int fd,
+	const unsigned char * head, size_t n)
+{
+	struct decompress_thread * t;
+	int i;
+	
+	if((t = calloc(1, sizeof(struct decompress_thread))) == NULL)
+		return NULL;
+	
+	t->d = d;
+	t->fd = fd;
+	t->head = malloc(n);
+	t->head_length = n;
+	for(i = 0; i < DECOMPRESS_NUM_BLOCKS; i++)
+		t->block[i] = malloc(DECOMPRESS_BLOCK_SIZE);
+	pthread_mutex_init(&t->lock, NULL);
+	pthread_cond_init(&t->cond, NULL);
+	
+	for(i = 0; i < DECOMPRESS_NUM_BLOCKS; i++)
+		if(t->block[i] == NULL)
+			break;
+	if((t->head == NULL) || (i < DECOMPRESS_NUM_BLOCKS))
+	{
+		t->done = 1;
+		decompress_finish(t);
+		return NULL;
+	}
+	memcpy(t->head, head, n);
+	
+	if(pthread_create(&t->thread, NULL, decompress_main, t))
+	{
+		printf("error: decompress_start: could not start thread\n");
+		t->thread = 0;
+		t->done = 1;
+		decompress_finish(t);
+		return NULL;
+	}
+	
+	return t;
+}
+
+ssize_t decompress_read(struct decompress_thread * t, unsigned char * buf, size_t size)
+{
+	size_t length = 0, m;
+	unsigned int i;
+	int error = 0;
+	
+	while(length < size)
+	{
+		pthread_mutex_lock(&t->lock);
+		while((t->consumed == t->filled) && !t->done)
+			pthread_cond_wait(&t->cond, &t->lock);
+		error = t->error;
+		if((t->consumed == t->filled) || error)
+		{
+			pthread_mutex_unlock(&t->lock);
+			break;
+		}
+		pthread_mutex_unlock(&t->lock);
+		
+		// the block at 'consumed' belongs to the reader until it is
+		// given back
+		i = t->consumed % DECOMPRESS_NUM_BLOCKS;
+		m = t->length[i] - t->pos;
+		if(m > size - length)
+			m = size - length;
+		memcpy(buf + length, t->block[i] + t->pos, m);
+		t->pos += m;
+		length += m;
+		
+		if(t->pos == t->length[i])
+		{
+			pthread_mutex_lock(&t->lock);
+			t->length[i] = 0;
+			t->pos = 0;
+			t->consumed++;
+			pthread_cond_broadcast(&t->cond);
+			pthread_mutex_unlock(&t->lock);
+		}
+	}
+	
+	if(error)
+		return -1;
+	return length;
+}
+
+int decompress_finish(struct decompress_thread * t)
+{
+	int i, ret;
+	
+	if(t == NULL)
+		return 0;
+	
+	pthread_mutex_lock(&t->lock);
+	t->stop = 1;
+	pthread_cond_broadcast(&t->cond);
+	pthread_mutex_unlock(&t->lock);
+	
+	if(t->thread)
+		pthread_join(t->thread, NULL);
+	ret = t->error;
+	
+	pthread_mutex_destroy(&t->lock);
+	pthread_cond_destroy(&t->cond);
+	for(i = 0; i < DECOMPRESS_NUM_BLOCKS; i++)
+		free(t->block[i]);
+	free(t->head);
+	free(t);
+	
+	return ret;
+}
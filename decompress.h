@@ -0,0 +1,58 @@
+/*
+Compressed bitstreams. Each format built in has an entry in
+decompressors[], found by the magic number at the start of the data.
+
+A decompress_thread decompresses a stream on a thread of its own, a
+block at a time, so that the decompression overlaps with the shift that
+reads from it. Memory use is a few blocks whatever the size of the
+stream.
+*/
+
+#ifndef DECOMPRESS_H
+#define DECOMPRESS_H
+
+#include <sys/types.h>
+#include <stddef.h>
+
+#define DECOMPRESS_IO_SIZE (64 * 1024)
+#define DECOMPRESS_BLOCK_SIZE (256 * 1024)
+#define DECOMPRESS_NUM_BLOCKS (4)
+
+// called with each piece of decompressed data, returns non-zero to stop
+typedef int (*decompress_out)(void * arg, const unsigned char * buf, size_t n);
+
+struct decompressor
+{
+	const char * name;
+	
+	// non-zero if the 'n' bytes at 'p' start data in this format
+	int (*match)(const unsigned char * p, size_t n);
+	
+	// decompress the 'n' bytes at 'head' and then the rest of 'fd' (if
+	// it is not -1), passing the output to 'out'. returns 1 if the data
+	// is bad or cut short.
+	int (*run)(int fd, const unsigned char * head, size_t n, decompress_out out, void * arg);
+};
+
+// every format built in, ending with a NULL name
+extern const struct decompressor decompressors[];
+
+// the format the 'n' bytes at 'p' are in, NULL if not compressed
+const struct decompressor * decompressor_find(const unsigned char * p, size_t n);
+
+struct decompress_thread;
+
+// start decompressing 'fd' with 'd', the first 'n' bytes of it already
+// having been read into 'head'
+struct decompress_thread * decompress_start(const struct decompressor * d, int fd,
+	const unsigned char * head, size_t n);
+
+// read up to 'size' bytes of decompressed data into 'buf', fewer only
+// at the end. returns the number read or -1 if decompression failed.
+ssize_t decompress_read(struct decompress_thread * t, unsigned char * buf, size_t size);
+
+// stop the thread if it is still running and free it. returns 1 if
+// decompression failed.
+int decompress_finish(struct decompress_thread * t);
+
+#endif
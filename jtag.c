@@ -0,0 +1,1202 @@
+/*
+JTAG through the MPSSE engine of an FT232H, for Spartan 6 FPGAs. See
+jtag.h.
+*/
+
+#include "jtag.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+/*
+ FT2232H pin definitions
+
+ pin	| name		| mpsse function
+ -------+-----------+---------------
+ 13		| ADBUS0	| TCK
+ 14		| ADBUS1	| TDI
+ 15		| ADBUS2	| TDO
+ 16		| ADBUS3	| TMS
+ 17		| ADBUS4	| GPIOL0
+ 18		| ADBUS5	| GPIOL1
+ 19		| ADBUS6	| GPIOL2
+ 20		| ADBUS7	| GPIOL3
+		|			|
+ 21		| ACBUS0	| GPIOH0
+ 25		| ACBUS1	| GPIOH1
+ 26		| ACBUS2	| GPIOH2
+ 27		| ACBUS3	| GPIOH3
+ 28		| ACBUS4	| GPIOH4
+ 29		| ACBUS5	| GPIOH5
+ 30		| ACBUS6	| GPIOH6
+ 31		| ACBUS7	| GPIOH7
+
+ 0 is LSB, 7 is MSB
+
+
+ *** MPSSE mode commands ***
+
+ * SET_BITS_LOW, data, direction
+    sets low port bits and direction
+ * SET_BITS_HIGH, data, direction
+    sets high port bits and direction
+ * TCK_DIVISOR, div_low, div_high
+    sets the TCK divisor to {div_high, div_low}
+    rate = 60e6 / ((value + 1) * 2)
+ * SEND_IMMEDIATE
+    immediately send whatever data is in the ftdi device's buffer to
+    the host.
+
+
+ *** MPSSE shifting commands ***
+
+ bit mode format:
+  {shifting command,
+   length in bits,
+   data byte}
+
+ byte mode format:
+  {shifting command,
+   length in bytes high,
+   length in bytes low,
+   data byte 0,
+   ...,
+   data byte n}
+
+ shifting command byte:
+  MPSSE_WRITE_NEG 0x01   Write TDI/DO on negative TCK/SK edge
+  MPSSE_BITMODE   0x02   Write bits, not bytes
+  MPSSE_READ_NEG  0x04   Sample TDO/DI on negative TCK/SK edge
+  MPSSE_LSB       0x08   LSB first
+  MPSSE_DO_WRITE  0x10   Write TDI/DO
+  MPSSE_DO_READ   0x20   Read TDO/DI
+  MPSSE_WRITE_TMS 0x40   Write TMS/CS
+
+  * MPSSE_DO_WRITE and MPSSE_WRITE_TMS cannot both be set
+  * cannot read and write on the same clock edge
+
+*/
+
+
+////////////////////////////////////////////////////////////////////////
+// low level jtag and ftdi device functions
+////////////////////////////////////////////////////////////////////////
+
+
+// clear a session and set the default encoder settings. no device is
+// opened until jtag_init.
+void jtag_defaults(struct jtag * jtag)
+{
+	memset(jtag, 0, sizeof(struct jtag));
+	jtag->chunk_size = JTAG_CHUNK_SIZE;
+	jtag->zero_copy = 1;
+}
+
+// sender thread, writes filled buffers to the device in order
+static void * jtag_sender_main(void * arg)
+{
+	struct jtag * jtag = arg;
+	struct transport_iov * seg;
+	unsigned int t;
+	int nseg, length, i;
+	
+	for(;;)
+	{
+		sem_wait(&jtag->ring_used);
+		t = atomic_load_explicit(&jtag->ring_tail, memory_order_relaxed);
+		seg = jtag->ring_seg[t % JTAG_NUM_BUFFERS];
+		nseg = jtag->ring_nseg[t % JTAG_NUM_BUFFERS];
+		
+		// a negative segment count asks the sender to exit
+		if(nseg < 0)
+			break;
+		
+		// gathered, the staged commands share usb transfers with the
+		// data queued by reference between them
+		if(jtag->tp->writev != NULL)
+		{
+			for(i = 0, length = 0; i < nseg; i++)
+				length += seg[i].length;
+			if(jtag->tp->writev(jtag->tp, seg, nseg) != length)
+				atomic_store(&jtag->ring_error, 1);
+		} else
+			for(i = 0; i < nseg; i++)
+				if(jtag->tp->write(jtag->tp, seg[i].p, seg[i].length) != seg[i].length)
+					atomic_store(&jtag->ring_error, 1);
+		
+		atomic_store_explicit(&jtag->ring_tail, t + 1, memory_order_release);
+		sem_post(&jtag->ring_free);
+	}
+	
+	return NULL;
+}
+
+// segment list of the slot currently being filled
+#define jtag_cur_seg(jtag) ((jtag)->ring_seg[atomic_load_explicit(&(jtag)->ring_head, memory_order_relaxed) % JTAG_NUM_BUFFERS])
+#define jtag_cur_nseg(jtag) ((jtag)->ring_nseg[atomic_load_explicit(&(jtag)->ring_head, memory_order_relaxed) % JTAG_NUM_BUFFERS])
+
+// close off the bytes staged in jtag->buf since the last segment
+static void jtag_end_seg(struct jtag * jtag)
+{
+	if(jtag->buf_i > jtag->buf_seg)
+	{
+		jtag_cur_seg(jtag)[jtag_cur_nseg(jtag)].p = &jtag->buf[jtag->buf_seg];
+		jtag_cur_seg(jtag)[jtag_cur_nseg(jtag)].length = jtag->buf_i - jtag->buf_seg;
+		jtag_cur_seg(jtag)[jtag_cur_nseg(jtag)].ref = 0;
+		jtag_cur_nseg(jtag)++;
+		jtag->buf_seg = jtag->buf_i;
+	}
+}
+
+// queue the current slot's segments for the sender thread and switch
+// jtag->buf to the next free buffer. 'nseg' < 0 stops the sender.
+static void jtag_ring_push(struct jtag * jtag, int nseg)
+{
+	unsigned int h = atomic_load_explicit(&jtag->ring_head, memory_order_relaxed);
+	
+	jtag->ring_nseg[h % JTAG_NUM_BUFFERS] = nseg;
+	atomic_store_explicit(&jtag->ring_head, h + 1, memory_order_release);
+	sem_post(&jtag->ring_used);
+	
+	// wait for the sender to release a buffer. at most
+	// JTAG_NUM_BUFFERS - 1 are queued so this is always the next one.
+	sem_wait(&jtag->ring_free);
+	jtag->buf = jtag->ring_buf[(h + 1) % JTAG_NUM_BUFFERS];
+	jtag->buf_i = 0;
+	jtag->buf_seg = 0;
+	jtag->ring_nseg[(h + 1) % JTAG_NUM_BUFFERS] = 0;
+}
+
+// hand the commands in jtag->buf to the sender thread.
+// returns 1 if nothing was queued or if an earlier write failed.
+int jtag_send(struct jtag * jtag)
+{
+	struct transport_iov * seg;
+	int i, l, ret = 0;
+	
+	jtag_end_seg(jtag);
+	
+	if(jtag_cur_nseg(jtag) < 1)
+		return 1;
+	
+	if((jtag->compile_out != NULL) || (jtag->sink != NULL))
+	{
+		seg = jtag_cur_seg(jtag);
+		for(i = 0; i < jtag_cur_nseg(jtag); i++)
+		{
+			if(jtag->compile_out != NULL)
+				ret |= (fwrite(seg[i].p, 1, seg[i].length, jtag->compile_out) != seg[i].length);
+			else if(!seg[i].ref)
+				for(l = 0; l < seg[i].length; l += JTAG_BUFFER_SIZE)
+					memcpy(jtag->sink, &seg[i].p[l],
+						(seg[i].length - l > JTAG_BUFFER_SIZE) ? JTAG_BUFFER_SIZE : (seg[i].length - l));
+		}
+		jtag_cur_nseg(jtag) = 0;
+		jtag->buf_i = 0;
+		jtag->buf_seg = 0;
+		return ret;
+	}
+	
+	jtag_ring_push(jtag, jtag_cur_nseg(jtag));
+	
+	return atomic_load(&jtag->ring_error);
+}
+
+// drop any commands staged but not yet handed to the sender
+void jtag_clear(struct jtag * jtag)
+{
+	jtag->buf_i = 0;
+	jtag->buf_seg = 0;
+	jtag_cur_nseg(jtag) = 0;
+}
+
+// queue 'n' bytes at 'p' by reference after the commands already in
+// jtag->buf. 'p' must stay valid until jtag_sync returns.
+int jtag_add_ref(struct jtag * jtag, const unsigned char * p, int n)
+{
+	// leave room for this segment and the staged bytes either side
+	if(jtag_cur_nseg(jtag) > JTAG_MAX_SEGS - 3)
+		if(jtag_send(jtag))
+			return 1;
+	
+	jtag_end_seg(jtag);
+	jtag_cur_seg(jtag)[jtag_cur_nseg(jtag)].p = p;
+	jtag_cur_seg(jtag)[jtag_cur_nseg(jtag)].length = n;
+	jtag_cur_seg(jtag)[jtag_cur_nseg(jtag)].ref = 1;
+	jtag_cur_nseg(jtag)++;
+	
+	return 0;
+}
+
+// wait until every queued buffer has been written to the device.
+// returns 1 if any write failed since the last call.
+int jtag_sync(struct jtag * jtag)
+{
+	int i;
+	
+	if(!jtag->sender_running)
+		return 0;
+	
+	// all buffers but the one being filled are free once the sender
+	// has caught up
+	for(i = 0; i < JTAG_NUM_BUFFERS - 1; i++)
+		sem_wait(&jtag->ring_free);
+	for(i = 0; i < JTAG_NUM_BUFFERS - 1; i++)
+		sem_post(&jtag->ring_free);
+	
+	// and the transport has finished its own writes
+	if((jtag->tp->flush != NULL) && jtag->tp->flush(jtag->tp))
+		atomic_store(&jtag->ring_error, 1);
+	
+	return atomic_exchange(&jtag->ring_error, 0);
+}
+
+// write a precompiled command stream straight to the device without
+// copying it, after anything already queued. it is queued in pieces of
+// at most JTAG_RAW_SEG_SIZE bytes.
+int jtag_send_raw(struct jtag * jtag, const unsigned char * buf, size_t n)
+{
+	int length;
+	
+	while(n > 0)
+	{
+		length = (n > JTAG_RAW_SEG_SIZE) ? JTAG_RAW_SEG_SIZE : n;
+		if(jtag_add_ref(jtag, buf, length) || jtag_send(jtag))
+			return 1;
+		buf += length;
+		n -= length;
+	}
+	
+	return jtag_sync(jtag);
+}
+
+/*
+ An MPSSE byte shift command carries at most 65536 bytes, so that is the
+ largest chunk jtag_dr_op will put in one command. Chunks are kept a
+ multiple of the device's bulk packet size (512 bytes for the FT232H at
+ high speed) and the transport's transfer sizes are set so that a whole chunk
+ goes out, and its TDO bytes come back, in a single usb transfer.
+*/
+
+// usb bulk packet size of the open device, or the high speed size if
+// no device is open (e.g. when compiling streams)
+int jtag_packet_size(struct jtag * jtag)
+{
+	int packet = (jtag->tp != NULL) ? jtag->tp->packet_size(jtag->tp) : 0;
+	return (packet > 0) ? packet : JTAG_USB_PACKET_SIZE;
+}
+
+// set the number of bytes per shift command, rounded down to a whole
+// number of usb packets and limited to what one command can carry
+int jtag_set_chunk_size(struct jtag * jtag, int size)
+{
+	int packet = jtag_packet_size(jtag);
+	int write_size, read_size;
+	
+	if(size > JTAG_CHUNK_SIZE)
+		size = JTAG_CHUNK_SIZE;
+	size -= size % packet;
+	if(size < packet)
+		size = packet;
+	
+	jtag->chunk_size = size;
+	
+	if(jtag->tp == NULL)
+		return 0;
+	
+	// room for the command header in the same transfer
+	write_size = size + packet;
+	// every IN packet starts with two modem status bytes
+	read_size = ((size + packet - 3) / (packet - 2)) * packet;
+	
+	if(jtag->tp->set_chunk_size(jtag->tp, write_size, read_size))
+	{
+		printf("error: jtag_set_chunk_size: could not set transfer sizes\n");
+		return 1;
+	}
+	
+	return 0;
+}
+
+// time allowed for 'n' bytes to be shifted in at the configured TCK
+// rate, doubled for usb overhead, plus JTAG_RECV_TIMEOUT_MS of slack
+long jtag_recv_timeout_us(int n)
+{
+	return JTAG_RECV_TIMEOUT_MS * 1000L + (long)((16.0e6 * n) / jtag_tck_hz());
+}
+
+// receive 'n' bytes into 'rbuf', or discard them if 'rbuf' is NULL.
+// returns the number of bytes that did not arrive before the deadline.
+int jtag_recv(struct jtag * jtag, unsigned char * rbuf, int n)
+{
+	struct transport_read * r;
+	unsigned char buf[32];
+	int total = n, l, ret;
+	
+	while(n > 0)
+	{
+		l = ((rbuf == NULL) && (n > (int)sizeof(buf))) ? (int)sizeof(buf) : n;
+		
+		if((r = jtag->tp->read_submit(jtag->tp, (rbuf != NULL) ? rbuf : buf, l)) == NULL)
+		{
+			printf("error: jtag_recv: could not submit read\n");
+			break;
+		}
+		
+		ret = jtag->tp->read_wait(jtag->tp, r, jtag_recv_timeout_us(l));
+		if(ret < 0)
+		{
+			printf("error: jtag_recv: read failed with %d of %d bytes received\n", total - n, total);
+			break;
+		}
+		
+		n -= ret;
+		if(rbuf != NULL)
+			rbuf += ret;
+		
+		if(ret < l)
+		{
+			printf("error: jtag_recv: timed out with %d of %d bytes received\n", total - n, total);
+			break;
+		}
+	}
+	
+	return n;
+}
+
+// close and deinitialize the device
+void jtag_close(struct jtag * jtag)
+{
+	int i;
+	
+	// stop the sender thread once it has written everything queued
+	if(jtag->sender_running)
+	{
+		jtag_ring_push(jtag, -1);
+		pthread_join(jtag->sender, NULL);
+		jtag->sender_running = 0;
+		sem_destroy(&jtag->ring_used);
+		sem_destroy(&jtag->ring_free);
+	}
+	
+	for(i = 0; i < JTAG_NUM_BUFFERS; i++)
+	{
+		if(jtag->ring_buf[i] != NULL)
+			free(jtag->ring_buf[i]);
+		jtag->ring_buf[i] = NULL;
+	}
+	jtag->buf = NULL;
+	
+	if(jtag->tp != NULL)
+		jtag->tp->close(jtag->tp);
+	jtag->tp = NULL;
+}
+
+// open the device with serial number 'serial' (the first found if NULL)
+// through the transport called 'transport' (the default if NULL) and
+// initialize it for jtag. 'jtag' must have been set up by jtag_defaults.
+int jtag_init(struct jtag * jtag, char * transport, char * serial)
+{
+	int i;
+	
+	for(i = 0; i < JTAG_NUM_BUFFERS; i++)
+	{
+		if((jtag->ring_buf[i] = malloc(JTAG_BUFFER_SIZE)) == NULL)
+		{
+			printf("error: jtag_init: could not malloc buffers\n");
+			while(i-- > 0)
+				free(jtag->ring_buf[i]);
+			return 1;
+		}
+	}
+	
+	// open the device in MPSSE mode. 0x0b sets TCK, TDI and TMS as
+	// outputs and TDO as an input.
+	if((jtag->tp = transport_open(transport, serial, 0x0b)) == NULL)
+	{
+		for(i = 0; i < JTAG_NUM_BUFFERS; i++)
+		{
+			free(jtag->ring_buf[i]);
+			jtag->ring_buf[i] = NULL;
+		}
+		return 1;
+	}
+	
+	// size shift commands and usb transfers for this device
+	if(jtag_set_chunk_size(jtag, jtag->chunk_size))
+	{
+		jtag_close(jtag);
+		return 1;
+	}
+	
+	// start the sender thread with the first buffer to fill
+	atomic_store(&jtag->ring_head, 0);
+	atomic_store(&jtag->ring_tail, 0);
+	atomic_store(&jtag->ring_error, 0);
+	sem_init(&jtag->ring_used, 0, 0);
+	sem_init(&jtag->ring_free, 0, JTAG_NUM_BUFFERS - 1);
+	jtag->buf = jtag->ring_buf[0];
+	jtag_clear(jtag);
+	
+	if(pthread_create(&jtag->sender, NULL, jtag_sender_main, jtag))
+	{
+		printf("error: jtag_init: could not start sender thread\n");
+		jtag_close(jtag);
+		return 1;
+	}
+	jtag->sender_running = 1;
+	
+	// set TMS high, TCK low, TDI low and TDO as input
+	jtag->buf[jtag->buf_i++] = SET_BITS_LOW;
+	jtag->buf[jtag->buf_i++] = 0x08;
+	jtag->buf[jtag->buf_i++] = 0x0b;
+	
+	// set all pins of the high port to inputs
+	jtag->buf[jtag->buf_i++] = SET_BITS_HIGH;
+	jtag->buf[jtag->buf_i++] = 0x00;
+	jtag->buf[jtag->buf_i++] = 0x00;
+	
+	// disable the divide by 5 clock prescaler
+	jtag->buf[jtag->buf_i++] = CLK_DIV_5_DISABLE;
+	
+	// set the TCK rate to 30MHz
+	jtag->buf[jtag->buf_i++] = TCK_DIVISOR;
+	jtag->buf[jtag->buf_i++] = JTAG_TCK_DIVISOR_LOW;
+	jtag->buf[jtag->buf_i++] = 0x00;
+	
+	// disable 3 phase data clocking
+	jtag->buf[jtag->buf_i++] = DATA_CLK_3_PHASE_DISABLE;
+	
+	// disable adaptive clocking
+	jtag->buf[jtag->buf_i++] = ADAPTIVE_CLK_DISABLE;
+	
+	// flush ftdi buffer
+	jtag->buf[jtag->buf_i++] = SEND_IMMEDIATE;
+
+	if(jtag_send(jtag))
+	{
+		printf("error: jtag_init: could not send initialization commands\n");
+		jtag_close(jtag);
+		return 1;
+	}
+	
+	return 0;
+}
+
+// go to test logic reset state
+void jtag_to_tlr(struct jtag * jtag)
+{
+	// TMS: 11111
+	jtag->buf[jtag->buf_i++] = MPSSE_WRITE_TMS | MPSSE_LSB | MPSSE_BITMODE | MPSSE_WRITE_NEG;
+	jtag->buf[jtag->buf_i++] = 4;
+	jtag->buf[jtag->buf_i++] = 0x9f;
+}
+
+// go to rti state from tlr state
+void jtag_tlr_to_rti(struct jtag * jtag)
+{
+	// TMS: 0
+	jtag->buf[jtag->buf_i++] = MPSSE_WRITE_TMS | MPSSE_LSB | MPSSE_BITMODE | MPSSE_WRITE_NEG;
+	jtag->buf[jtag->buf_i++] = 0;
+	jtag->buf[jtag->buf_i++] = 0x80;	
+}
+
+// stay in run-test-idle state for 'cycles' TCK cycles.
+// uses as few clock commands as possible: one DATA_CLK_BYTES command
+// covers up to 65536 * 8 cycles and DATA_CLK_BITS covers the rest.
+// the commands are only queued, they go out with the next jtag_send.
+void jtag_rti_wait(struct jtag * jtag, long cycles)
+{
+	long n;
+	
+	if(cycles < 1)
+		return;
+	
+	// set TMS to 0, this is the first cycle
+	jtag->buf[jtag->buf_i++] = MPSSE_WRITE_TMS | MPSSE_LSB | MPSSE_BITMODE | MPSSE_WRITE_NEG;
+	jtag->buf[jtag->buf_i++] = 0;
+	jtag->buf[jtag->buf_i++] = 0x80;
+	cycles--;
+	
+	// whole bytes of clocks, (length + 1) * 8 cycles per command
+	while(cycles >= 8)
+	{
+		n = cycles / 8;
+		if(n > 0x10000)
+			n = 0x10000;
+		jtag->buf[jtag->buf_i++] = DATA_CLK_BYTES;
+		jtag->buf[jtag->buf_i++] = (n - 1) & 0xff;
+		jtag->buf[jtag->buf_i++] = ((n - 1) >> 8) & 0xff;
+		cycles -= n * 8;
+	}
+	
+	// remaining bits of clocks, length + 1 cycles
+	if(cycles > 0)
+	{
+		jtag->buf[jtag->buf_i++] = DATA_CLK_BITS;
+		jtag->buf[jtag->buf_i++] = cycles - 1;
+	}
+}
+
+// stay in run-test-idle state for at least 'us' microseconds at the
+// configured TCK rate
+void jtag_rti_wait_us(struct jtag * jtag, long us)
+{
+	jtag_rti_wait(jtag, (long)(((long long)us * jtag_tck_hz() + 999999) / 1000000));
+}
+
+// go to shift-ir state from rti state
+void jtag_rti_to_shift_ir(struct jtag * jtag)
+{
+	// RTI -> SHIFT-IR
+	// TMS: 0011
+	jtag->buf[jtag->buf_i++] = MPSSE_WRITE_TMS | MPSSE_LSB | MPSSE_BITMODE | MPSSE_WRITE_NEG;
+	jtag->buf[jtag->buf_i++] = 3;
+	jtag->buf[jtag->buf_i++] = 0x83;
+}
+
+// go to shift-dr state from rti state
+void jtag_rti_to_shift_dr(struct jtag * jtag)
+{
+	// RTI -> SHIFT-DR
+	// TMS: 001
+	jtag->buf[jtag->buf_i++] = MPSSE_WRITE_TMS | MPSSE_LSB | MPSSE_BITMODE | MPSSE_WRITE_NEG;
+	jtag->buf[jtag->buf_i++] = 2;
+	jtag->buf[jtag->buf_i++] = 0x81;
+}
+
+void jtag_exit1_ir_to_rti(struct jtag * jtag)
+{
+	// EXIT1-IR -> RTI
+	// TMS: 01
+	jtag->buf[jtag->buf_i++] = MPSSE_WRITE_TMS | MPSSE_LSB | MPSSE_BITMODE | MPSSE_WRITE_NEG;
+	jtag->buf[jtag->buf_i++] = 1;
+	jtag->buf[jtag->buf_i++] = 0x81;
+}
+
+void jtag_exit1_dr_to_rti(struct jtag * jtag)
+{
+	// EXIT1-DR -> RTI
+	// TMS: 01
+	jtag->buf[jtag->buf_i++] = MPSSE_WRITE_TMS | MPSSE_LSB | MPSSE_BITMODE | MPSSE_WRITE_NEG;
+	jtag->buf[jtag->buf_i++] = 1;
+	jtag->buf[jtag->buf_i++] = 0x81;
+}
+
+// add the command header for a shift of 'n' bytes to jtag->buf
+void jtag_shift_bytes_header(struct jtag * jtag, int do_write, int n, int do_read, int order)
+{
+	// command byte
+	jtag->buf[jtag->buf_i] = order;
+	if(do_write)
+		jtag->buf[jtag->buf_i] |= MPSSE_DO_WRITE | MPSSE_WRITE_NEG;
+	if(do_read)
+		jtag->buf[jtag->buf_i] |= MPSSE_DO_READ;
+	jtag->buf_i++;
+	
+	// two byte length
+	jtag->buf[jtag->buf_i++] = ((n - 1) & 0xff);
+	jtag->buf[jtag->buf_i++] = ((n - 1) >> 8) & 0xff;
+}
+
+// add commands to jtag->buf to shift out 'n' bytes from 'tdi'.
+// if do_read is set then make the command read while shifting out.
+// 'order' is JTAG_LSB_FIRST or JTAG_MSB_FIRST.
+// assumes tap already in shift-dr or shift-ir state.
+void jtag_shift_bytes(struct jtag * jtag, const unsigned char * tdi, int n, int do_read, int order)
+{
+	int i;
+	
+	jtag_shift_bytes_header(jtag, (tdi != NULL), n, do_read, order);
+	
+	// data bytes if writing
+	if(tdi != NULL)
+		for(i = 0; i < n; i++)
+			jtag->buf[jtag->buf_i++] = tdi[i];
+}
+
+// same as jtag_shift_bytes but the data bytes are queued by reference
+// instead of being copied into jtag->buf. 'tdi' must stay valid until
+// jtag_sync returns.
+int jtag_shift_bytes_ref(struct jtag * jtag, const unsigned char * tdi, int n, int do_read, int order)
+{
+	jtag_shift_bytes_header(jtag, 1, n, do_read, order);
+	return jtag_add_ref(jtag, tdi, n);
+}
+
+// shift 'n' bits of data onto TDI, the low 'n' bits of *tdi when LSB
+// first and the high 'n' bits when MSB first. the last bit goes out
+// with TMS high to leave the shift state.
+// assumes tap already in shift-dr or shift-ir state.
+
+void jtag_shift_bits(struct jtag * jtag, const unsigned char * tdi, int n, int do_read, int order)
+{
+	int last;
+	
+	// if more than one bits need to be shifted
+	if(n > 1)
+	{
+		// command byte
+		jtag->buf[jtag->buf_i] = MPSSE_BITMODE | order;
+		if(tdi != NULL)
+			jtag->buf[jtag->buf_i] |= MPSSE_DO_WRITE | MPSSE_WRITE_NEG;
+		if(do_read)
+			jtag->buf[jtag->buf_i] |= MPSSE_DO_READ;
+		jtag->buf_i++;
+		
+		// number of bits
+		jtag->buf[jtag->buf_i++] = (n - 2);
+		
+		// data byte (last byte of buffer)
+		if((tdi != NULL) && (order == JTAG_LSB_FIRST))
+			jtag->buf[jtag->buf_i++] = *tdi & ((1 << (n - 1)) - 1);
+		else if(tdi != NULL)
+			jtag->buf[jtag->buf_i++] = *tdi & (0xff00 >> (n - 1));
+	}
+	
+	// the final bit is the highest of the 'n' bits when LSB first and
+	// the lowest when MSB first
+	last = (order == JTAG_LSB_FIRST) ? (1 << (n - 1)) : (0x80 >> (n - 1));
+
+	// shift the final bit
+	jtag->buf[jtag->buf_i] = MPSSE_WRITE_TMS | MPSSE_BITMODE | MPSSE_LSB | MPSSE_WRITE_NEG;
+	if(do_read)
+		jtag->buf[jtag->buf_i] |= MPSSE_DO_READ;
+	jtag->buf_i++;
+	
+	// shift one bit
+	jtag->buf[jtag->buf_i++] = 0;
+	
+	// MSB is value to set TDI to
+	// LSB is TMS value (=1)
+	if(tdi != NULL)
+		jtag->buf[jtag->buf_i++] = (*tdi & last) ? 0x81 : 0x01;
+	else
+		jtag->buf[jtag->buf_i++] = 0x01;
+}
+
+// receive bits from ftdi device
+// combines the bits if they were transferred in separate commands
+int jtag_recv_bits(struct jtag * jtag, unsigned char * tdo, int n, int order)
+{
+	unsigned char rbuf[2];
+	
+	if((n < 1) || (n > 8))
+		return 1;
+	
+	if(jtag_recv(jtag, rbuf, (n > 1) ? 2 : 1))
+	{
+		printf("error: jtag_recv_bits: could not recv bytes\n");
+		return 1;
+	}
+	
+	// if more than one bits were shifted then we need to add the
+	// final bit received to the correct position in the prior bits.
+	// the TMS command always shifts the final bit in at the MSB.
+	if((n > 1) && (order == JTAG_LSB_FIRST))
+	{
+		// bits are shifted in from the left (MSB) so if less than 8
+		// bits were shifted then need to shift the bits in the
+		// received byte right by 8 - n bits.
+		*tdo = ((rbuf[1] & 0x80) | (rbuf[0] >> 1)) >> (8 - n);
+	} else if(n > 1)
+	{
+		// bits are shifted in from the right (LSB), so the first
+		// n - 1 bits are the low bits of the first byte. put all n
+		// at the top of the byte as they were sent.
+		*tdo = (((rbuf[0] << 1) | (rbuf[1] >> 7)) << (8 - n)) & 0xff;
+	} else if(order == JTAG_LSB_FIRST)
+		// if only 1 bit received
+		*tdo = (rbuf[0] & 0x80) >> 7;
+	else
+		*tdo = rbuf[0] & 0x80;
+	
+	return 0;
+}
+
+// wait for an asynchronous read of 'size' bytes started by jtag_dr_op
+// to complete. returns 0 if all bytes were transferred, 1 otherwise.
+int jtag_wait(struct jtag * jtag, struct transport_read ** r, int size)
+{
+	int ret;
+	
+	if(*r == NULL)
+		return 0;
+	
+	ret = jtag->tp->read_wait(jtag->tp, *r, jtag_recv_timeout_us(size));
+	*r = NULL;
+	
+	if(ret != size)
+		printf("error: jtag_wait: %d of %d bytes received\n", (ret < 0) ? 0 : ret, size);
+	
+	return (ret != size);
+}
+
+/*
+ The TDO bytes of a long data register operation are read a chunk at a
+ time, with up to TRANSPORT_MAX_READS reads in flight so that the device
+ is never left waiting for the host to collect the chunk before.
+*/
+
+// reads in flight for one data register operation, oldest first
+struct jtag_reads
+{
+	struct transport_read * r[TRANSPORT_MAX_READS];
+	int size[TRANSPORT_MAX_READS];
+	int first;
+	int count;
+};
+
+// the slot the next read goes in
+#define jtag_reads_next(q) (((q)->first + (q)->count) % TRANSPORT_MAX_READS)
+
+// wait for the oldest read in flight. returns 1 if it came back short.
+static int jtag_reads_wait(struct jtag * jtag, struct jtag_reads * q)
+{
+	int i = q->first;
+	
+	q->first = (q->first + 1) % TRANSPORT_MAX_READS;
+	q->count--;
+	
+	return jtag_wait(jtag, &q->r[i], q->size[i]);
+}
+
+// start reading 'n' bytes into 'buf' behind the reads in flight, which
+// must be fewer than TRANSPORT_MAX_READS
+static int jtag_reads_submit(struct jtag * jtag, struct jtag_reads * q, unsigned char * buf, int n)
+{
+	int i = jtag_reads_next(q);
+	
+	if((q->r[i] = jtag->tp->read_submit(jtag->tp, buf, n)) == NULL)
+		return 1;
+	q->size[i] = n;
+	q->count++;
+	
+	return 0;
+}
+
+// wait for every read still in flight, also after an error so that the
+// transport can release them. returns 1 if any came back short.
+static int jtag_reads_drain(struct jtag * jtag, struct jtag_reads * q)
+{
+	int ret = 0;
+	
+	while(q->count > 0)
+		ret |= jtag_reads_wait(jtag, q);
+	
+	return ret;
+}
+
+// drop what is staged and take the tap back to rti through tlr after an error
+static void jtag_dr_abort(struct jtag * jtag)
+{
+	jtag_clear(jtag);
+	jtag_sync(jtag);
+	jtag_to_tlr(jtag);
+	jtag_tlr_to_rti(jtag);
+	jtag_send(jtag);
+	jtag_sync(jtag);
+}
+
+// read and/or write data register
+// n is length of data in bits.
+// each chunk is handed to the sender thread as soon as it is encoded so
+// that the next chunk is encoded while it is written. TDO bytes for a
+// chunk are collected asynchronously while the following chunks are
+// already being sent.
+// 'order' is the bit order of each byte of 'tdi' and 'tdo',
+// JTAG_LSB_FIRST or JTAG_MSB_FIRST. MSB first shifts the bytes of a .bin
+// file as they are, with no bit reversal on the host.
+int jtag_dr_op(struct jtag * jtag, const unsigned char * tdi, unsigned char * tdo, long n, int order)
+{
+	struct jtag_reads q;
+	long bytes_remaining, tdi_i, tdo_i;
+	int bits_remaining, chunk_length;
+	int by_ref = 0, ret = 0;
+	
+	if((tdi == NULL) && (tdo == NULL))
+		return 1;
+	
+	// go to shift dr state
+	jtag_rti_to_shift_dr(jtag);
+	
+	// number of whole bytes that need to be shifted out
+	bytes_remaining = (n - 1) / 8;
+	// number of bits that need to be shifted out
+	// this should only ever be between 1 and 8 inclusive
+	bits_remaining  = n - (bytes_remaining * 8);
+	
+	tdi_i = 0;
+	tdo_i = 0;
+	chunk_length = 0;
+	q.first = 0;
+	q.count = 0;
+	
+	while(bytes_remaining > 0)
+	{
+		// shift out/in a maximum number bytes at a time
+		chunk_length = (bytes_remaining > jtag->chunk_size) ? jtag->chunk_size : bytes_remaining;
+		
+		// shift the chunk through the data register
+		if((tdi != NULL) && jtag->zero_copy && (chunk_length >= JTAG_REF_MIN_SIZE))
+		{
+			if(jtag_shift_bytes_ref(jtag, &tdi[tdi_i], chunk_length, (tdo != NULL), order))
+			{
+				printf("error: jtag_dr_op: could not queue bytes for chunk\n");
+				ret = 1;
+				break;
+			}
+			tdi_i += chunk_length;
+			by_ref = 1;
+		} else if(tdi != NULL)
+		{
+			jtag_shift_bytes(jtag, &tdi[tdi_i], chunk_length, (tdo != NULL), order);
+			tdi_i += chunk_length;
+		} else
+			jtag_shift_bytes(jtag, NULL, chunk_length, (tdo != NULL), order);
+		
+		bytes_remaining -= chunk_length;
+		
+		// if there is still another chunk to transfer then queue this
+		// one and carry on encoding the next chunk while it is sent
+		if(bytes_remaining > 0)
+		{
+			if(jtag_send(jtag))
+			{
+				printf("error: jtag_dr_op: could not send bytes for chunk\n");
+				ret = 1;
+				break;
+			}
+			
+			// read this chunk behind the ones still in flight, collecting
+			// the oldest first if there is no room for another
+			if(tdo != NULL)
+			{
+				if((q.count == TRANSPORT_MAX_READS) && jtag_reads_wait(jtag, &q))
+				{
+					printf("error: jtag_dr_op: could not receive bytes for chunk\n");
+					ret = 1;
+					break;
+				}
+				if(jtag_reads_submit(jtag, &q, &tdo[tdo_i], chunk_length))
+				{
+					printf("error: jtag_dr_op: could not submit read for chunk\n");
+					ret = 1;
+					break;
+				}
+				tdo_i += chunk_length;
+			}
+		}
+	}
+	
+	if(jtag_reads_drain(jtag, &q) && (ret == 0))
+	{
+		printf("error: jtag_dr_op: could not receive bytes for chunk\n");
+		ret = 1;
+	}
+	
+	if(ret)
+	{
+		jtag_dr_abort(jtag);
+		return 1;
+	}
+	
+	// shift the remaining bits
+	if(bits_remaining > 0)
+	{
+		if(tdi != NULL)
+			jtag_shift_bits(jtag, &tdi[tdi_i], bits_remaining, (tdo != NULL), order);
+		else
+			jtag_shift_bits(jtag, NULL, bits_remaining, (tdo != NULL), order);
+	}
+	
+	// back to rti state
+	jtag_exit1_dr_to_rti(jtag);
+	
+	// send the last chunk
+	if(jtag_send(jtag))
+	{
+		printf("error: jtag_dr_op: could not send bytes for last chunk\n");
+		ret = 1;
+	}
+	
+	// now receive the bytes from the last chunk sent and any bits
+	if((tdo != NULL) && (ret == 0))
+	{
+		// if chunk_length is 0 it means that only bits were sent
+		if(chunk_length > 0)
+		{
+			if(jtag_recv(jtag, &tdo[tdo_i], chunk_length))
+			{
+				printf("error: jtag_dr_op: could not receive bytes for the last chunk\n");
+				ret = 1;
+			}
+			tdo_i += chunk_length;
+		}
+		
+		if((bits_remaining > 0) && (ret == 0))
+		{
+			if(jtag_recv_bits(jtag, &tdo[tdo_i], bits_remaining, order))
+			{
+				printf("error: jtag_dr_op: could not receive bits for the last chunk\n");
+				ret = 1;
+			}
+			tdo_i++;
+		}
+	}
+	
+	// tdi must not be released before it has been written if any of it
+	// was queued by reference
+	if(by_ref && jtag_sync(jtag) && (ret == 0))
+	{
+		printf("error: jtag_dr_op: could not send bytes for last chunk\n");
+		ret = 1;
+	}
+	
+	return ret;
+}
+
+// read 'n' bytes out of the data register with tdi held low, handing
+// each chunk to 'out' as soon as it has arrived. as in jtag_dr_op,
+// chunks are received while the next ones are already being shifted,
+// but only TRANSPORT_MAX_READS chunks are ever held, however long the
+// read. returns 1 on error or if 'out' returns non-zero. the tap ends in
+// rti, also on error (see jtag_dr_abort).
+int jtag_dr_read_to(struct jtag * jtag, long n, int order, jtag_read_out out, void * arg)
+{
+	struct jtag_reads q;
+	unsigned char * buf, last;
+	long bytes_remaining = n - 1;
+	int chunk_length = 0, i, ret = 0;
+	
+	// a buffer for each read in flight, the one a read goes in is free
+	// again once the read before in the same slot has been handed over
+	if((n < 1) || ((buf = malloc(TRANSPORT_MAX_READS * jtag->chunk_size)) == NULL))
+		return 1;
+	q.first = 0;
+	q.count = 0;
+	
+	jtag_rti_to_shift_dr(jtag);
+	
+	// the last byte goes out with the exit from shift-dr
+	while(bytes_remaining > 0)
+	{
+		chunk_length = (bytes_remaining > jtag->chunk_size) ? jtag->chunk_size : bytes_remaining;
+		jtag_shift_bytes(jtag, NULL, chunk_length, 1, order);
+		bytes_remaining -= chunk_length;
+		if(bytes_remaining == 0)
+			break;
+		
+		if(jtag_send(jtag))
+		{
+			printf("error: jtag_dr_read_to: could not send chunk\n");
+			ret = 1;
+			break;
+		}
+		
+		// hand the oldest chunk over if there is no room for another read
+		if(q.count == TRANSPORT_MAX_READS)
+		{
+			i = q.first;
+			if(jtag_reads_wait(jtag, &q))
+			{
+				printf("error: jtag_dr_read_to: could not read chunk\n");
+				ret = 1;
+				break;
+			}
+			if(out(arg, &buf[i * jtag->chunk_size], q.size[i]))
+			{
+				ret = 1;
+				break;
+			}
+		}
+		
+		if(jtag_reads_submit(jtag, &q, &buf[jtag_reads_next(&q) * jtag->chunk_size], chunk_length))
+		{
+			printf("error: jtag_dr_read_to: could not submit read for chunk\n");
+			ret = 1;
+			break;
+		}
+	}
+	
+	if(ret)
+	{
+		jtag_reads_drain(jtag, &q);
+		jtag_dr_abort(jtag);
+		free(buf);
+		return 1;
+	}
+	
+	jtag_shift_bits(jtag, NULL, 8, 1, order);
+	jtag_exit1_dr_to_rti(jtag);
+	if(jtag_send(jtag))
+	{
+		printf("error: jtag_dr_read_to: could not send last chunk\n");
+		jtag_reads_drain(jtag, &q);
+		free(buf);
+		return 1;
+	}
+	
+	// the chunks still in flight in order, then the last chunk and byte.
+	// all of them are received even once 'out' has failed, so that none
+	// of the data is left for the next read.
+	while(q.count > 0)
+	{
+		i = q.first;
+		if(jtag_reads_wait(jtag, &q) || ((ret == 0) && out(arg, &buf[i * jtag->chunk_size], q.size[i])))
+			ret = 1;
+	}
+	if((chunk_length > 0) && (jtag_recv(jtag, buf, chunk_length) || ((ret == 0) && out(arg, buf, chunk_length))))
+		ret = 1;
+	if(jtag_recv_bits(jtag, &last, 8, order) || ((ret == 0) && out(arg, &last, 1)))
+		ret = 1;
+	
+	free(buf);
+	return ret;
+}
+
+/*
+ A data register write can also be made in pieces, for data that is
+ streamed in and whose length is not known until it ends. The last bit
+ has to go out with TMS high, so the caller holds the end of the data
+ back until it knows there is no more and passes it to jtag_dr_end.
+*/
+
+// go to shift-dr to start a write made with jtag_dr_continue and
+// jtag_dr_end
+void jtag_dr_begin(struct jtag * jtag)
+{
+	jtag_rti_to_shift_dr(jtag);
+}
+
+// shift 'n' whole bytes of a write started with jtag_dr_begin, staying
+// in shift-dr. the bytes are copied, so 'tdi' can be reused on return.
+int jtag_dr_continue(struct jtag * jtag, const unsigned char * tdi, long n, int order)
+{
+	int chunk_length;
+	
+	while(n > 0)
+	{
+		chunk_length = (n > jtag->chunk_size) ? jtag->chunk_size : n;
+		jtag_shift_bytes(jtag, tdi, chunk_length, 0, order);
+		
+		if(jtag_send(jtag))
+		{
+			printf("error: jtag_dr_continue: could not send bytes for chunk\n");
+			jtag_dr_abort(jtag);
+			return 1;
+		}
+		
+		tdi += chunk_length;
+		n -= chunk_length;
+	}
+	
+	return 0;
+}
+
+// shift the last 'n' (1 to 8) bits of a write started with
+// jtag_dr_begin, and go back to rti
+int jtag_dr_end(struct jtag * jtag, const unsigned char * tdi, int n, int order)
+{
+	if((n < 1) || (n > 8))
+		return 1;
+	
+	jtag_shift_bits(jtag, tdi, n, 0, order);
+	jtag_exit1_dr_to_rti(jtag);
+	
+	if(jtag_send(jtag))
+	{
+		printf("error: jtag_dr_end: could not send last bits\n");
+		return 1;
+	}
+	
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////
+// high level functions
+////////////////////////////////////////////////////////////////////////
+
+// shift in 6 bit instruction
+void jtag_ir_write(struct jtag * jtag, unsigned char instruction)
+{
+	jtag_rti_to_shift_ir(jtag);
+	jtag_shift_bits(jtag, &instruction, 6, 0, JTAG_LSB_FIRST);
+	jtag_exit1_ir_to_rti(jtag);
+}
+
+// shift in 6 bit instruction and read back the instruction capture
+// value into 'status'
+int jtag_ir_rw(struct jtag * jtag, unsigned char instruction, unsigned char * status)
+{
+	jtag_rti_to_shift_ir(jtag);
+	jtag_shift_bits(jtag, &instruction, 6, 1, JTAG_LSB_FIRST);
+	jtag_exit1_ir_to_rti(jtag);
+	jtag_add_send_immediate(jtag);
+	
+	if(jtag_send(jtag))
+		return 1;
+	
+	return jtag_recv_bits(jtag, status, 6, JTAG_LSB_FIRST);
+}
+
+// wait in RTI with 'instruction' loaded until the instruction capture
+// value masked with 'mask' equals 'value'. waits at least 'min_cycles'
+// TCK cycles, then rescans 'instruction' every JTAG_POLL_CYCLES cycles
+// until the status matches or 'timeout_us' microseconds have passed.
+// the last status read and the number of TCK cycles clocked are
+// returned in 'status' and 'cycles'. returns 1 on timeout or error.
+int jtag_poll_status(struct jtag * jtag, unsigned char instruction, unsigned char mask, unsigned char value,
+	long min_cycles, long timeout_us, unsigned char * status, long * cycles)
+{
+	double deadline = transport_now() + timeout_us * 1e-6;
+	long wait = min_cycles;
+	
+	*cycles = 0;
+	
+	for(;;)
+	{
+		jtag_rti_wait(jtag, wait);
+		*cycles += wait;
+		wait = JTAG_POLL_CYCLES;
+		
+		if(jtag_ir_rw(jtag, instruction, status))
+			return 1;
+		
+		if((*status & mask) == value)
+			return 0;
+		
+		if(transport_now() > deadline)
+			return 1;
+	}
+}
+
+// sends an invalid command to the ftdi device and checks to see if it
+// replies with the correct sequence.
+int jtag_mpsse_sync(struct jtag * jtag)
+{
+	int ret;
+	unsigned char buf[2];
+	// load an invalid instruction
+	jtag->buf[jtag->buf_i++] = 0xaa;
+	jtag_send(jtag);
+	ret = jtag_recv(jtag, buf, 2);
+	return (ret | (buf[0] != 0xfa) | (buf[1] != 0xaa));
+}
+
+// read jtag idcode
+int jtag_get_idcode(struct jtag * jtag, int * idcode)
+{
+	unsigned char buf[4];
+	
+	// shift in IDCODE instruction
+	jtag_ir_write(jtag, JTAG_INSTR_IDCODE);
+	
+	if(jtag_dr_read(jtag, buf, 32))
+		return 1;
+	
+	*idcode = (buf[3] << 24) | (buf[2] << 16) | (buf[1] << 8) | buf[0];
+
+	return 0;
+}
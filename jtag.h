@@ -0,0 +1,218 @@
+/*
+JTAG through the MPSSE engine of an FT232H, for Spartan 6 FPGAs.
+
+A struct jtag is one session with one adapter. Commands are encoded
+into the session's buffers and written by its sender thread, so every
+function here takes the session first and several sessions can run
+from different threads at once.
+*/
+
+#ifndef JTAG_H
+#define JTAG_H
+
+#include "transport.h"
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+#include <stdio.h>
+
+#define MPSSE_WRITE_NEG (0x01)
+#define MPSSE_BITMODE (0x02)
+#define MPSSE_READ_NEG (0x04)
+#define MPSSE_LSB (0x08)
+#define MPSSE_DO_WRITE (0x10)
+#define MPSSE_DO_READ (0x20)
+#define MPSSE_WRITE_TMS (0x40)
+#define SET_BITS_LOW (0x80)
+#define SET_BITS_HIGH (0x82)
+#define TCK_DIVISOR (0x86)
+#define SEND_IMMEDIATE (0x87)
+#define CLK_DIV_5_DISABLE (0x8a)
+#define CLK_DIV_5_ENABLE (0x8b)
+#define DATA_CLK_3_PHASE_ENABLE (0x8c)
+#define DATA_CLK_3_PHASE_DISABLE (0x8d)
+#define DATA_CLK_BITS (0x8e)
+#define DATA_CLK_BYTES (0x8f)
+#define ADAPTIVE_CLK_ENABLE (0x96)
+#define ADAPTIVE_CLK_DISABLE (0x97)
+
+// bit order of the bytes of a shift, the MPSSE_LSB bit of the command
+#define JTAG_LSB_FIRST (MPSSE_LSB)
+#define JTAG_MSB_FIRST (0)
+
+#define JTAG_INSTR_ISC_DNA 		(0x30)	// (110000b)
+#define JTAG_INSTR_ISC_DISABLE 	(0x16)	// (010110b)
+#define JTAG_INSTR_ISC_NOOP 	(0x14)	// (010100b)
+#define JTAG_INSTR_ISC_PROGRAM 	(0x11)	// (010001b)
+#define JTAG_INSTR_ISC_ENABLE 	(0x10)	// (010000b)
+#define JTAG_INSTR_BYPASS 		(0x3f)	// (111111b)
+#define JTAG_INSTR_JSHUTDOWN 	(0x0d)	// (001101b)
+#define JTAG_INSTR_JSTART 		(0x0c)	// (001100b)
+#define JTAG_INSTR_JPROGRAM 	(0x0b)	// (001011b)
+#define JTAG_INSTR_HIGHZ 		(0x0a)	// (001010b)
+#define JTAG_INSTR_IDCODE 		(0x09)	// (001001b)
+#define JTAG_INSTR_USERCODE 	(0x08)	// (001000b)
+#define JTAG_INSTR_INTEST 		(0x07)	// (000111b)
+#define JTAG_INSTR_PRELOAD 		(0x01)	// (000001b)
+#define JTAG_INSTR_SAMPLE 		(0x01)	// (000001b)
+#define JTAG_INSTR_EXTEST 		(0x0f)	// (001111b)
+#define JTAG_INSTR_CFG_IN 		(0x05)	// (000101b)
+#define JTAG_INSTR_CFG_OUT 		(0x04)	// (000100b)
+
+// instruction capture value, shifted out of the IR on every IR scan
+#define JTAG_IR_CAPTURE_DONE		(0x20)
+#define JTAG_IR_CAPTURE_INIT		(0x10)
+#define JTAG_IR_CAPTURE_ISC_ENABLED	(0x08)
+#define JTAG_IR_CAPTURE_ISC_DONE	(0x04)
+
+#define JTAG_BUFFER_SIZE (256 * 1024)
+#define JTAG_NUM_BUFFERS (4)
+#define JTAG_MAX_SEGS (64)
+#define JTAG_REF_MIN_SIZE (512)
+#define JTAG_RAW_SEG_SIZE (16 * 1024 * 1024)
+#define JTAG_CHUNK_SIZE (0x10000)
+#define JTAG_USB_PACKET_SIZE (512)
+#define JTAG_SWEEP_MIN_CHUNK (512)
+#define JTAG_RECV_TIMEOUT_MS (100)
+#define JTAG_STARTUP_CYCLES (500 * 1024)
+#define JTAG_SHUTDOWN_CYCLES (500 * 1024)
+#define JTAG_STARTUP_MIN_CYCLES (16)
+#define JTAG_SHUTDOWN_MIN_CYCLES (16)
+#define JTAG_POLL_CYCLES (256)
+#define JTAG_POLL_TIMEOUT_MS (1000)
+#define JTAG_ISC_CYCLES (64)
+#define JTAG_DNA_BITS (57)
+#define JTAG_TCK_DIVISOR_LOW (0)
+
+// TCK frequency in Hz for the configured divisor
+// rate = 60e6 / ((divisor + 1) * 2)
+#define jtag_tck_hz() (60000000 / ((JTAG_TCK_DIVISOR_LOW + 1) * 2))
+
+/*
+ Commands are encoded into one of JTAG_NUM_BUFFERS buffers. jtag->buf
+ always points at the buffer the encoding thread is filling; jtag_send hands
+ it to the sender thread through a single producer/single consumer ring
+ and moves on to the next free buffer, so encoding the next commands
+ overlaps with the usb write of the previous ones.
+
+ The ring slots are the buffers themselves and are used round robin.
+ jtag->ring_head is only written by the encoding thread and jtag->ring_tail
+ only by the sender thread. The semaphores count used and free slots
+ so that either side can sleep instead of spinning when the ring is
+ empty or full.
+
+ Each slot is written as a list of segments. Usually that is just the
+ staged bytes in jtag->buf, but jtag_add_ref can insert caller owned data
+ by reference between them so that large shifts are not copied by the
+ encoder. The caller's data must stay valid until jtag_sync returns.
+ Transports with a writev method get a slot's segments in one call. The
+ staged bytes are packed into shared usb transfers, so a shift command's
+ header does not go out in a transfer of its own, and the segments added
+ by reference are marked so that the transport can send them in place.
+*/
+
+// state of one jtag session. everything the encoder and the sender
+// thread share lives here so that several adapters can be driven from
+// their own threads at once.
+struct jtag
+{
+	// transport to the device, NULL when only encoding
+	struct transport * tp;
+	
+	unsigned char * buf;
+	int buf_i;
+	int buf_seg;
+	
+	unsigned char * ring_buf[JTAG_NUM_BUFFERS];
+	struct transport_iov ring_seg[JTAG_NUM_BUFFERS][JTAG_MAX_SEGS];
+	int ring_nseg[JTAG_NUM_BUFFERS];
+	atomic_uint ring_head;
+	atomic_uint ring_tail;
+	atomic_int ring_error;
+	sem_t ring_used;
+	sem_t ring_free;
+	pthread_t sender;
+	int sender_running;
+	
+	// when set, jtag_send writes the encoded commands to this file
+	// instead of the device. used to compile bitstreams into the stream
+	// cache.
+	FILE * compile_out;
+	
+	// when set, jtag_send copies the encoded commands into this
+	// JTAG_BUFFER_SIZE byte buffer, each over the last, instead of
+	// sending them. used to benchmark the host side encoder on its own,
+	// the copy standing in for the one into the usb transfers, so data
+	// queued by reference is skipped as usb_bulk.c sends it in place.
+	unsigned char * sink;
+	
+	// bytes per shift command, see jtag_set_chunk_size
+	int chunk_size;
+	
+	// shift large tdi chunks by reference rather than copying them
+	int zero_copy;
+};
+
+#define jtag_add_send_immediate(jtag) ((jtag)->buf[(jtag)->buf_i++] = SEND_IMMEDIATE)
+
+#define jtag_dr_write(jtag, tdi, n) 		(jtag_dr_op(jtag, tdi, NULL, n, JTAG_LSB_FIRST))
+#define jtag_dr_read(jtag, tdo, n)  		(jtag_dr_op(jtag, NULL, tdo, n, JTAG_LSB_FIRST))
+#define jtag_dr_rw(jtag, tdi, tdo, n)		(jtag_dr_op(jtag, tdi, tdo, n, JTAG_LSB_FIRST))
+
+// configuration data goes through CFG_IN and CFG_OUT msb first of each
+// byte, in the byte order of a .bin file
+#define jtag_cfg_write(jtag, tdi, n)		(jtag_dr_op(jtag, tdi, NULL, n, JTAG_MSB_FIRST))
+#define jtag_cfg_read(jtag, tdo, n)		(jtag_dr_op(jtag, NULL, tdo, n, JTAG_MSB_FIRST))
+
+// sessions
+void jtag_defaults(struct jtag * jtag);
+int jtag_init(struct jtag * jtag, char * transport, char * serial);
+void jtag_close(struct jtag * jtag);
+int jtag_packet_size(struct jtag * jtag);
+int jtag_set_chunk_size(struct jtag * jtag, int size);
+
+// queueing and sending commands
+int jtag_send(struct jtag * jtag);
+void jtag_clear(struct jtag * jtag);
+int jtag_add_ref(struct jtag * jtag, const unsigned char * p, int n);
+int jtag_sync(struct jtag * jtag);
+int jtag_send_raw(struct jtag * jtag, const unsigned char * buf, size_t n);
+
+// receiving
+long jtag_recv_timeout_us(int n);
+int jtag_recv(struct jtag * jtag, unsigned char * rbuf, int n);
+int jtag_recv_bits(struct jtag * jtag, unsigned char * tdo, int n, int order);
+int jtag_wait(struct jtag * jtag, struct transport_read ** r, int size);
+
+// tap state changes
+void jtag_to_tlr(struct jtag * jtag);
+void jtag_tlr_to_rti(struct jtag * jtag);
+void jtag_rti_wait(struct jtag * jtag, long cycles);
+void jtag_rti_wait_us(struct jtag * jtag, long us);
+void jtag_rti_to_shift_ir(struct jtag * jtag);
+void jtag_rti_to_shift_dr(struct jtag * jtag);
+void jtag_exit1_ir_to_rti(struct jtag * jtag);
+void jtag_exit1_dr_to_rti(struct jtag * jtag);
+
+// shifting
+void jtag_shift_bytes_header(struct jtag * jtag, int do_write, int n, int do_read, int order);
+void jtag_shift_bytes(struct jtag * jtag, const unsigned char * tdi, int n, int do_read, int order);
+int jtag_shift_bytes_ref(struct jtag * jtag, const unsigned char * tdi, int n, int do_read, int order);
+void jtag_shift_bits(struct jtag * jtag, const unsigned char * tdi, int n, int do_read, int order);
+int jtag_dr_op(struct jtag * jtag, const unsigned char * tdi, unsigned char * tdo, long n, int order);
+void jtag_dr_begin(struct jtag * jtag);
+int jtag_dr_continue(struct jtag * jtag, const unsigned char * tdi, long n, int order);
+int jtag_dr_end(struct jtag * jtag, const unsigned char * tdi, int n, int order);
+typedef int (*jtag_read_out)(void * arg, const unsigned char * buf, int n);
+int jtag_dr_read_to(struct jtag * jtag, long n, int order, jtag_read_out out, void * arg);
+
+// instructions and status
+void jtag_ir_write(struct jtag * jtag, unsigned char instruction);
+int jtag_ir_rw(struct jtag * jtag, unsigned char instruction, unsigned char * status);
+int jtag_poll_status(struct jtag * jtag, unsigned char instruction, unsigned char mask, unsigned char value,
+	long min_cycles, long timeout_us, unsigned char * status, long * cycles);
+int jtag_mpsse_sync(struct jtag * jtag);
+int jtag_get_idcode(struct jtag * jtag, int * idcode);
+
+#endif
@@ -0,0 +1,2543 @@
+/*
+libs6prog: programs Spartan 6 FPGAs over JTAG using FTDI FT232H
+adapters. See s6prog.h for the API.
+
+Takes ".bin" or ".bit" files as input, which can be output from ISE.
+*/
+
+#include "s6prog.h"
+#include "jtag.h"
+#include "bitstream.h"
+#include "decompress.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#define IMAGE_READ_BLOCK (64 * 1024)
+#define STREAM_BLOCK_SIZE (256 * 1024)
+#define STREAM_UNLIMITED (SIZE_MAX)
+#define FNV1A_INIT (0xcbf29ce484222325ULL)
+
+#define CACHE_MAGIC "S6MPSSE4"
+#define CACHE_PATH_SIZE (4096)
+#define LAST_MAGIC "S6LAST01"
+#define DIFF_SAMPLE_FRAMES (32)
+#define DIFF_CHANGED_FRAMES (32)
+
+_Static_assert(S6PROG_SERIAL_SIZE == TRANSPORT_SERIAL_SIZE, "serial number sizes differ");
+_Static_assert(S6PROG_CHUNK_SIZE == JTAG_CHUNK_SIZE, "chunk sizes differ");
+_Static_assert(S6PROG_POLL_TIMEOUT_MS == JTAG_POLL_TIMEOUT_MS, "poll timeouts differ");
+_Static_assert(S6PROG_FIELD_SIZE == BIT_FIELD_SIZE, "bit file field sizes differ");
+
+struct s6prog
+{
+	struct jtag jtag;
+	pthread_mutex_t lock;
+	
+	char serial[S6PROG_SERIAL_SIZE];
+	int poll;
+	long timeout_ms;
+	int verbose;
+	
+	// the idcode read from the device, and the part it says is attached
+	uint32_t idcode;
+	const struct bit_part * part;
+	
+	// where the record of the image last loaded into each board is
+	// kept, empty if images are not compared against it. the record is
+	// named by the device dna, read once.
+	char diff_dir[CACHE_PATH_SIZE];
+	int has_dna;
+	uint64_t dna;
+	
+	// the frame layout of the part, to confirm what the FPGA holds and
+	// load only the frames changed since. NULL if that is not done.
+	struct bit_geometry * geometry;
+};
+
+struct s6prog_image
+{
+	// configuration data as read from the file, NULL when the compiled
+	// stream is used instead. it points into 'data_map' when the file
+	// is mapped and into 'data_buf' when it had to be read, after the
+	// header of a .bit file.
+	const unsigned char * data;
+	size_t length;
+	unsigned char * data_map;
+	size_t data_map_length;
+	unsigned char * data_buf;
+	
+	// the header of a .bit file, all empty for a .bin file, and the part
+	// it names (NULL if there is none or it is not known)
+	struct bit_header bit;
+	const struct bit_part * part;
+	
+	// the packets of the configuration data, checked when it was read
+	struct bit_summary packets;
+	
+	// the configuration data rewritten with multi-frame writes, shifted
+	// in place of 'data' if not NULL. 'data' stays to compare against.
+	unsigned char * mfwr;
+	size_t mfwr_length;
+	
+	// hashes of the configuration data and of each frame in it, to
+	// compare against the image last loaded into a board. they are only
+	// worked out when the image is first compared, or before the data
+	// is released if it is loaded with S6PROG_IMAGE_FRAMES.
+	pthread_mutex_t hash_lock;
+	int hashed;
+	uint64_t data_hash;
+	uint64_t * frame_hashes;
+	size_t frames;
+	
+	// MPSSE command stream for the CFG_IN shift, if the image has been
+	// compiled. it points into 'map' when mapped from the stream cache
+	// and into 'buf' when encoded in memory.
+	const unsigned char * stream;
+	size_t stream_length;
+	unsigned char * map;
+	size_t map_length;
+	unsigned char * buf;
+	
+	// the loader and the image cache each hold a reference
+	atomic_int refs;
+};
+
+////////////////////////////////////////////////////////////////////////
+// images
+////////////////////////////////////////////////////////////////////////
+
+// continue the 64 bit FNV-1a hash 'h' over 'n' bytes, starting from
+// FNV1A_INIT
+static uint64_t fnv1a_hash(uint64_t h, const unsigned char * p, size_t n)
+{
+	size_t i;
+	
+	for(i = 0; i < n; i++)
+	{
+		h ^= p[i];
+		h *= 0x100000001b3ULL;
+	}
+	
+	return h;
+}
+
+// drop the configuration data once the image has been compiled
+static void image_release_data(struct s6prog_image * image)
+{
+	if(image->data_map != NULL)
+		munmap(image->data_map, image->data_map_length);
+	free(image->data_buf);
+	free(image->mfwr);
+	image->data = NULL;
+	image->data_map = NULL;
+	image->data_buf = NULL;
+	image->mfwr = NULL;
+}
+
+struct image_buffer
+{
+	unsigned char * data;
+	size_t length;
+	size_t size;
+};
+
+// decompress_out that appends to the image_buffer 'arg'
+static int image_buffer_append(void * arg, const unsigned char * p, size_t n)
+{
+	struct image_buffer * b = arg;
+	unsigned char * data;
+	size_t size = b->size;
+	
+	while(b->length + n > size)
+		size = (size == 0) ? IMAGE_READ_BLOCK : size * 2;
+	if(size != b->size)
+	{
+		if((data = realloc(b->data, size)) == NULL)
+			return 1;
+		b->data = data;
+		b->size = size;
+	}
+	
+	memcpy(b->data + b->length, p, n);
+	b->length += n;
+	return 0;
+}
+
+// if the data is compressed, replace it with the decompressed data in
+// image->data_buf
+static int image_decompress(struct s6prog_image * image)
+{
+	const struct decompressor * d;
+	struct image_buffer b = {NULL, 0, 0};
+	unsigned char * data;
+	
+	if((d = decompressor_find(image->data, image->length)) == NULL)
+		return 0;
+	
+	if(d->run(-1, image->data, image->length, image_buffer_append, &b) || (b.length < 1))
+	{
+		printf("error: image_decompress: could not decompress %s data\n", d->name);
+		free(b.data);
+		return 1;
+	}
+	
+	if((data = realloc(b.data, b.length)) != NULL)
+		b.data = data;
+	
+	image_release_data(image);
+	image->data_buf = b.data;
+	image->data = image->data_buf;
+	image->length = b.length;
+	
+	return 0;
+}
+
+// read all of 'fd' into image->data_buf, for files that can not be
+// mapped. the buffer grows as needed and is trimmed to the length read.
+static int image_read_fd(struct s6prog_image * image, int fd)
+{
+	unsigned char * buf;
+	size_t size = 0;
+	ssize_t n;
+	
+	image->length = 0;
+	for(;;)
+	{
+		if(image->length == size)
+		{
+			size = (size == 0) ? IMAGE_READ_BLOCK : size * 2;
+			if((buf = realloc(image->data_buf, size)) == NULL)
+				return 1;
+			image->data_buf = buf;
+		}
+		
+		n = read(fd, image->data_buf + image->length, size - image->length);
+		if((n < 0) && (errno == EINTR))
+			continue;
+		if(n < 0)
+			return 1;
+		if(n == 0)
+			break;
+		image->length += n;
+	}
+	
+	if((image->length > 0) && ((buf = realloc(image->data_buf, image->length)) != NULL))
+		image->data_buf = buf;
+	image->data = image->data_buf;
+	
+	return 0;
+}
+
+// if the data is a .bit file, parse its header and narrow image->data
+// down to the configuration data in it, without copying
+static int image_parse_bit(struct s6prog_image * image)
+{
+	if(!bit_is_bit_file(image->data, image->length))
+		return 0;
+	
+	if(bit_parse_header(image->data, image->length, &image->bit) || (image->bit.data_length < 1) ||
+		(image->bit.data_offset + image->bit.data_length > image->length))
+	{
+		printf("error: image_parse_bit: bad or truncated .bit file header\n");
+		return 1;
+	}
+	
+	image->data += image->bit.data_offset;
+	image->length = image->bit.data_length;
+	
+	if((image->part = bit_part_by_name(image->bit.part)) == NULL)
+		printf("warning: image_parse_bit: unknown part %s, it will not be checked against the device\n",
+			image->bit.part);
+	
+	return 0;
+}
+
+// hash the configuration data and its frames the first time they are
+// needed. the hashes are filled in under the image's own lock, so this
+// may be called on an image shared between sessions. returns 1 if they
+// can not be worked out, because the data has already been released.
+static int image_hash_frames(const struct s6prog_image * image)
+{
+	struct s6prog_image * im = (struct s6prog_image *)image;
+	int ret = 0;
+	
+	pthread_mutex_lock(&im->hash_lock);
+	if(!im->hashed)
+	{
+		if(im->data == NULL)
+			ret = 1;
+		else
+		{
+			im->data_hash = fnv1a_hash(FNV1A_INIT, im->data, im->length);
+			ret = bit_frame_hashes(im->data, &im->packets, &im->frame_hashes, &im->frames);
+			im->hashed = (ret == 0);
+		}
+	}
+	pthread_mutex_unlock(&im->hash_lock);
+	
+	return ret;
+}
+
+// map the file at 'filename' read only at image->data, or read it into
+// memory if it can not be mapped (a pipe, say). the bytes are shifted
+// msb first as they are, so need no conversion and no copy. the whole
+// file is hashed into 'hash' unless it is NULL. then compressed data is
+// decompressed, the header of a .bit file is skipped and the packets of
+// the configuration data are checked, so that a truncated or corrupt
+// image is refused here and not after a whole download.
+static int image_read(struct s6prog_image * image, const char * filename, uint64_t * hash)
+{
+	struct stat st;
+	void * map;
+	int fd, ret = 0;
+	
+	if((fd = open(filename, O_RDONLY)) < 0)
+		return 1;
+	
+	if((fstat(fd, &st) == 0) && S_ISREG(st.st_mode) && (st.st_size > 0))
+	{
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(map != MAP_FAILED)
+		{
+			// it is read front to back, by the hash and then the shift
+			madvise(map, st.st_size, MADV_SEQUENTIAL);
+			image->data_map = map;
+			image->data_map_length = st.st_size;
+			image->data = image->data_map;
+			image->length = st.st_size;
+		}
+	}
+	
+	if(image->data == NULL)
+		ret = image_read_fd(image, fd);
+	
+	close(fd);
+	
+	if(ret || (image->length < 1))
+		return 1;
+	
+	if(hash != NULL)
+		*hash = fnv1a_hash(FNV1A_INIT, image->data, image->length);
+	
+	return image_decompress(image) || image_parse_bit(image) ||
+		bit_check_packets(image->data, image->length, 0, &image->packets);
+}
+
+// trim the configuration data of an image that has not been compiled
+// yet (see bit_trim). it is narrowed where it is when only its ends go,
+// and copied when NOOP runs are cut from the middle.
+static int image_trim(struct s6prog_image * image)
+{
+	struct bit_trim t;
+	unsigned char * buf;
+	size_t length;
+	
+	if((image->data == NULL) || (image->mfwr != NULL))
+	{
+		printf("error: image_trim: the image has already been %s\n", (image->data == NULL) ? "compiled" : "rewritten");
+		return 1;
+	}
+	
+	length = bit_trim(image->data, image->length, &image->packets, &t, NULL);
+	if(t.cut == 0)
+		image->data += t.start;
+	else
+	{
+		if((buf = malloc(length)) == NULL)
+			return 1;
+		bit_trim(image->data, image->length, &image->packets, &t, buf);
+		image_release_data(image);
+		image->data_buf = buf;
+		image->data = buf;
+	}
+	
+	printf("trimmed %zu of %zu configuration bytes\n", image->length - length, image->length);
+	image->length = length;
+	
+	// the offsets in the summary moved with the data
+	return bit_check_packets(image->data, image->length, 0, &image->packets);
+}
+
+static struct s6prog_image * image_new()
+{
+	struct s6prog_image * image;
+	
+	if((image = calloc(1, sizeof(struct s6prog_image))) == NULL)
+		return NULL;
+	atomic_init(&image->refs, 1);
+	pthread_mutex_init(&image->hash_lock, NULL);
+	return image;
+}
+
+void s6prog_image_free(struct s6prog_image * image)
+{
+	if(image == NULL)
+		return;
+	if(atomic_fetch_sub(&image->refs, 1) != 1)
+		return;
+	
+	image_release_data(image);
+	free(image->frame_hashes);
+	pthread_mutex_destroy(&image->hash_lock);
+	free(image->buf);
+	if(image->map != NULL)
+		munmap(image->map, image->map_length);
+	free(image);
+}
+
+// read the file ready for shifting
+struct s6prog_image * s6prog_image_load(const char * filename)
+{
+	struct s6prog_image * image;
+	
+	if((image = image_new()) == NULL)
+		return NULL;
+	
+	if(image_read(image, filename, NULL))
+	{
+		printf("error: s6prog_image_load: could not load data from %s\n", filename);
+		s6prog_image_free(image);
+		return NULL;
+	}
+	
+	return image;
+}
+
+int s6prog_image_trim(struct s6prog_image * image)
+{
+	return image_trim(image);
+}
+
+// the configuration data as it is shifted, rewritten if it has been
+static const unsigned char * image_shift_data(const struct s6prog_image * image, size_t * length)
+{
+	*length = (image->mfwr != NULL) ? image->mfwr_length : image->length;
+	return (image->mfwr != NULL) ? image->mfwr : image->data;
+}
+
+// the rewrite is checked like the data was, so that a bad one is
+// refused before the FPGA is shut down
+int s6prog_image_mfwr(struct s6prog_image * image, const char * geometry)
+{
+	struct bit_geometry g;
+	struct bit_summary sum;
+	struct bit_mfwr m;
+	uint32_t idcode;
+	
+	if((image->data == NULL) || (image->mfwr != NULL))
+	{
+		printf("error: s6prog_image_mfwr: the image has already been %s\n",
+			(image->data == NULL) ? "compiled" : "rewritten");
+		return 1;
+	}
+	
+	if(bit_geometry_load(geometry, &g))
+		return 1;
+	
+	idcode = (image->part != NULL) ? image->part->idcode :
+		(image->packets.has_idcode ? (image->packets.idcode & BIT_IDCODE_MASK) : 0);
+	if((g.idcode != 0) && (idcode != 0) && (g.idcode != idcode))
+	{
+		printf("error: s6prog_image_mfwr: %s is the frame layout of idcode 0x%08x, the image is for 0x%08x\n",
+			geometry, g.idcode, idcode);
+		return 1;
+	}
+	
+	if(bit_mfwr(image->data, image->length, &image->packets, &g, NULL, &m))
+		return 1;
+	if(m.placed == 0)
+	{
+		printf("no frames repeat enough to place with multi-frame writes, keeping the data as it is\n");
+		return 0;
+	}
+	
+	if(((image->mfwr = malloc(m.length)) == NULL) ||
+		bit_mfwr(image->data, image->length, &image->packets, &g, image->mfwr, &m) ||
+		bit_check_packets(image->mfwr, m.length, 0, &sum))
+	{
+		printf("error: s6prog_image_mfwr: could not rewrite the configuration data\n");
+		free(image->mfwr);
+		image->mfwr = NULL;
+		return 1;
+	}
+	image->mfwr_length = m.length;
+	
+	printf("multi-frame writes place %zu frames from %zu loads, shifting %zu of %zu configuration bytes "
+		"(%.1f%%, %.2f:1)\n", m.placed, m.loads, m.length, image->length, 100.0 * m.length / image->length,
+		(double)image->length / m.length);
+	return 0;
+}
+
+int s6prog_image_save(const struct s6prog_image * image, const char * filename)
+{
+	const unsigned char * data;
+	size_t length;
+	FILE * f;
+	int ret;
+	
+	if(image->data == NULL)
+	{
+		printf("error: s6prog_image_save: the image has already been compiled\n");
+		return 1;
+	}
+	
+	data = image_shift_data(image, &length);
+	if((f = fopen(filename, "wb")) == NULL)
+	{
+		printf("error: s6prog_image_save: could not open %s\n", filename);
+		return 1;
+	}
+	ret = (fwrite(data, 1, length, f) != length);
+	ret |= (fclose(f) != 0);
+	if(ret)
+		printf("error: s6prog_image_save: could not write %s\n", filename);
+	
+	return ret;
+}
+
+size_t s6prog_image_length(const struct s6prog_image * image)
+{
+	return image->length;
+}
+
+void s6prog_image_get_info(const struct s6prog_image * image, struct s6prog_image_info * info)
+{
+	memcpy(info->design, image->bit.design, sizeof(info->design));
+	memcpy(info->part, image->bit.part, sizeof(info->part));
+	memcpy(info->date, image->bit.date, sizeof(info->date));
+	memcpy(info->time, image->bit.time, sizeof(info->time));
+	if(image->part != NULL)
+		info->idcode = image->part->idcode;
+	else
+		info->idcode = image->packets.has_idcode ? (image->packets.idcode & BIT_IDCODE_MASK) : 0;
+}
+
+int s6prog_image_frame_stats(const struct s6prog_image * image, struct s6prog_frame_stats * fs)
+{
+	struct bit_frame_stats bfs;
+	
+	if(image->data == NULL)
+	{
+		printf("error: s6prog_image_frame_stats: the image has already been compiled\n");
+		return 1;
+	}
+	
+	if(bit_frame_stats(image->data, image->length, &image->packets, &bfs))
+		return 1;
+	
+	fs->frames = bfs.frames;
+	fs->zero = bfs.zero;
+	fs->repeats = bfs.repeats;
+	fs->bytes = bfs.bytes;
+	fs->mfwr_bytes = bfs.mfwr_bytes;
+	
+	return 0;
+}
+
+// the chunk size 'size' is rounded to by the encoder
+static int image_chunk_size(int size)
+{
+	struct jtag enc;
+	
+	jtag_defaults(&enc);
+	jtag_set_chunk_size(&enc, size);
+	return enc.chunk_size;
+}
+
+// encode the CFG_IN shift of the data in 'image' with 'chunk_size'
+// byte shift commands to 'f', by running the normal encoder
+// in a session of its own with jtag_send redirected to the file
+static int image_encode_to(struct s6prog_image * image, int chunk_size, FILE * f)
+{
+	const unsigned char * data;
+	struct jtag enc;
+	unsigned char * buf;
+	size_t length;
+	int ret;
+	
+	if((buf = malloc(JTAG_BUFFER_SIZE)) == NULL)
+		return 1;
+	
+	jtag_defaults(&enc);
+	enc.chunk_size = chunk_size;
+	enc.buf = buf;
+	enc.compile_out = f;
+	data = image_shift_data(image, &length);
+	ret = jtag_cfg_write(&enc, data, length * 8);
+	free(buf);
+	
+	return ret;
+}
+
+// encode the CFG_IN shift into memory at image->stream and release the
+// data
+static int image_encode(struct s6prog_image * image, int chunk_size)
+{
+	char * buf = NULL;
+	size_t length = 0;
+	FILE * f;
+	int ret;
+	
+	if((f = open_memstream(&buf, &length)) == NULL)
+		return 1;
+	ret = image_encode_to(image, chunk_size, f);
+	ret |= (fclose(f) != 0);
+	
+	if(ret)
+	{
+		free(buf);
+		return 1;
+	}
+	
+	image->buf = (unsigned char *)buf;
+	image->stream = image->buf;
+	image->stream_length = length;
+	image_release_data(image);
+	
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////
+// MPSSE stream cache
+////////////////////////////////////////////////////////////////////////
+
+/*
+ The stream cache holds the exact MPSSE command stream for the CFG_IN
+ data register shift of a bitstream, so that programming the same image
+ again is a single write of a mapped file with no per byte work on the
+ host.
+
+ Cache files are named after the FNV-1a hash of the raw .bin file, the
+ TCK divisor and the chunk size they were encoded with, and start with a
+ cache_header that repeats the key so stale or foreign files are
+ rejected. The header also keeps what the image needs besides the
+ stream, the .bit header, the packet summary and the data hash, and the
+ frame hashes follow the stream, so a mapped stream is a whole image.
+
+ Finding the stream by its hash means reading and hashing the file, so
+ an index maps each file, by the device, inode, size, mtime and ctime
+ it had when it was compiled, to its stream. Index entries are symbolic
+ links named after that key whose target is the stream's file name.
+ While a file is unchanged, loading it is a stat, a readlink and a mmap
+ of the stream. Entries left behind by files that changed are never
+ matched again and can be removed with the rest of the cache.
+*/
+
+struct cache_header
+{
+	char magic[8];
+	uint64_t hash;
+	uint32_t tck_divisor;
+	uint32_t chunk_size;
+	uint64_t data_length;
+	uint64_t stream_length;
+	
+	// the rest of the image, and the number of frame hashes after the
+	// stream
+	struct bit_header bit;
+	struct bit_summary packets;
+	uint64_t data_hash;
+	uint64_t frames;
+};
+
+int s6prog_cache_default_dir(char * dir, int n)
+{
+	char * e;
+	
+	if((e = getenv("S6PROG_CACHE_DIR")) != NULL)
+		return (snprintf(dir, n, "%s", e) >= n);
+	if((e = getenv("HOME")) != NULL)
+		return (snprintf(dir, n, "%s/.cache/s6prog", e) >= n);
+	return 1;
+}
+
+// create 'dir' and any missing parent directories
+static int cache_make_dir(char * dir)
+{
+	char * p;
+	
+	for(p = dir + 1; *p != '\0'; p++)
+	{
+		if(*p != '/')
+			continue;
+		*p = '\0';
+		mkdir(dir, 0755);
+		*p = '/';
+	}
+	
+	return ((mkdir(dir, 0755) != 0) && (errno != EEXIST));
+}
+
+// build the cache file path for a bitstream encoded with 'chunk_size'
+// byte shift commands
+static int cache_path(char * path, int n, const char * dir, uint64_t hash, int chunk_size, int flags)
+{
+	return (snprintf(path, n, "%s/%016llx-%02x-%x%s.mpsse", dir, (unsigned long long)hash,
+		JTAG_TCK_DIVISOR_LOW, chunk_size, (flags & S6PROG_IMAGE_TRIM) ? "-trim" : "") >= n);
+}
+
+// build the index entry path for the file described by 'st', compiled
+// with 'chunk_size' byte shift commands
+static int cache_index_path(char * path, int n, const char * dir, const struct stat * st, int chunk_size, int flags)
+{
+	return (snprintf(path, n, "%s/%llx-%llx-%llx-%llx.%09ld-%llx.%09ld-%02x-%x%s.index", dir,
+		(unsigned long long)st->st_dev, (unsigned long long)st->st_ino, (unsigned long long)st->st_size,
+		(unsigned long long)st->st_mtim.tv_sec, (long)st->st_mtim.tv_nsec,
+		(unsigned long long)st->st_ctim.tv_sec, (long)st->st_ctim.tv_nsec,
+		JTAG_TCK_DIVISOR_LOW, chunk_size, (flags & S6PROG_IMAGE_TRIM) ? "-trim" : "") >= n);
+}
+
+// point the index entry for the file described by 'st' at the stream
+// 'path'. the link is made under a temporary name and renamed over any
+// old one. a missing entry only costs a hash next time, so failures are
+// not reported.
+static void cache_index_write(const char * dir, const struct stat * st, int chunk_size, int flags,
+	const char * path)
+{
+	char index[CACHE_PATH_SIZE], tmp[CACHE_PATH_SIZE];
+	const char * name;
+	
+	if(cache_index_path(index, sizeof(index), dir, st, chunk_size, flags) ||
+		(snprintf(tmp, sizeof(tmp), "%s.%d.%lx", index, (int)getpid(), (unsigned long)pthread_self()) >= (int)sizeof(tmp)))
+		return;
+	
+	name = ((name = strrchr(path, '/')) != NULL) ? name + 1 : path;
+	if(symlink(name, tmp))
+		return;
+	if(rename(tmp, index))
+		unlink(tmp);
+}
+
+// encode the CFG_IN shift of the data in 'image' with 'chunk_size'
+// byte shift commands into the cache file at 'path', followed by the
+// frame hashes. the file is written under a temporary name and renamed
+// so that readers never see a partial stream.
+static int cache_compile(struct s6prog_image * image, int chunk_size, char * path, uint64_t hash)
+{
+	struct cache_header hdr;
+	char tmp[CACHE_PATH_SIZE];
+	FILE * f;
+	long length;
+	int ret;
+	
+	if(image_hash_frames(image))
+		return 1;
+	
+	if(snprintf(tmp, sizeof(tmp), "%s.%d.%lx", path, (int)getpid(), (unsigned long)pthread_self()) >= (int)sizeof(tmp))
+		return 1;
+	
+	if((f = fopen(tmp, "wb")) == NULL)
+	{
+		printf("error: cache_compile: could not create %s\n", tmp);
+		return 1;
+	}
+	
+	memset(&hdr, 0, sizeof(hdr));
+	fwrite(&hdr, sizeof(hdr), 1, f);
+	
+	ret = image_encode_to(image, chunk_size, f);
+	
+	length = ftell(f) - (long)sizeof(hdr);
+	ret |= (fwrite(image->frame_hashes, sizeof(uint64_t), image->frames, f) != image->frames);
+	
+	memcpy(hdr.magic, CACHE_MAGIC, sizeof(hdr.magic));
+	hdr.hash = hash;
+	hdr.tck_divisor = JTAG_TCK_DIVISOR_LOW;
+	hdr.chunk_size = chunk_size;
+	hdr.data_length = image->length;
+	hdr.stream_length = length;
+	hdr.bit = image->bit;
+	hdr.packets = image->packets;
+	hdr.data_hash = image->data_hash;
+	hdr.frames = image->frames;
+	
+	rewind(f);
+	ret |= (fwrite(&hdr, sizeof(hdr), 1, f) != 1);
+	ret |= (fclose(f) != 0);
+	
+	if(ret || rename(tmp, path))
+	{
+		printf("error: cache_compile: could not write %s\n", path);
+		unlink(tmp);
+		return 1;
+	}
+	
+	return 0;
+}
+
+// map the cache file at 'path' into 'image' and check that it matches
+// 'hash' and 'chunk_size'. the rest of the image is filled in from the
+// header, so the file need not have been read.
+static int cache_map_file(struct s6prog_image * image, int chunk_size, char * path, uint64_t hash)
+{
+	struct cache_header * hdr;
+	struct stat st;
+	void * map;
+	uint64_t * hashes = NULL;
+	int fd;
+	
+	if((fd = open(path, O_RDONLY)) < 0)
+		return 1;
+	
+	if(fstat(fd, &st) || (st.st_size < (off_t)sizeof(struct cache_header)))
+	{
+		close(fd);
+		return 1;
+	}
+	
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED)
+		return 1;
+	
+	hdr = (struct cache_header *)map;
+	if(memcmp(hdr->magic, CACHE_MAGIC, sizeof(hdr->magic)) ||
+		(hdr->hash != hash) ||
+		(hdr->tck_divisor != JTAG_TCK_DIVISOR_LOW) ||
+		(hdr->chunk_size != chunk_size) ||
+		(sizeof(struct cache_header) + hdr->stream_length + hdr->frames * sizeof(uint64_t) != (size_t)st.st_size) ||
+		(!image->hashed && (hdr->frames > 0) && ((hashes = malloc(hdr->frames * sizeof(uint64_t))) == NULL)))
+	{
+		munmap(map, st.st_size);
+		return 1;
+	}
+	
+	image->map = map;
+	image->map_length = st.st_size;
+	image->stream = image->map + sizeof(struct cache_header);
+	image->stream_length = hdr->stream_length;
+	
+	image->length = hdr->data_length;
+	image->bit = hdr->bit;
+	image->packets = hdr->packets;
+	if(image->bit.part[0] != '\0')
+		image->part = bit_part_by_name(image->bit.part);
+	
+	// the hashes follow the stream, unaligned
+	if(!image->hashed)
+	{
+		if(hashes != NULL)
+			memcpy(hashes, image->stream + hdr->stream_length, hdr->frames * sizeof(uint64_t));
+		image->frame_hashes = hashes;
+		image->frames = hdr->frames;
+		image->data_hash = hdr->data_hash;
+		image->hashed = 1;
+	}
+	
+	return 0;
+}
+
+// map the stream the index has for the file described by 'st' into
+// 'image', and set 'hash' to the hash of the file it was compiled from.
+// returns 1 if the file has no index entry or has changed since.
+static int cache_index_map(struct s6prog_image * image, const char * dir, const struct stat * st,
+	int chunk_size, int flags, uint64_t * hash)
+{
+	char index[CACHE_PATH_SIZE], path[CACHE_PATH_SIZE], name[CACHE_PATH_SIZE];
+	unsigned long long h;
+	ssize_t n;
+	
+	if((flags & S6PROG_IMAGE_REBUILD) || !S_ISREG(st->st_mode) ||
+		cache_index_path(index, sizeof(index), dir, st, chunk_size, flags))
+		return 1;
+	
+	if((n = readlink(index, name, sizeof(name) - 1)) < 0)
+		return 1;
+	name[n] = '\0';
+	
+	// only the hash is taken from the link, the path is built as usual
+	if((sscanf(name, "%16llx", &h) != 1) ||
+		cache_path(path, sizeof(path), dir, h, chunk_size, flags) ||
+		cache_map_file(image, chunk_size, path, h))
+		return 1;
+	
+	printf("using cached stream %s\n", path);
+	*hash = h;
+	
+	return 0;
+}
+
+// find the compiled stream for the data in 'image', whose raw
+// file hashed to 'hash', in the cache directory, compiling it first on a miss (or if
+// S6PROG_IMAGE_REBUILD is set). trimmed images are cached apart from
+// untrimmed ones. on success the stream is mapped at image->stream
+// and the data itself is released. the file is indexed under 'st'
+// unless it is NULL.
+static int image_load_cached(struct s6prog_image * image, const char * cache_dir, int chunk_size,
+	int flags, uint64_t hash, const struct stat * st)
+{
+	char path[CACHE_PATH_SIZE], dir[CACHE_PATH_SIZE];
+	
+	if((snprintf(dir, sizeof(dir), "%s", cache_dir) >= (int)sizeof(dir)) ||
+		cache_path(path, sizeof(path), dir, hash, chunk_size, flags))
+		return 1;
+	
+	if((flags & S6PROG_IMAGE_REBUILD) || cache_map_file(image, chunk_size, path, hash))
+	{
+		if(cache_make_dir(dir))
+		{
+			printf("error: image_load_cached: could not create %s\n", dir);
+			return 1;
+		}
+		
+		if(cache_compile(image, chunk_size, path, hash) ||
+			cache_map_file(image, chunk_size, path, hash))
+			return 1;
+		
+		printf("compiled stream %s\n", path);
+	} else
+		printf("using cached stream %s\n", path);
+	
+	if((st != NULL) && S_ISREG(st->st_mode))
+		cache_index_write(dir, st, chunk_size, flags, path);
+	
+	image_release_data(image);
+	
+	return 0;
+}
+
+struct s6prog_image * s6prog_image_load_cached(const char * filename, const char * cache_dir,
+	int chunk_size, int flags)
+{
+	struct s6prog_image * image;
+	struct stat st, * stp = NULL;
+	uint64_t hash;
+	
+	chunk_size = image_chunk_size(chunk_size);
+	if((image = image_new()) == NULL)
+		return NULL;
+	
+	// stat before reading, so that a change made meanwhile leaves an
+	// index entry that is never matched rather than a stale one
+	if(stat(filename, &st) == 0)
+	{
+		stp = &st;
+		if(!cache_index_map(image, cache_dir, &st, chunk_size, flags, &hash))
+			return image;
+	}
+	
+	if(image_read(image, filename, &hash) || ((flags & S6PROG_IMAGE_TRIM) && image_trim(image)) ||
+		((flags & S6PROG_IMAGE_FRAMES) && image_hash_frames(image)))
+	{
+		printf("error: s6prog_image_load_cached: could not load data from %s\n", filename);
+		s6prog_image_free(image);
+		return NULL;
+	}
+	
+	if(image_load_cached(image, cache_dir, chunk_size, flags, hash, stp))
+	{
+		s6prog_image_free(image);
+		return NULL;
+	}
+	
+	return image;
+}
+
+////////////////////////////////////////////////////////////////////////
+// image cache
+////////////////////////////////////////////////////////////////////////
+
+/*
+ The image cache keeps compiled images in memory so that programming the
+ same file again costs no file reads or encoding.
+
+ Images are content addressed: entries are keyed by the hash and length
+ of the raw file, so several paths to the same bitstream share one
+ entry. Each path seen remembers the device, inode, size, mtime and
+ ctime it had when it was hashed. While these still match, a lookup is a
+ single stat(). When they change, the file is read and hashed again and
+ the image is only rebuilt if its contents did change.
+
+ Entries are kept in least recently used order and the oldest are
+ dropped once their streams add up to more than the memory budget,
+ along with the paths that held their contents. An image handed out
+ stays valid until its caller frees it, even if the cache has dropped
+ it.
+
+ The lock is only held to look things up and to insert, not while a
+ file is read, hashed and compiled, so that hits on other images are
+ not held up behind a miss. Two callers missing on the same contents at
+ once both compile them and the second copy is dropped.
+*/
+
+struct image_entry
+{
+	uint64_t hash;
+	size_t length;
+	struct s6prog_image * image;
+	size_t bytes;
+	
+	// least recently used order, most recent first
+	struct image_entry * prev;
+	struct image_entry * next;
+};
+
+struct image_path
+{
+	char * path;
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+	struct timespec ctime;
+	uint64_t hash;
+	size_t length;
+	struct image_path * next;
+};
+
+struct s6prog_image_cache
+{
+	pthread_mutex_t lock;
+	size_t budget;
+	int chunk_size;
+	int flags;
+	char * cache_dir;
+	
+	struct image_entry * head;
+	struct image_entry * tail;
+	struct image_path * paths;
+	
+	struct s6prog_image_cache_stats stats;
+};
+
+struct s6prog_image_cache * s6prog_image_cache_new(size_t budget, int chunk_size, const char * cache_dir,
+	int flags)
+{
+	struct s6prog_image_cache * c;
+	
+	if((c = calloc(1, sizeof(struct s6prog_image_cache))) == NULL)
+		return NULL;
+	
+	if((cache_dir != NULL) && ((c->cache_dir = strdup(cache_dir)) == NULL))
+	{
+		free(c);
+		return NULL;
+	}
+	
+	pthread_mutex_init(&c->lock, NULL);
+	c->budget = budget;
+	c->chunk_size = image_chunk_size(chunk_size);
+	c->flags = flags & (S6PROG_IMAGE_TRIM | S6PROG_IMAGE_FRAMES);
+	
+	return c;
+}
+
+static void image_entry_unlink(struct s6prog_image_cache * c, struct image_entry * e)
+{
+	if(e->prev != NULL)
+		e->prev->next = e->next;
+	else
+		c->head = e->next;
+	if(e->next != NULL)
+		e->next->prev = e->prev;
+	else
+		c->tail = e->prev;
+	e->prev = e->next = NULL;
+}
+
+static void image_entry_push(struct s6prog_image_cache * c, struct image_entry * e)
+{
+	e->prev = NULL;
+	e->next = c->head;
+	if(c->head != NULL)
+		c->head->prev = e;
+	else
+		c->tail = e;
+	c->head = e;
+}
+
+static void image_entry_free(struct s6prog_image_cache * c, struct image_entry * e)
+{
+	image_entry_unlink(c, e);
+	c->stats.bytes -= e->bytes;
+	c->stats.entries--;
+	s6prog_image_free(e->image);
+	free(e);
+}
+
+void s6prog_image_cache_free(struct s6prog_image_cache * c)
+{
+	struct image_path * p;
+	
+	if(c == NULL)
+		return;
+	
+	while(c->head != NULL)
+		image_entry_free(c, c->head);
+	while((p = c->paths) != NULL)
+	{
+		c->paths = p->next;
+		free(p->path);
+		free(p);
+	}
+	
+	pthread_mutex_destroy(&c->lock);
+	free(c->cache_dir);
+	free(c);
+}
+
+// the entry for the contents 'hash' and 'length', moved to the front
+static struct image_entry * image_entry_find(struct s6prog_image_cache * c, uint64_t hash, size_t length)
+{
+	struct image_entry * e;
+	
+	for(e = c->head; e != NULL; e = e->next)
+	{
+		if((e->hash == hash) && (e->length == length))
+		{
+			image_entry_unlink(c, e);
+			image_entry_push(c, e);
+			return e;
+		}
+	}
+	
+	return NULL;
+}
+
+// the record for 'path', NULL if it has not been seen
+static struct image_path * image_path_find(struct s6prog_image_cache * c, const char * path)
+{
+	struct image_path * p;
+	
+	for(p = c->paths; p != NULL; p = p->next)
+		if(strcmp(p->path, path) == 0)
+			return p;
+	
+	return NULL;
+}
+
+static int image_path_valid(struct image_path * p, struct stat * st)
+{
+	return (p->dev == st->st_dev) && (p->ino == st->st_ino) &&
+		(p->size == st->st_size) &&
+		(p->mtime.tv_sec == st->st_mtim.tv_sec) && (p->mtime.tv_nsec == st->st_mtim.tv_nsec) &&
+		(p->ctime.tv_sec == st->st_ctim.tv_sec) && (p->ctime.tv_nsec == st->st_ctim.tv_nsec);
+}
+
+// remember that 'path', as described by 'st', holds the contents 'hash'
+// and 'length'. if the record can not be allocated the path is simply
+// hashed again next time.
+static void image_path_update(struct s6prog_image_cache * c, const char * path, struct stat * st,
+	uint64_t hash, size_t length)
+{
+	struct image_path * p;
+	
+	if((p = image_path_find(c, path)) == NULL)
+	{
+		if((p = calloc(1, sizeof(struct image_path))) == NULL)
+			return;
+		if((p->path = strdup(path)) == NULL)
+		{
+			free(p);
+			return;
+		}
+		p->next = c->paths;
+		c->paths = p;
+	}
+	
+	p->dev = st->st_dev;
+	p->ino = st->st_ino;
+	p->size = st->st_size;
+	p->mtime = st->st_mtim;
+	p->ctime = st->st_ctim;
+	p->hash = hash;
+	p->length = length;
+}
+
+// forget the paths that held the contents 'hash' and 'length'
+static void image_path_prune(struct s6prog_image_cache * c, uint64_t hash, size_t length)
+{
+	struct image_path ** pp = &c->paths, * p;
+	
+	while((p = *pp) != NULL)
+	{
+		if((p->hash == hash) && (p->length == length))
+		{
+			*pp = p->next;
+			free(p->path);
+			free(p);
+		} else
+			pp = &p->next;
+	}
+}
+
+// drop the least recently used entries, but not 'keep', until the cache
+// fits its budget
+static void image_cache_trim(struct s6prog_image_cache * c, struct image_entry * keep)
+{
+	struct image_entry * e = c->tail, * prev;
+	
+	while((c->stats.bytes > c->budget) && (e != NULL))
+	{
+		prev = e->prev;
+		if(e != keep)
+		{
+			image_path_prune(c, e->hash, e->length);
+			image_entry_free(c, e);
+			c->stats.evictions++;
+		}
+		e = prev;
+	}
+}
+
+// take a reference to the image of 'e' for the caller
+static struct s6prog_image * image_entry_get(struct image_entry * e)
+{
+	atomic_fetch_add(&e->image->refs, 1);
+	return e->image;
+}
+
+// read, hash and compile the file at 'filename' into a new entry, or
+// find the entry that already holds its contents. called without the
+// lock, which is taken for each look at the cache.
+static struct s6prog_image * image_cache_load(struct s6prog_image_cache * c, const char * filename,
+	struct stat * st)
+{
+	struct s6prog_image * image, * found = NULL, * dup = NULL;
+	struct image_entry * e;
+	uint64_t hash;
+	int indexed;
+	
+	if((image = image_new()) == NULL)
+		return NULL;
+	
+	// a file compiled into the stream cache before, and not changed
+	// since, is mapped from there without being read
+	indexed = (c->cache_dir != NULL) && !cache_index_map(image, c->cache_dir, st, c->chunk_size, c->flags, &hash);
+	
+	if(!indexed && (image_read(image, filename, &hash) || ((c->flags & S6PROG_IMAGE_TRIM) && image_trim(image)) ||
+		((c->flags & S6PROG_IMAGE_FRAMES) && image_hash_frames(image))))
+	{
+		printf("error: s6prog_image_cache_get: could not load data from %s\n", filename);
+		s6prog_image_free(image);
+		return NULL;
+	}
+	
+	// the contents may be cached already under another path, or from
+	// before the path was touched
+	pthread_mutex_lock(&c->lock);
+	if((e = image_entry_find(c, hash, image->length)) != NULL)
+	{
+		image_path_update(c, filename, st, hash, image->length);
+		c->stats.revalidations++;
+		found = image_entry_get(e);
+	}
+	pthread_mutex_unlock(&c->lock);
+	
+	if(found != NULL)
+	{
+		s6prog_image_free(image);
+		return found;
+	}
+	
+	if(!indexed && (c->cache_dir != NULL))
+	{
+		if(image_load_cached(image, c->cache_dir, c->chunk_size, c->flags, hash, st))
+		{
+			s6prog_image_free(image);
+			return NULL;
+		}
+	} else if(!indexed && image_encode(image, c->chunk_size))
+	{
+		printf("error: s6prog_image_cache_get: could not encode %s\n", filename);
+		s6prog_image_free(image);
+		return NULL;
+	}
+	
+	pthread_mutex_lock(&c->lock);
+	
+	image_path_update(c, filename, st, hash, image->length);
+	c->stats.misses++;
+	
+	// another caller may have compiled the same contents meanwhile. a
+	// new entry takes over the reference to the image, and if there is
+	// no memory for one the image is handed out uncached.
+	if((e = image_entry_find(c, hash, image->length)) != NULL)
+	{
+		found = image_entry_get(e);
+		dup = image;
+	} else if((e = calloc(1, sizeof(struct image_entry))) != NULL)
+	{
+		e->hash = hash;
+		e->length = image->length;
+		e->image = image;
+		e->bytes = (image->map != NULL) ? image->map_length : image->stream_length;
+		image_entry_push(c, e);
+		c->stats.bytes += e->bytes;
+		c->stats.entries++;
+		
+		image_cache_trim(c, e);
+		found = image_entry_get(e);
+	} else
+		found = image;
+	
+	pthread_mutex_unlock(&c->lock);
+	s6prog_image_free(dup);
+	
+	return found;
+}
+
+struct s6prog_image * s6prog_image_cache_get(struct s6prog_image_cache * c, const char * filename)
+{
+	struct s6prog_image * image = NULL;
+	struct image_entry * e;
+	struct image_path * p;
+	struct stat st;
+	
+	if(stat(filename, &st))
+	{
+		printf("error: s6prog_image_cache_get: could not find %s\n", filename);
+		return NULL;
+	}
+	
+	pthread_mutex_lock(&c->lock);
+	if(((p = image_path_find(c, filename)) != NULL) && image_path_valid(p, &st) &&
+		((e = image_entry_find(c, p->hash, p->length)) != NULL))
+	{
+		c->stats.hits++;
+		image = image_entry_get(e);
+	}
+	pthread_mutex_unlock(&c->lock);
+	
+	if(image != NULL)
+		return image;
+	
+	return image_cache_load(c, filename, &st);
+}
+
+void s6prog_image_cache_get_stats(struct s6prog_image_cache * c, struct s6prog_image_cache_stats * stats)
+{
+	pthread_mutex_lock(&c->lock);
+	*stats = c->stats;
+	pthread_mutex_unlock(&c->lock);
+}
+
+////////////////////////////////////////////////////////////////////////
+// sessions
+////////////////////////////////////////////////////////////////////////
+
+const char * const * s6prog_transports()
+{
+	return transport_names;
+}
+
+double s6prog_now_seconds()
+{
+	return transport_now();
+}
+
+int s6prog_list(const char * transport, char serials[][S6PROG_SERIAL_SIZE], int max)
+{
+	return transport_list(transport, serials, max);
+}
+
+// print a progress message if the session is verbose, prefixed with
+// the serial number if it has one. each message is printed with a
+// single call so that lines from several sessions do not get mixed up.
+static void session_printf(struct s6prog * s, const char * format, ...)
+{
+	char line[256];
+	va_list ap;
+	
+	if(!s->verbose)
+		return;
+	
+	va_start(ap, format);
+	vsnprintf(line, sizeof(line), format, ap);
+	va_end(ap);
+	
+	if(s->serial[0] != '\0')
+		printf("%s: %s", s->serial, line);
+	else
+		printf("%s", line);
+}
+
+// report an error on session 's', returns 1
+static int session_error(struct s6prog * s, char * msg)
+{
+	if(s->serial[0] != '\0')
+		printf("%s: error: %s\n", s->serial, msg);
+	else
+		printf("error: %s\n", msg);
+	return 1;
+}
+
+// check the link and leave the tap in the rti state after reading and
+// checking the idcode
+static int session_start(struct s6prog * s)
+{
+	struct jtag * jtag = &s->jtag;
+	unsigned char c[2];
+	int idcode;
+	
+	if(jtag_mpsse_sync(jtag))
+		return session_error(s, "could not sync mpsse controller");
+	
+	session_printf(s, "testing 1 byte transfer, send 0xaa\n");
+	jtag->buf[jtag->buf_i++] = 0xaa;
+	if(jtag_send(jtag))
+		return session_error(s, "ftdi write 1 byte failed");
+	jtag_recv(jtag, c, 2);
+	session_printf(s, "receive 0x%02x 0x%02x\n", c[0], c[1]);
+	
+	// put jtag tap into TLR state
+	jtag_to_tlr(jtag);
+	
+	// put jtag tap into RTI state
+	jtag_tlr_to_rti(jtag);
+	
+	if(jtag_get_idcode(jtag, &idcode))
+		return session_error(s, "could not get idcode");
+	
+	// the version bits are ignored, the rest names the part
+	if((s->part = bit_part_by_idcode(idcode)) == NULL)
+	{
+		session_printf(s, "idcode = 0x%08x\n", idcode);
+		return session_error(s, "idcode is not a known spartan 6 device");
+	}
+	
+	session_printf(s, "idcode = 0x%08x (xc%s)\n", idcode, s->part->name);
+	s->idcode = idcode;
+	
+	return 0;
+}
+
+// refuse an image built for a part other than the one attached, before
+// the FPGA is shut down. images with no part (.bin files) always pass.
+static int session_check_part(struct s6prog * s, const struct bit_part * part)
+{
+	char msg[128];
+	
+	if((part == NULL) || (part == s->part))
+		return 0;
+	
+	snprintf(msg, sizeof(msg), "bitstream is for xc%s but the device is xc%s", part->name, s->part->name);
+	return session_error(s, msg);
+}
+
+// refuse configuration data that writes the IDCODE register with
+// another part's idcode, which the FPGA would only fail after the whole
+// download. data with no IDCODE write passes.
+static int session_check_packets(struct s6prog * s, const struct bit_summary * sum)
+{
+	const struct bit_part * part;
+	char msg[128];
+	
+	if(!sum->has_idcode || (((sum->idcode ^ s->idcode) & BIT_IDCODE_MASK) == 0))
+		return 0;
+	
+	part = bit_part_by_idcode(sum->idcode);
+	snprintf(msg, sizeof(msg), "bitstream writes idcode 0x%08x (%s%s) but the device is 0x%08x (xc%s)",
+		sum->idcode, (part != NULL) ? "xc" : "", (part != NULL) ? part->name : "unknown part",
+		s->idcode, s->part->name);
+	return session_error(s, msg);
+}
+
+struct s6prog * s6prog_open(const char * transport, const char * serial)
+{
+	struct s6prog * s;
+	
+	if((s = calloc(1, sizeof(struct s6prog))) == NULL)
+		return NULL;
+	
+	jtag_defaults(&s->jtag);
+	pthread_mutex_init(&s->lock, NULL);
+	s->timeout_ms = JTAG_POLL_TIMEOUT_MS;
+	s->verbose = 1;
+	if(serial != NULL)
+		snprintf(s->serial, sizeof(s->serial), "%s", serial);
+	
+	if(jtag_init(&s->jtag, (char *)transport, (char *)serial))
+	{
+		session_error(s, "jtag_init failed");
+		s6prog_close(s);
+		return NULL;
+	}
+	
+	if(session_start(s))
+	{
+		s6prog_close(s);
+		return NULL;
+	}
+	
+	return s;
+}
+
+void s6prog_close(struct s6prog * s)
+{
+	if(s == NULL)
+		return;
+	
+	if(s->jtag.tp != NULL)
+	{
+		jtag_to_tlr(&s->jtag);
+		jtag_send(&s->jtag);
+		jtag_close(&s->jtag);
+	}
+	
+	pthread_mutex_destroy(&s->lock);
+	free(s->geometry);
+	free(s);
+}
+
+const char * s6prog_serial(struct s6prog * s)
+{
+	return s->serial;
+}
+
+int s6prog_set_chunk_size(struct s6prog * s, int size)
+{
+	int ret;
+	
+	pthread_mutex_lock(&s->lock);
+	ret = jtag_set_chunk_size(&s->jtag, size);
+	pthread_mutex_unlock(&s->lock);
+	
+	return ret;
+}
+
+void s6prog_set_poll(struct s6prog * s, int poll, long timeout_ms)
+{
+	pthread_mutex_lock(&s->lock);
+	s->poll = poll;
+	s->timeout_ms = timeout_ms;
+	pthread_mutex_unlock(&s->lock);
+}
+
+void s6prog_set_diff(struct s6prog * s, const char * dir)
+{
+	pthread_mutex_lock(&s->lock);
+	snprintf(s->diff_dir, sizeof(s->diff_dir), "%s", (dir != NULL) ? dir : "");
+	pthread_mutex_unlock(&s->lock);
+}
+
+int s6prog_set_partial(struct s6prog * s, const char * geometry)
+{
+	struct bit_geometry * g = NULL;
+	
+	if((geometry != NULL) && (((g = malloc(sizeof(struct bit_geometry))) == NULL) || bit_geometry_load(geometry, g)))
+	{
+		free(g);
+		return 1;
+	}
+	
+	pthread_mutex_lock(&s->lock);
+	free(s->geometry);
+	s->geometry = g;
+	pthread_mutex_unlock(&s->lock);
+	
+	return 0;
+}
+
+void s6prog_set_verbose(struct s6prog * s, int verbose)
+{
+	pthread_mutex_lock(&s->lock);
+	s->verbose = verbose;
+	pthread_mutex_unlock(&s->lock);
+}
+
+int s6prog_idcode(struct s6prog * s, uint32_t * idcode)
+{
+	int ret;
+	
+	pthread_mutex_lock(&s->lock);
+	ret = jtag_get_idcode(&s->jtag, (int *)idcode);
+	pthread_mutex_unlock(&s->lock);
+	
+	return ret;
+}
+
+const char * s6prog_register_name(int reg)
+{
+	return bit_register_name(reg);
+}
+
+// shift the 16 bit configuration words in 'words' into CFG_IN, msb
+// first like the configuration data
+static int session_cfg_write(struct s6prog * s, const uint16_t * words, int n)
+{
+	unsigned char buf[64];
+	int i;
+	
+	for(i = 0; i < n; i++)
+	{
+		buf[i * 2] = words[i] >> 8;
+		buf[i * 2 + 1] = words[i];
+	}
+	
+	jtag_ir_write(&s->jtag, JTAG_INSTR_CFG_IN);
+	return jtag_cfg_write(&s->jtag, buf, n * 16);
+}
+
+/*
+ Register readback through the packet processor, as in the status
+ register readback sequence of UG380: synchronize, issue a type 1 read
+ of the register, shift its words out of CFG_OUT, then desynchronize so
+ a following configuration starts from scratch.
+*/
+
+static int session_read_register(struct s6prog * s, int reg, uint16_t * words, int n)
+{
+	const uint16_t desync[] = {0x30a1, 0x000d, 0x2000, 0x2000};
+	uint16_t cmd[] = {0xffff, 0xaa99, 0x5566, 0x2000, 0x2800 | (reg << 5) | n, 0x2000, 0x2000};
+	unsigned char buf[64];
+	int i;
+	
+	if((reg < 0) || (reg > 0x3f) || (n < 1) || (n > 31))
+		return session_error(s, "bad register read");
+	
+	if(session_cfg_write(s, cmd, sizeof(cmd) / sizeof(cmd[0])))
+		return session_error(s, "could not write register read command");
+	
+	jtag_ir_write(&s->jtag, JTAG_INSTR_CFG_OUT);
+	if(jtag_cfg_read(&s->jtag, buf, n * 16))
+		return session_error(s, "could not read register");
+	
+	for(i = 0; i < n; i++)
+		words[i] = (buf[i * 2] << 8) | buf[i * 2 + 1];
+	
+	if(session_cfg_write(s, desync, sizeof(desync) / sizeof(desync[0])))
+		return session_error(s, "could not desynchronize");
+	
+	jtag_to_tlr(&s->jtag);
+	jtag_tlr_to_rti(&s->jtag);
+	return jtag_send(&s->jtag);
+}
+
+int s6prog_read_register(struct s6prog * s, int reg, uint16_t * words, int n)
+{
+	int ret;
+	
+	pthread_mutex_lock(&s->lock);
+	ret = session_read_register(s, reg, words, n);
+	pthread_mutex_unlock(&s->lock);
+	
+	return ret;
+}
+
+// the dna is shifted out of ISC_DNA msb first, and ISC_DNA is only
+// valid with in system configuration enabled
+static int session_dna(struct s6prog * s, uint64_t * dna)
+{
+	struct jtag * jtag = &s->jtag;
+	unsigned char buf[8];
+	int i;
+	
+	jtag_ir_write(jtag, JTAG_INSTR_ISC_ENABLE);
+	jtag_rti_wait(jtag, JTAG_ISC_CYCLES);
+	
+	jtag_ir_write(jtag, JTAG_INSTR_ISC_DNA);
+	if(jtag_dr_read(jtag, buf, JTAG_DNA_BITS))
+		return session_error(s, "could not read dna");
+	
+	jtag_ir_write(jtag, JTAG_INSTR_ISC_DISABLE);
+	jtag_rti_wait(jtag, JTAG_ISC_CYCLES);
+	jtag_to_tlr(jtag);
+	jtag_tlr_to_rti(jtag);
+	if(jtag_send(jtag))
+		return session_error(s, "could not disable isc");
+	
+	*dna = 0;
+	for(i = 0; i < JTAG_DNA_BITS; i++)
+		*dna = (*dna << 1) | ((buf[i / 8] >> (i % 8)) & 1);
+	
+	return 0;
+}
+
+int s6prog_dna(struct s6prog * s, uint64_t * dna)
+{
+	int ret;
+	
+	pthread_mutex_lock(&s->lock);
+	ret = session_dna(s, dna);
+	pthread_mutex_unlock(&s->lock);
+	
+	return ret;
+}
+
+// shut the FPGA down and load CFG_IN ready for the configuration data,
+// the tap must be in the rti state
+static int session_shutdown(struct s6prog * s)
+{
+	struct jtag * jtag = &s->jtag;
+	unsigned char status;
+	long cycles;
+	double t;
+	
+	// enable in system configuration
+	jtag_ir_write(jtag, JTAG_INSTR_JSHUTDOWN);
+	
+	// wait in RTI for FPGA to shut down, until DONE goes low if polling
+	if(s->poll)
+	{
+		t = transport_now();
+		if(jtag_poll_status(jtag, JTAG_INSTR_JSHUTDOWN, JTAG_IR_CAPTURE_DONE, 0,
+			JTAG_SHUTDOWN_MIN_CYCLES, s->timeout_ms * 1000, &status, &cycles))
+			return session_error(s, "timed out waiting for shutdown");
+		session_printf(s, "shutdown took %.3f ms, %ld TCK cycles (status 0x%02x)\n",
+			(transport_now() - t) * 1e3, cycles, status);
+	} else
+		jtag_rti_wait(jtag, JTAG_SHUTDOWN_CYCLES);
+	
+	// load CFG_IN instruction
+	jtag_ir_write(jtag, JTAG_INSTR_CFG_IN);
+	
+	return 0;
+}
+
+// start the FPGA once the configuration data has been shifted in, and
+// leave the tap in rti
+static int session_startup(struct s6prog * s)
+{
+	struct jtag * jtag = &s->jtag;
+	unsigned char status;
+	long cycles;
+	double t;
+	
+	// disable in system configuration
+	jtag_ir_write(jtag, JTAG_INSTR_JSTART);
+	
+	// wait in RTI for FPGA to restart, until DONE goes high if polling
+	if(s->poll)
+	{
+		t = transport_now();
+		if(jtag_poll_status(jtag, JTAG_INSTR_JSTART, JTAG_IR_CAPTURE_DONE, JTAG_IR_CAPTURE_DONE,
+			JTAG_STARTUP_MIN_CYCLES, s->timeout_ms * 1000, &status, &cycles))
+		{
+			session_printf(s, "startup status 0x%02x after %ld TCK cycles\n", status, cycles);
+			if(!(status & JTAG_IR_CAPTURE_INIT))
+				return session_error(s, "INIT low during startup, configuration error");
+			return session_error(s, "timed out waiting for startup");
+		}
+		session_printf(s, "startup took %.3f ms, %ld TCK cycles (status 0x%02x)\n",
+			(transport_now() - t) * 1e3, cycles, status);
+	} else
+		jtag_rti_wait(jtag, JTAG_STARTUP_CYCLES);
+	
+	// reset the tap and leave it in RTI for the next operation
+	jtag_to_tlr(jtag);
+	jtag_tlr_to_rti(jtag);
+	
+	if(jtag_send(jtag))
+		return session_error(s, "could not disable isc");
+	
+	return 0;
+}
+
+/*
+ Each board has a record of the image last loaded into it: the hash of
+ the configuration data and of each of its frames. It is dropped before
+ the FPGA is shut down and written again once it has started, so it
+ never names an image that did not finish loading.
+
+ The record says what was last loaded from here, not what the FPGA
+ holds now, which something else may have loaded since. So on its own
+ it only reports what has changed, and the image is loaded in full.
+ With the frame layout of the part (s6prog_set_partial), frames are
+ read back and hashed first: DIFF_SAMPLE_FRAMES spread over the image,
+ and up to DIFF_CHANGED_FRAMES of those that changed, which tell the
+ image last loaded from the new one. Only if DONE is high and they all
+ match the record is the FPGA left running the same image, or given a
+ partial bitstream of the frames that changed.
+*/
+
+struct last_header
+{
+	char magic[8];
+	uint64_t data_hash;
+	uint64_t length;
+	uint64_t frames;
+};
+
+// the path of the record of the board on session 's', named by the
+// device dna or else by the adapter serial number. returns 1 if there
+// is neither.
+static int session_last_path(struct s6prog * s, char * path, int n)
+{
+	if(!s->has_dna)
+		s->has_dna = (session_dna(s, &s->dna) == 0);
+	
+	if(s->has_dna)
+		return (snprintf(path, n, "%s/last-%016llx", s->diff_dir, (unsigned long long)s->dna) >= n);
+	if(s->serial[0] != '\0')
+		return (snprintf(path, n, "%s/last-serial-%s", s->diff_dir, s->serial) >= n);
+	return 1;
+}
+
+static int session_read_frames(struct s6prog * s, uint32_t far, size_t words, jtag_read_out out, void * arg);
+
+// a frame read back, after the pad frame
+struct frame_read
+{
+	unsigned char buf[2 * BIT_FRAME_BYTES];
+	size_t pos;
+};
+
+static int frame_read_chunk(void * arg, const unsigned char * buf, int n)
+{
+	struct frame_read * r = (struct frame_read *)arg;
+	size_t len = ((size_t)n < sizeof(r->buf) - r->pos) ? (size_t)n : sizeof(r->buf) - r->pos;
+	
+	memcpy(&r->buf[r->pos], buf, len);
+	r->pos += len;
+	return 0;
+}
+
+// read back a sample of the frames of 'image', those set in 'changed'
+// first among them, and compare them with the hashes 'last' of the image
+// last loaded. returns 1 if they can not be read or do not all match.
+static int session_diff_confirm(struct s6prog * s, const struct s6prog_image * image, const uint64_t * last,
+	const unsigned char * changed)
+{
+	struct frame_read r;
+	uint32_t * fars;
+	size_t i, frames, stride, picked = 0, read = 0, bad = 0;
+	
+	if(image->data == NULL)
+	{
+		session_printf(s, "the image has been compiled, so its frames can not be found to compare\n");
+		return 1;
+	}
+	if(bit_frame_addresses(image->data, &image->packets, s->geometry, &fars, &frames))
+		return 1;
+	if(frames != image->frames)
+	{
+		free(fars);
+		return 1;
+	}
+	
+	stride = frames / DIFF_SAMPLE_FRAMES + 1;
+	for(i = 0; (i < frames) && (bad == 0); i++)
+	{
+		if(changed[i] && (picked < DIFF_CHANGED_FRAMES))
+			picked++;
+		else if(i % stride != 0)
+			continue;
+		
+		memset(&r, 0, sizeof(r));
+		if(session_read_frames(s, fars[i], 2 * BIT_FRAME_WORDS, frame_read_chunk, &r))
+		{
+			free(fars);
+			return 1;
+		}
+		bad += (bit_frame_hash(&r.buf[BIT_FRAME_BYTES]) != last[i]);
+		read++;
+	}
+	free(fars);
+	
+	if(bad > 0)
+		session_printf(s, "frame %zu read back is not the one last loaded\n", i - 1);
+	else
+		session_printf(s, "%zu frames read back match the image last loaded\n", read);
+	return (bad > 0);
+}
+
+// a partial bitstream of the frames of 'image' set in 'changed', in a
+// new buffer at 'partial'. returns 1 if there is none.
+static int session_partial(struct s6prog * s, const struct s6prog_image * image, const unsigned char * changed,
+	unsigned char ** partial, size_t * length)
+{
+	if(bit_partial(image->data, image->length, &image->packets, s->geometry, changed, NULL, length))
+	{
+		session_printf(s, "the frame data is not whole frames, so it can not be written in part\n");
+		return 1;
+	}
+	
+	if(((*partial = malloc(*length + 1)) == NULL) ||
+		bit_partial(image->data, image->length, &image->packets, s->geometry, changed, *partial, length))
+	{
+		free(*partial);
+		*partial = NULL;
+		return 1;
+	}
+	
+	return 0;
+}
+
+// compare 'image' with the record of the image last loaded. returns 1
+// if the FPGA is still running that very image. with a frame layout, a
+// partial bitstream to load instead of the image may be put at
+// 'partial'.
+static int session_diff(struct s6prog * s, const struct s6prog_image * image, unsigned char ** partial,
+	size_t * partial_length)
+{
+	char path[CACHE_PATH_SIZE];
+	struct last_header hdr;
+	uint64_t * last = NULL;
+	unsigned char * changed;
+	unsigned char status;
+	size_t n;
+	FILE * f;
+	int ok, same, ret = 0;
+	
+	if(session_last_path(s, path, sizeof(path)))
+		return 0;
+	
+	if((f = fopen(path, "rb")) == NULL)
+	{
+		session_printf(s, "no record of the image last loaded into this board\n");
+		return 0;
+	}
+	
+	ok = (fread(&hdr, sizeof(hdr), 1, f) == 1) && (memcmp(hdr.magic, LAST_MAGIC, sizeof(hdr.magic)) == 0) &&
+		(hdr.frames < SIZE_MAX / sizeof(uint64_t)) &&
+		((last = malloc(hdr.frames * sizeof(uint64_t) + 1)) != NULL) &&
+		(fread(last, sizeof(uint64_t), hdr.frames, f) == hdr.frames);
+	fclose(f);
+	if(!ok || ((changed = malloc(image->frames + 1)) == NULL))
+	{
+		free(last);
+		session_printf(s, "warning: bad record %s, ignoring it\n", path);
+		return 0;
+	}
+	
+	n = bit_frame_diff(last, hdr.frames, image->frame_hashes, image->frames, changed);
+	same = (n == 0) && (hdr.data_hash == image->data_hash) && (hdr.length == image->length);
+	if(same)
+		session_printf(s, "this image was loaded last\n");
+	else
+		session_printf(s, "%zu of %zu frames changed since the last load\n", n, image->frames);
+	
+	// DONE is low if anything has cleared the FPGA since
+	if(s->geometry == NULL)
+		session_printf(s, "loading it in full, there is no frame layout to check the fpga against\n");
+	else if(hdr.frames != image->frames)
+		session_printf(s, "loading it in full, the images have different frames\n");
+	else if(jtag_ir_rw(&s->jtag, JTAG_INSTR_BYPASS, &status) || !(status & JTAG_IR_CAPTURE_DONE))
+		session_printf(s, "loading it in full, the fpga is not running\n");
+	else if(session_diff_confirm(s, image, last, changed))
+		session_printf(s, "loading it in full, the fpga does not hold the image last loaded\n");
+	else if(same)
+	{
+		session_printf(s, "the fpga is still running this image, leaving it be\n");
+		ret = 1;
+	} else if(session_partial(s, image, changed, partial, partial_length) == 0)
+		session_printf(s, "loading only the %zu changed frames\n", n);
+	
+	free(last);
+	free(changed);
+	return ret;
+}
+
+// drop the record before the FPGA is shut down
+static void session_last_forget(struct s6prog * s)
+{
+	char path[CACHE_PATH_SIZE];
+	
+	if((s->diff_dir[0] != '\0') && !session_last_path(s, path, sizeof(path)))
+		unlink(path);
+}
+
+// record 'image' as the one last loaded, once the FPGA has started. the
+// file is written under a temporary name and renamed, like the stream
+// cache.
+static void session_last_save(struct s6prog * s, const struct s6prog_image * image)
+{
+	char path[CACHE_PATH_SIZE], tmp[CACHE_PATH_SIZE + 32];
+	struct last_header hdr;
+	FILE * f;
+	int ret;
+	
+	if((s->diff_dir[0] == '\0') || image_hash_frames(image) || session_last_path(s, path, sizeof(path)) ||
+		cache_make_dir(s->diff_dir))
+		return;
+	
+	snprintf(tmp, sizeof(tmp), "%s.%d.%lx", path, (int)getpid(), (unsigned long)pthread_self());
+	if((f = fopen(tmp, "wb")) == NULL)
+		return;
+	
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, LAST_MAGIC, sizeof(hdr.magic));
+	hdr.data_hash = image->data_hash;
+	hdr.length = image->length;
+	hdr.frames = image->frames;
+	
+	ret = (fwrite(&hdr, sizeof(hdr), 1, f) != 1);
+	ret |= (fwrite(image->frame_hashes, sizeof(uint64_t), image->frames, f) != image->frames);
+	ret |= (fclose(f) != 0);
+	
+	if(ret || rename(tmp, path))
+	{
+		session_printf(s, "warning: could not write %s\n", path);
+		unlink(tmp);
+	}
+}
+
+// load 'image' into the FPGA, the tap must be in the rti state
+static int session_program(struct s6prog * s, const struct s6prog_image * image)
+{
+	struct jtag * jtag = &s->jtag;
+	const unsigned char * data;
+	unsigned char * partial = NULL;
+	size_t length;
+	double t;
+	int ret;
+	
+	if(session_check_part(s, image->part) || session_check_packets(s, &image->packets))
+		return 1;
+	
+	if(image->bit.design[0] != '\0')
+		session_printf(s, "design %s for %s, built %s %s\n", image->bit.design, image->bit.part,
+			image->bit.date, image->bit.time);
+	session_printf(s, "%d packets, %zu frame data words, %d crc checks\n", image->packets.packets,
+		image->packets.fdri_words, image->packets.crc_writes);
+	
+	if((s->diff_dir[0] != '\0') && image_hash_frames(image))
+		session_printf(s, "warning: the image was compiled without its frame hashes, not comparing it\n");
+	else if((s->diff_dir[0] != '\0') && session_diff(s, image, &partial, &length))
+		return 0;
+	session_last_forget(s);
+	
+	if(session_shutdown(s))
+	{
+		free(partial);
+		return 1;
+	}
+	
+	// write the configuration to the data register, or only the frames
+	// that changed
+	t = transport_now();
+	if(partial != NULL)
+		data = partial;
+	else
+		data = image_shift_data(image, &length);
+	if((image->stream != NULL) && (partial == NULL))
+		ret = jtag_send_raw(jtag, image->stream, image->stream_length);
+	else
+		ret = jtag_cfg_write(jtag, data, length * 8);
+	ret = ret || jtag_sync(jtag);
+	free(partial);
+	if(ret)
+		return session_error(s, "could not write configuration to data register");
+	t = transport_now() - t;
+	
+	session_printf(s, "sent %zu configuration bytes to fpga in %.3f ms (%.2f MB/s)\n",
+		length, t * 1e3, length / (t * 1024 * 1024));
+	
+	if(session_startup(s))
+		return 1;
+	session_last_save(s, image);
+	
+	return 0;
+}
+
+int s6prog_program(struct s6prog * s, const struct s6prog_image * image)
+{
+	int ret;
+	
+	pthread_mutex_lock(&s->lock);
+	ret = session_program(s, image);
+	pthread_mutex_unlock(&s->lock);
+	
+	return ret;
+}
+
+/*
+ Verification reads the frames of each FDRI write back out of FDRO, as
+ in the readback sequence of UG380: synchronize, set FAR to where the
+ write started, issue RCFG and a type 2 read of FDRO, shift the words
+ out of CFG_OUT, then desynchronize. The FPGA sends a pad frame before
+ the frames themselves.
+
+ The readback is compared with the image chunk by chunk as CFG_OUT
+ shifts it, so no copy of it is kept whatever the size of the device.
+ Bits set in the mask, if one is given, are left out of the compare.
+*/
+
+struct verify
+{
+	// the frames expected and the mask of each bit, both without the
+	// pad frame
+	const unsigned char * expect;
+	const unsigned char * mask;
+	size_t length;
+	
+	// bytes read back so far, the pad frame included
+	size_t pos;
+	
+	// bits that differ, the frames they are in and the first of those
+	size_t bits;
+	size_t bad_frames;
+	size_t first_bad;
+	size_t last_bad;
+};
+
+// compare a chunk of readback, a frame at a time
+static int verify_chunk(void * arg, const unsigned char * buf, int n)
+{
+	struct verify * v = (struct verify *)arg;
+	size_t i, len, bits;
+	
+	while(n > 0)
+	{
+		if(v->pos < BIT_FRAME_BYTES)
+			len = BIT_FRAME_BYTES - v->pos;
+		else if((i = v->pos - BIT_FRAME_BYTES) >= v->length)
+			len = n;
+		else
+		{
+			len = BIT_FRAME_BYTES - (i % BIT_FRAME_BYTES);
+			if(len > (size_t)n)
+				len = n;
+			
+			bits = bit_compare(buf, &v->expect[i], (v->mask != NULL) ? &v->mask[i] : NULL, len);
+			if((bits > 0) && (v->last_bad != i / BIT_FRAME_BYTES))
+			{
+				if(v->bad_frames++ == 0)
+					v->first_bad = i / BIT_FRAME_BYTES;
+				v->last_bad = i / BIT_FRAME_BYTES;
+			}
+			v->bits += bits;
+		}
+		
+		if(len > (size_t)n)
+			len = n;
+		buf += len;
+		n -= len;
+		v->pos += len;
+	}
+	
+	return 0;
+}
+
+// read back 'words' words of frames from frame address 'far', the pad
+// frame first, passing them to 'out' as they arrive
+static int session_read_frames(struct s6prog * s, uint32_t far, size_t words, jtag_read_out out, void * arg)
+{
+	const uint16_t desync[] = {0x30a1, 0x000d, 0x2000, 0x2000};
+	const uint16_t cmd[] = {0xffff, 0xaa99, 0x5566, 0x2000,
+		0x3022, far >> 16, far & 0xffff,
+		0x30a1, BIT_CMD_RCFG, 0x2000,
+		0x2880, 0x4800, words >> 16, words & 0xffff, 0x2000, 0x2000};
+	int ret;
+	
+	if(session_cfg_write(s, cmd, sizeof(cmd) / sizeof(cmd[0])))
+		return session_error(s, "could not write readback command");
+	
+	// the configuration logic is desynchronized and the tap reset even
+	// when the read fails, so that the next job finds them as usual
+	jtag_ir_write(&s->jtag, JTAG_INSTR_CFG_OUT);
+	if((ret = jtag_dr_read_to(&s->jtag, words * 2, JTAG_MSB_FIRST, out, arg)))
+		session_error(s, "could not read back frames");
+	
+	if(session_cfg_write(s, desync, sizeof(desync) / sizeof(desync[0])))
+		ret = session_error(s, "could not desynchronize");
+	
+	jtag_to_tlr(&s->jtag);
+	jtag_tlr_to_rti(&s->jtag);
+	return jtag_send(&s->jtag) || ret;
+}
+
+// the next FDRI write of at least two frames, returns 0 if there is none
+static int verify_next_write(struct bit_parser * bp, struct bit_packet * pkt, uint32_t * far)
+{
+	while(bit_next_packet(bp, pkt) > 0)
+	{
+		// follow the frame address each write starts from
+		if((pkt->op != BIT_OP_WRITE) || (pkt->words == 0))
+			continue;
+		if((pkt->reg == BIT_REG_FAR_MAJ) && (pkt->words >= 2))
+			*far = ((uint32_t)pkt->data[0] << 24) | (pkt->data[1] << 16) | (pkt->data[2] << 8) | pkt->data[3];
+		else if(pkt->reg == BIT_REG_FAR_MIN)
+			*far = (*far & 0xffff0000) | (pkt->data[0] << 8) | pkt->data[1];
+		else if((pkt->reg == BIT_REG_FDRI) && (pkt->words >= 2 * BIT_FRAME_WORDS))
+			return 1;
+	}
+	
+	return 0;
+}
+
+static int session_verify(struct s6prog * s, const struct s6prog_image * image, const struct s6prog_image * mask)
+{
+	struct bit_parser bp, mp;
+	struct bit_packet pkt, mpkt;
+	struct verify v;
+	uint32_t far = 0, mask_far = 0;
+	size_t frames = 0, bits = 0, bad = 0, first_bad = 0;
+	char msg[128];
+	double t;
+	
+	if((image->data == NULL) || ((mask != NULL) && (mask->data == NULL)))
+		return session_error(s, "configuration data has been released, it cannot be verified");
+	
+	bit_parser_init(&bp, image->data, image->packets.end_offset);
+	if(mask != NULL)
+		bit_parser_init(&mp, mask->data, mask->packets.end_offset);
+	
+	t = transport_now();
+	while(verify_next_write(&bp, &pkt, &far))
+	{
+		memset(&v, 0, sizeof(v));
+		v.expect = pkt.data;
+		v.length = (pkt.words / BIT_FRAME_WORDS - 1) * BIT_FRAME_BYTES;
+		v.last_bad = SIZE_MAX;
+		
+		// the mask has the same frame data writes as the image
+		if(mask != NULL)
+		{
+			if(!verify_next_write(&mp, &mpkt, &mask_far) || (mpkt.words != pkt.words))
+				return session_error(s, "the mask does not match the image");
+			v.mask = mpkt.data;
+		}
+		
+		if(session_read_frames(s, far, pkt.words, verify_chunk, &v))
+			return 1;
+		
+		if((v.bad_frames > 0) && (bad == 0))
+			first_bad = frames + v.first_bad;
+		frames += v.length / BIT_FRAME_BYTES;
+		bits += v.bits;
+		bad += v.bad_frames;
+	}
+	t = transport_now() - t;
+	
+	if(bad > 0)
+	{
+		snprintf(msg, sizeof(msg), "%zu bits differ in %zu of %zu frames read back, the first in frame %zu",
+			bits, bad, frames, first_bad);
+		return session_error(s, msg);
+	}
+	
+	session_printf(s, "verified %zu frames%s in %.3f ms\n", frames, (mask != NULL) ? " against the mask" : "",
+		t * 1e3);
+	return 0;
+}
+
+int s6prog_verify(struct s6prog * s, const struct s6prog_image * image, const struct s6prog_image * mask)
+{
+	int ret;
+	
+	pthread_mutex_lock(&s->lock);
+	ret = session_verify(s, image, mask);
+	pthread_mutex_unlock(&s->lock);
+	
+	return ret;
+}
+
+/*
+ Streaming programs from a file descriptor, so that the input can be a
+ pipe and need not fit in memory. It is read in blocks of
+ STREAM_BLOCK_SIZE bytes and each block is shifted as soon as it is
+ full, while the next is read. The last byte of a block is held back
+ and shifted with the next one, because only at the end of the input
+ is it known which bit has to leave shift-dr.
+
+ Compressed input is decompressed on another thread, a block at a time,
+ so decompression overlaps with the shift as well.
+
+ The first block is read and its packets checked before the FPGA is
+ shut down, so an empty or unreadable input, or one for another part,
+ leaves it running.
+*/
+
+struct stream
+{
+	int fd;
+	
+	// bytes still to be read, the length of the data field of a .bit
+	// file or STREAM_UNLIMITED to read to the end
+	size_t left;
+	
+	// reading from a decompression thread rather than 'fd' itself
+	struct decompress_thread * dt;
+};
+
+// read up to 'size' bytes from 'st' into 'buf', fewer only at the end
+// of the input. returns the number read or -1 on error.
+static ssize_t stream_fill(struct stream * st, unsigned char * buf, size_t size)
+{
+	size_t length = 0;
+	ssize_t n;
+	
+	if(size > st->left)
+		size = st->left;
+	
+	if(st->dt != NULL)
+	{
+		if((n = decompress_read(st->dt, buf, size)) < 0)
+			return -1;
+		length = n;
+	}
+	
+	while((st->dt == NULL) && (length < size))
+	{
+		n = read(st->fd, buf + length, size - length);
+		if((n < 0) && (errno == EINTR))
+			continue;
+		if(n < 0)
+			return -1;
+		if(n == 0)
+			break;
+		length += n;
+	}
+	
+	if(st->left != STREAM_UNLIMITED)
+		st->left -= length;
+	
+	return length;
+}
+
+// if the first block 'buf' of 'n' bytes starts a .bit file, check the
+// part it is for and move the configuration data after the header to
+// the front of 'buf', topping it up from 'st'
+static int session_stream_bit(struct s6prog * s, struct stream * st, unsigned char * buf, ssize_t * n)
+{
+	const struct bit_part * part;
+	struct bit_header hdr;
+	ssize_t m;
+	
+	if(!bit_is_bit_file(buf, *n))
+		return 0;
+	
+	if(bit_parse_header(buf, *n, &hdr) || (hdr.data_length < 1))
+		return session_error(s, "bad or truncated .bit file header");
+	
+	if((part = bit_part_by_name(hdr.part)) == NULL)
+		session_printf(s, "warning: unknown part %s, it will not be checked against the device\n", hdr.part);
+	if(session_check_part(s, part))
+		return 1;
+	session_printf(s, "design %s for %s, built %s %s\n", hdr.design, hdr.part, hdr.date, hdr.time);
+	
+	*n -= hdr.data_offset;
+	memmove(buf, buf + hdr.data_offset, *n);
+	if((size_t)*n >= hdr.data_length)
+	{
+		*n = hdr.data_length;
+		st->left = 0;
+	} else
+		st->left = hdr.data_length - *n;
+	
+	if((m = stream_fill(st, buf + *n, STREAM_BLOCK_SIZE - *n)) < 0)
+		return session_error(s, "could not read configuration data");
+	*n += m;
+	
+	return 0;
+}
+
+// shift the configuration data from 'st' into CFG_IN, starting with the
+// 'n' bytes already read into 'buf'. 'total' is the number of bytes
+// shifted.
+static int session_stream(struct s6prog * s, struct stream * st, unsigned char * buf, ssize_t n, size_t * total)
+{
+	struct jtag * jtag = &s->jtag;
+	
+	*total = n;
+	jtag_dr_begin(jtag);
+	
+	while(n == STREAM_BLOCK_SIZE)
+	{
+		if(jtag_dr_continue(jtag, buf, n - 1, JTAG_MSB_FIRST))
+			return session_error(s, "could not write configuration to data register");
+		
+		buf[0] = buf[n - 1];
+		if((n = stream_fill(st, buf + 1, STREAM_BLOCK_SIZE - 1)) < 0)
+			return session_error(s, "could not read configuration data");
+		*total += n;
+		n++;
+	}
+	
+	// a .bit file that ends before its data field does
+	if((st->left != STREAM_UNLIMITED) && (st->left > 0))
+		return session_error(s, "configuration data is cut short");
+	
+	if(jtag_dr_continue(jtag, buf, n - 1, JTAG_MSB_FIRST) ||
+		jtag_dr_end(jtag, buf + n - 1, 8, JTAG_MSB_FIRST) || jtag_sync(jtag))
+		return session_error(s, "could not write configuration to data register");
+	
+	return 0;
+}
+
+// program from 'st', with 'buf' to read it into
+static int session_program_stream(struct s6prog * s, struct stream * st, unsigned char * buf)
+{
+	struct jtag * jtag = &s->jtag;
+	const struct decompressor * d;
+	struct bit_summary sum;
+	size_t total;
+	ssize_t n;
+	double t;
+	
+	if((n = stream_fill(st, buf, STREAM_BLOCK_SIZE)) < 0)
+		return session_error(s, "could not read configuration data");
+	
+	// compressed input is decompressed on a thread of its own while it
+	// is shifted, starting again from the bytes already read
+	if((d = decompressor_find(buf, n)) != NULL)
+	{
+		if((st->dt = decompress_start(d, st->fd, buf, n)) == NULL)
+			return session_error(s, "could not start decompression");
+		session_printf(s, "decompressing %s input\n", d->name);
+		if((n = stream_fill(st, buf, STREAM_BLOCK_SIZE)) < 0)
+			return session_error(s, "could not decompress configuration data");
+	}
+	
+	if(session_stream_bit(s, st, buf, &n))
+		return 1;
+	
+	if(n < 1)
+		return session_error(s, "no configuration data");
+	
+	// only the first block can be checked before the shift, but the sync
+	// word and the IDCODE write come well within it
+	if(bit_check_packets(buf, n, n == STREAM_BLOCK_SIZE, &sum))
+		return session_error(s, "configuration data is not valid");
+	if(session_check_packets(s, &sum))
+		return 1;
+	
+	session_last_forget(s);
+	if(session_shutdown(s))
+		return 1;
+	
+	t = transport_now();
+	if(session_stream(s, st, buf, n, &total))
+	{
+		// the tap may have been left in shift-dr, so put it back in rti
+		jtag_clear(jtag);
+		jtag_to_tlr(jtag);
+		jtag_tlr_to_rti(jtag);
+		jtag_send(jtag);
+		return 1;
+	}
+	t = transport_now() - t;
+	
+	session_printf(s, "streamed %zu configuration bytes to fpga in %.3f ms (%.2f MB/s)\n",
+		total, t * 1e3, total / (t * 1024 * 1024));
+	
+	return session_startup(s);
+}
+
+static int session_program_fd(struct s6prog * s, int fd)
+{
+	struct stream st = {fd, STREAM_UNLIMITED, NULL};
+	unsigned char * buf;
+	int ret;
+	
+	if((buf = malloc(STREAM_BLOCK_SIZE)) == NULL)
+		return session_error(s, "could not allocate stream buffer");
+	
+	ret = session_program_stream(s, &st, buf);
+	ret |= decompress_finish(st.dt);
+	free(buf);
+	
+	return ret;
+}
+
+int s6prog_program_fd(struct s6prog * s, int fd)
+{
+	int ret;
+	
+	pthread_mutex_lock(&s->lock);
+	ret = session_program_fd(s, fd);
+	pthread_mutex_unlock(&s->lock);
+	
+	return ret;
+}
+
+////////////////////////////////////////////////////////////////////////
+// benchmarks
+////////////////////////////////////////////////////////////////////////
+
+// time the host side encoding of a 'mb' megabyte data register write
+// with the data copied into the commands and queued by reference. what
+// would be copied into the usb transfers is copied into a scratch
+// buffer instead, so no device is needed. the scratch buffer is reused
+// like the transfers are and stays in cache, so the figures are the cpu
+// time spent per megabyte, not a rate the usb link could reach.
+int s6prog_bench_encode(int mb)
+{
+	unsigned char * data, * buf, * sink;
+	int length = mb * 1024 * 1024;
+	int zc, rep, reps = 16;
+	struct jtag jtag;
+	double t;
+	
+	data = malloc(length);
+	buf = malloc(JTAG_BUFFER_SIZE);
+	sink = malloc(JTAG_BUFFER_SIZE);
+	if((data == NULL) || (buf == NULL) || (sink == NULL))
+	{
+		free(data);
+		free(buf);
+		free(sink);
+		return 1;
+	}
+	memset(data, 0x5a, length);
+	
+	jtag_defaults(&jtag);
+	jtag.buf = buf;
+	jtag.sink = sink;
+	
+	for(zc = 0; zc < 2; zc++)
+	{
+		jtag.zero_copy = zc;
+		t = transport_now();
+		for(rep = 0; rep < reps; rep++)
+			jtag_dr_write(&jtag, data, length * 8);
+		t = transport_now() - t;
+		printf("encode %-12s %10.3f us of cpu per MB\n", zc ? "by reference" : "copied", t * 1e6 / ((double)mb * reps));
+	}
+	printf("the jtag link takes %.3f us per MB\n", 1048576 * 8e6 / jtag_tck_hz());
+	
+	free(sink);
+	free(buf);
+	free(data);
+	
+	return 0;
+}
+
+// shift 'mb' megabytes through the BYPASS register with each chunk
+// size from JTAG_SWEEP_MIN_CHUNK up to the largest a command can carry
+// and report the write and read throughput of each
+int s6prog_bench_chunk_sweep(struct s6prog * s, int mb)
+{
+	struct jtag * jtag = &s->jtag;
+	unsigned char * data;
+	int length = mb * 1024 * 1024;
+	int size, saved, ret = 0;
+	double tw, tr;
+	
+	if((data = malloc(length)) == NULL)
+		return 1;
+	memset(data, 0x5a, length);
+	
+	pthread_mutex_lock(&s->lock);
+	saved = jtag->chunk_size;
+	
+	jtag_ir_write(jtag, JTAG_INSTR_BYPASS);
+	
+	for(size = JTAG_SWEEP_MIN_CHUNK; (size <= JTAG_CHUNK_SIZE) && (ret == 0); size *= 2)
+	{
+		if(jtag_set_chunk_size(jtag, size))
+		{
+			ret = 1;
+			break;
+		}
+		
+		tw = transport_now();
+		ret |= jtag_dr_write(jtag, data, length * 8);
+		ret |= jtag_sync(jtag);
+		tw = transport_now() - tw;
+		
+		tr = transport_now();
+		ret |= jtag_dr_read(jtag, data, length * 8);
+		tr = transport_now() - tr;
+		
+		printf("chunk %6d  write %8.2f MB/s  read %8.2f MB/s\n", jtag->chunk_size, mb / tw, mb / tr);
+	}
+	
+	jtag_set_chunk_size(jtag, saved);
+	pthread_mutex_unlock(&s->lock);
+	free(data);
+	
+	return ret;
+}
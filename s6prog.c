@@ -1,747 +1,506 @@
 /*
-Programs a Spartan 6 FPGA over JTAG using an FTDI FT232H chip.
+Programs Spartan 6 FPGAs over JTAG using FTDI FT232H chips.
 
-Takes a ".bin" file as input, which can be output from ISE.
+Takes a ".bin" or ".bit" file as input, which can be output from ISE. This is the
+command line front end of libs6prog, see s6prog.h.
 */
 
-#include <ftdi.h>
-#include <usb.h>
+#include "s6prog.h"
 
-#include <stdint.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <unistd.h>
 
-#define CLK_DIV_5_DISABLE (0x8a)
-#define CLK_DIV_5_ENABLE (0x8b)
-#define DATA_CLK_3_PHASE_ENABLE (0x8c)
-#define DATA_CLK_3_PHASE_DISABLE (0x8d)
-#define DATA_CLK_BITS (0x8e)
-#define DATA_CLK_BYTES (0x8f)
-#define ADAPTIVE_CLK_ENABLE (0x96)
-#define ADAPTIVE_CLK_DISABLE (0x97)
-
-#define JTAG_INSTR_ISC_DNA 		(0x30)	// (110000b)
-#define JTAG_INSTR_ISC_DISABLE 	(0x16)	// (010110b)
-#define JTAG_INSTR_ISC_NOOP 	(0x14)	// (010100b)
-#define JTAG_INSTR_ISC_PROGRAM 	(0x11)	// (010001b)
-#define JTAG_INSTR_ISC_ENABLE 	(0x10)	// (010000b)
-#define JTAG_INSTR_BYPASS 		(0x3f)	// (111111b)
-#define JTAG_INSTR_JSHUTDOWN 	(0x0d)	// (001101b)
-#define JTAG_INSTR_JSTART 		(0x0c)	// (001100b)
-#define JTAG_INSTR_JPROGRAM 	(0x0b)	// (001011b)
-#define JTAG_INSTR_HIGHZ 		(0x0a)	// (001010b)
-#define JTAG_INSTR_IDCODE 		(0x09)	// (001001b)
-#define JTAG_INSTR_USERCODE 	(0x08)	// (001000b)
-#define JTAG_INSTR_INTEST 		(0x07)	// (000111b)
-#define JTAG_INSTR_PRELOAD 		(0x01)	// (000001b)
-#define JTAG_INSTR_SAMPLE 		(0x01)	// (000001b)
-#define JTAG_INSTR_EXTEST 		(0x0f)	// (001111b)
-#define JTAG_INSTR_CFG_IN 		(0x05)	// (000101b)
-
-#define FDATA_SIZE (16 * 1024 * 1024)
-#define JTAG_BUFFER_SIZE (1024 * 1024)
-#define JTAG_CHUNK_SIZE (0x8000)
-#define JTAG_RECV_ATTEMPTS (20)
-#define JTAG_STARTUP_DELAY (500)
-#define JTAG_SHUTDOWN_DELAY (500)
-#define JTAG_TCK_DIVISOR_LOW (0)
-
-/*
- FT2232H pin definitions
-
- pin	| name		| mpsse function
- -------+-----------+---------------
- 13		| ADBUS0	| TCK
- 14		| ADBUS1	| TDI
- 15		| ADBUS2	| TDO
- 16		| ADBUS3	| TMS
- 17		| ADBUS4	| GPIOL0
- 18		| ADBUS5	| GPIOL1
- 19		| ADBUS6	| GPIOL2
- 20		| ADBUS7	| GPIOL3
-		|			|
- 21		| ACBUS0	| GPIOH0
- 25		| ACBUS1	| GPIOH1
- 26		| ACBUS2	| GPIOH2
- 27		| ACBUS3	| GPIOH3
- 28		| ACBUS4	| GPIOH4
- 29		| ACBUS5	| GPIOH5
- 30		| ACBUS6	| GPIOH6
- 31		| ACBUS7	| GPIOH7
-
- 0 is LSB, 7 is MSB
-
-
- *** MPSSE mode commands ***
-
- * SET_BITS_LOW, data, direction
-    sets low port bits and direction
- * SET_BITS_HIGH, data, direction
-    sets high port bits and direction
- * TCK_DIVISOR, div_low, div_high
-    sets the TCK divisor to {div_high, div_low}
-    rate = 60e6 / ((value + 1) * 2)
- * SEND_IMMEDIATE
-    immediately send whatever data is in the ftdi device's buffer to
-    the host.
-
-
- *** MPSSE shifting commands ***
-
- bit mode format:
-  {shifting command,
-   length in bits,
-   data byte}
-
- byte mode format:
-  {shifting command,
-   length in bytes high,
-   length in bytes low,
-   data byte 0,
-   ...,
-   data byte n}
-
- shifting command byte:
-  MPSSE_WRITE_NEG 0x01   Write TDI/DO on negative TCK/SK edge
-  MPSSE_BITMODE   0x02   Write bits, not bytes
-  MPSSE_READ_NEG  0x04   Sample TDO/DI on negative TCK/SK edge
-  MPSSE_LSB       0x08   LSB first
-  MPSSE_DO_WRITE  0x10   Write TDI/DO
-  MPSSE_DO_READ   0x20   Read TDO/DI
-  MPSSE_WRITE_TMS 0x40   Write TMS/CS
-
-  * MPSSE_DO_WRITE and MPSSE_WRITE_TMS cannot both be set
-  * cannot read and write on the same clock edge
-
-*/
+// largest number of boards programmed at once
+#define MAX_BOARDS (64)
 
+#define CACHE_DIR_SIZE (4096)
 
 ////////////////////////////////////////////////////////////////////////
-// low level jtag and ftdi device functions
+// boards
 ////////////////////////////////////////////////////////////////////////
 
+/*
+ A board is one adapter and the FPGA behind it. When several are
+ programmed at once each is driven from its own thread with its own
+ library session, and they all share the one loaded image.
+*/
 
-unsigned char * jtag_buf = NULL;
-int jtag_buf_i = 0;
-struct ftdi_context ftdi;
-
-int jtag_send()
+struct board
 {
-	//int i;
+	// serial number of the adapter, empty to use the first one found
+	char serial[S6PROG_SERIAL_SIZE];
 	
-	if(jtag_buf_i < 1)
-		return 1;
-	
-	//printf("jtag_send %d bytes:\n", jtag_buf_i);
-	//for(i = 0; (i < jtag_buf_i); i++)
-	//	printf("%02x ", jtag_buf[i]);
-	//printf("\n");
+	pthread_t thread;
+	int ret;
+	double time;
+};
+
+// transport the boards are opened through (NULL for the default), how
+// they wait for shutdown and startup, where the records of the last
+// image loaded are kept (NULL for none) and the frame layout to load
+// only the frames changed since (NULL for full loads), and the image
+// they all get, or the file descriptor the one board is streamed from.
+// with board_verify set the image is read back after it is loaded and
+// compared against it, leaving out the bits set in board_mask.
+char * board_transport = NULL;
+int board_poll = 0;
+long board_timeout_ms = S6PROG_POLL_TIMEOUT_MS;
+int board_chunk_size = 0;
+char * board_diff_dir = NULL;
+char * board_geometry = NULL;
+struct s6prog_image * board_image = NULL;
+int board_stream_fd = -1;
+int board_verify = 0;
+struct s6prog_image * board_mask = NULL;
+
+// open, program and close one board. runs in a thread of its own when
+// several boards are programmed at once.
+void * board_main(void * arg)
+{
+	struct board * b = arg;
+	struct s6prog * s;
 	
-	int l = ftdi_write_data(&ftdi, jtag_buf, jtag_buf_i);
-	if(l != jtag_buf_i)
+	b->time = s6prog_now_seconds();
+	s = s6prog_open(board_transport, (b->serial[0] != '\0') ? b->serial : NULL);
+	b->ret = (s == NULL);
+	if(s != NULL)
 	{
-		//printf("error: jtag_send: ftdi_write_data returned %d (expected %d)\n", l, jtag_buf_i);
-		return 1;
+		s6prog_set_poll(s, board_poll, board_timeout_ms);
+		if(board_chunk_size > 0)
+			b->ret |= s6prog_set_chunk_size(s, board_chunk_size);
+		s6prog_set_diff(s, board_diff_dir);
+		if(board_geometry != NULL)
+			b->ret |= s6prog_set_partial(s, board_geometry);
+		if((b->ret == 0) && (board_stream_fd >= 0))
+			b->ret = s6prog_program_fd(s, board_stream_fd);
+		else if(b->ret == 0)
+			b->ret = s6prog_program(s, board_image);
+		if((b->ret == 0) && board_verify)
+			b->ret = s6prog_verify(s, board_image, board_mask);
+		s6prog_close(s);
 	}
-	jtag_buf_i = 0;
-	return 0;
+	b->time = s6prog_now_seconds() - b->time;
+	
+	if(b->ret != 0)
+		return NULL;
+	if(b->serial[0] != '\0')
+		printf("%s: configuration complete in %.3f ms\n", b->serial, b->time * 1e3);
+	else
+		printf("configuration complete in %.3f ms\n", b->time * 1e3);
+	
+	return NULL;
 }
 
-int jtag_recv(unsigned char * rbuf, int n)
+// program every board in 'boards' at once, one thread each. returns the
+// number that failed.
+int board_program_all(struct board * boards, int n)
 {
-	int timeout = JTAG_RECV_ATTEMPTS, ret;
-	//unsigned char * rbuf2 = rbuf;
-	unsigned char buf[32];
-	while(n > 0)
+	int i, failed = 0;
+	double t = s6prog_now_seconds();
+	
+	for(i = 0; i < n; i++)
 	{
-		if(rbuf != NULL)
-		{
-			ret = ftdi_read_data(&ftdi, rbuf, n);
-			rbuf += ret;
-		}
-		else
-			ret = ftdi_read_data(&ftdi, buf, 32);
-		
-		n -= ret;
-		
-		if(timeout-- <= 0)
+		if(pthread_create(&boards[i].thread, NULL, board_main, &boards[i]))
 		{
-			//printf("error: jtag_recv: timed out with %d byte remaining\n", n);
-			break;
+			printf("%s: error: could not start thread\n", boards[i].serial);
+			boards[i].ret = 1;
+			boards[i].thread = 0;
 		}
 	}
 	
-	//printf("jtag_recv: ");
-	//while(rbuf2 < rbuf)
-	//	printf("%02x ", *rbuf2++);
-	//printf("\n");
+	for(i = 0; i < n; i++)
+	{
+		if(boards[i].thread)
+			pthread_join(boards[i].thread, NULL);
+		failed += (boards[i].ret != 0);
+	}
+	
+	printf("programmed %d of %d boards in %.3f ms\n", n - failed, n, (s6prog_now_seconds() - t) * 1e3);
 	
-	return n;
+	return failed;
 }
 
-// close and deinitialize ftdi device
-void jtag_close()
+////////////////////////////////////////////////////////////////////////
+// main routine and exit function for cleaning up
+////////////////////////////////////////////////////////////////////////
+
+// print 's' as the outcome, unless it is NULL because it has already
+// been reported, and clean up
+int main_exit(int ret, char * s)
 {
-	if(jtag_buf != NULL)
-		free(jtag_buf);
-	jtag_buf = NULL;
-	ftdi_usb_purge_buffers(&ftdi);
-	ftdi_usb_reset(&ftdi);
-	ftdi_usb_close(&ftdi);
-	ftdi_deinit(&ftdi);
+	if(ret)
+		printf("error: main: %s\n", s);
+	else if(s != NULL)
+		printf("%s\n", s);
+	
+	s6prog_image_free(board_image);
+	board_image = NULL;
+	s6prog_image_free(board_mask);
+	board_mask = NULL;
+	if(board_stream_fd > 0)
+		close(board_stream_fd);
+	board_stream_fd = -1;
+	return ret;
 }
 
-// initialize ftdi device for jtag
-int jtag_init()
+// print how the frames of 'filename' compress with multi-frame writes,
+// which needs no device
+int frame_report(const char * filename, int flags)
 {
+	struct s6prog_frame_stats fs;
+	struct s6prog_image * image;
 	int ret;
 	
-	if((jtag_buf = malloc(JTAG_BUFFER_SIZE)) == NULL)
-	{
-		printf("error: jtag_init: could not malloc jtag_buf\n");
-		return 1;
-	}
-	
-	// initialize ftdi data structure and open the ftdi device with
-	// VID:PID = 0403:6014
-	ftdi_init(&ftdi);
-	if(ftdi_usb_open_desc(&ftdi, 0x0403, 0x6014, 0, 0) < 0)
-	{
-		printf("error: could not open ftdi device\n");
-		ftdi_deinit(&ftdi);
+	if((image = s6prog_image_load(filename)) == NULL)
 		return 1;
-	}
-	
-	// reset ftdi device
-	ret = ftdi_usb_reset(&ftdi);
-	
-	// use interface A
-	//ret += ftdi_set_interface(&ftdi, INTERFACE_A);
-	
-	// 1ms latency timer
-	ret += ftdi_set_latency_timer(&ftdi, 1);
-	
-	// purge buffers
-	ret += ftdi_usb_purge_buffers(&ftdi);
 	
-	// set bit mode to MPSSE, 0xfb bitmask sets all bits except for
-	// TDO to output
-	ret += ftdi_set_bitmode(&ftdi, 0x00, 0x00);
-	ret += ftdi_set_bitmode(&ftdi, 0x0b, BITMODE_MPSSE);
-	
-	if(ret < 0)
-	{
-		printf("error: jtag_init: ftdi device config failed\n");
+	ret = ((flags & S6PROG_IMAGE_TRIM) && s6prog_image_trim(image)) || s6prog_image_frame_stats(image, &fs);
+	s6prog_image_free(image);
+	if(ret)
 		return 1;
-	}
-	
-	jtag_buf_i = 0;
-	
-	// set TMS high, TCK low, TDI low and TDO as input
-	jtag_buf[jtag_buf_i++] = SET_BITS_LOW;
-	jtag_buf[jtag_buf_i++] = 0x08;
-	jtag_buf[jtag_buf_i++] = 0x0b;
-	
-	// set all pins of the high port to inputs
-	jtag_buf[jtag_buf_i++] = SET_BITS_HIGH;
-	jtag_buf[jtag_buf_i++] = 0x00;
-	jtag_buf[jtag_buf_i++] = 0x00;
-	
-	// disable the divide by 5 clock prescaler
-	jtag_buf[jtag_buf_i++] = CLK_DIV_5_DISABLE;
 	
-	// set the TCK rate to 30MHz
-	jtag_buf[jtag_buf_i++] = TCK_DIVISOR;
-	jtag_buf[jtag_buf_i++] = JTAG_TCK_DIVISOR_LOW;
-	jtag_buf[jtag_buf_i++] = 0x00;
-	
-	// disable 3 phase data clocking
-	jtag_buf[jtag_buf_i++] = DATA_CLK_3_PHASE_DISABLE;
-	
-	// disable adaptive clocking
-	jtag_buf[jtag_buf_i++] = ADAPTIVE_CLK_DISABLE;
-	
-	// flush ftdi buffer
-	jtag_buf[jtag_buf_i++] = SEND_IMMEDIATE;
-
-	if(jtag_send())
-	{
-		printf("error: jtag_init: could not send initialization commands\n");
-		jtag_close();
-		return 1;
-	}
+	printf("%zu frames, %zu all zero, %zu repeats of an earlier frame\n", fs.frames, fs.zero, fs.repeats);
+	printf("multi-frame writes shift %zu of %zu configuration bytes", fs.mfwr_bytes, fs.bytes);
+	if((fs.bytes > 0) && (fs.mfwr_bytes > 0))
+		printf(" (%.1f%%, %.2f:1)", 100.0 * fs.mfwr_bytes / fs.bytes, (double)fs.bytes / fs.mfwr_bytes);
+	printf("\n");
 	
 	return 0;
 }
 
-#define jtag_add_send_immediate() (jtag_buf[jtag_buf_i++] = SEND_IMMEDIATE)
-
-// go to test logic reset state
-void jtag_to_tlr()
-{
-	// TMS: 11111
-	jtag_buf[jtag_buf_i++] = MPSSE_WRITE_TMS | MPSSE_LSB | MPSSE_BITMODE | MPSSE_WRITE_NEG;
-	jtag_buf[jtag_buf_i++] = 4;
-	jtag_buf[jtag_buf_i++] = 0x9f;
-}
-
-// go to rti state from tlr state
-void jtag_tlr_to_rti()
+void usage(char * name)
 {
-	// TMS: 0
-	jtag_buf[jtag_buf_i++] = MPSSE_WRITE_TMS | MPSSE_LSB | MPSSE_BITMODE | MPSSE_WRITE_NEG;
-	jtag_buf[jtag_buf_i++] = 0;
-	jtag_buf[jtag_buf_i++] = 0x80;	
+	const char * const * names = s6prog_transports();
+	int i;
+	
+	printf("usage: %s [options] <bin or bit file, or - for stdin>\n", name);
+	printf("  -T, --transport NAME usb transport or emulator to use, one of:\n");
+	printf("                      ");
+	for(i = 0; names[i] != NULL; i++)
+		printf(" %s", names[i]);
+	printf(" (default %s)\n", names[0]);
+	printf("  -n, --serial SERIAL  use the adapter with this serial number, give more\n");
+	printf("                       than once to program several boards at once\n");
+	printf("  -a, --all            program every adapter found at once\n");
+	printf("  -c, --compile        compile the bitstream into the stream cache and exit\n");
+	printf("  -k, --cache          program from the stream cache, compiling on a miss\n");
+	printf("  -i, --stream         shift the file as it is read instead of loading it\n");
+	printf("                       first, one board only (always done for stdin)\n");
+	printf("  -d, --cache-dir DIR  stream cache directory\n");
+	printf("                       (default $S6PROG_CACHE_DIR or ~/.cache/s6prog)\n");
+	printf("  -x, --trim           drop padding and NOOP runs the FPGA does not need\n");
+	printf("  -D, --diff           compare with the image last loaded into each board\n");
+	printf("                       and report the frames that changed\n");
+	printf("  -P, --partial        with -D and -G, read frames back and if they are the\n");
+	printf("                       image last loaded write only the changed frames,\n");
+	printf("                       leaving block and LUT RAM in the others as they are\n");
+	printf("  -V, --verify         read the frames back once loaded and compare them\n");
+	printf("  -M, --mask FILE      leave out the bits set in this .msk file when verifying\n");
+	printf("  -f, --frames         report how the frames compress with multi-frame writes\n");
+	printf("                       and exit\n");
+	printf("  -G, --geometry FILE  frame layout of the part, see README.md\n");
+	printf("  -w, --mfwr           place repeated frames with multi-frame writes, needs -G\n");
+	printf("  -o, --output FILE    write the configuration data as it would be shifted,\n");
+	printf("                       after -x and -w, to FILE and exit\n");
+	printf("  -s, --chunk-size N   bytes per shift command (default and maximum %d)\n", S6PROG_CHUNK_SIZE);
+	printf("  -S, --chunk-sweep MB report throughput of an MB megabyte shift for each chunk size\n");
+	printf("  -p, --poll           poll the device status instead of fixed shutdown and\n");
+	printf("                       startup delays, and report how long each took\n");
+	printf("  -t, --timeout MS     give up polling after MS milliseconds (default %d)\n", S6PROG_POLL_TIMEOUT_MS);
+	printf("  -b, --bench-encode MB\n");
+	printf("                       benchmark host side encoding of an MB megabyte shift\n");
 }
 
-// spin in run-test-idle state for 128 * 8 TCK cycles
-void jtag_rti_spin()
+int main(int argc, char * argv[])
 {
-	int n;
-	
-	// set TMS to 0
-	jtag_buf[jtag_buf_i++] = MPSSE_WRITE_TMS | MPSSE_LSB | MPSSE_BITMODE | MPSSE_WRITE_NEG;
-	jtag_buf[jtag_buf_i++] = 0;
-	jtag_buf[jtag_buf_i++] = 0x80;
+	static struct option long_options[] = {
+		{"transport",    required_argument, NULL, 'T'},
+		{"serial",       required_argument, NULL, 'n'},
+		{"all",          no_argument,       NULL, 'a'},
+		{"compile",      no_argument,       NULL, 'c'},
+		{"cache",        no_argument,       NULL, 'k'},
+		{"stream",       no_argument,       NULL, 'i'},
+		{"cache-dir",    required_argument, NULL, 'd'},
+		{"trim",         no_argument,       NULL, 'x'},
+		{"verify",       no_argument,       NULL, 'V'},
+		{"mask",         required_argument, NULL, 'M'},
+		{"frames",       no_argument,       NULL, 'f'},
+		{"geometry",     required_argument, NULL, 'G'},
+		{"mfwr",         no_argument,       NULL, 'w'},
+		{"output",       required_argument, NULL, 'o'},
+		{"diff",         no_argument,       NULL, 'D'},
+		{"partial",      no_argument,       NULL, 'P'},
+		{"chunk-size",   required_argument, NULL, 's'},
+		{"chunk-sweep",  required_argument, NULL, 'S'},
+		{"bench-encode", required_argument, NULL, 'b'},
+		{"poll",         no_argument,       NULL, 'p'},
+		{"timeout",      required_argument, NULL, 't'},
+		{"help",         no_argument,       NULL, 'h'},
+		{NULL, 0, NULL, 0}
+	};
+	static char serials[MAX_BOARDS][S6PROG_SERIAL_SIZE];
+	char cache_dir[CACHE_DIR_SIZE];
+	int i, opt, nboards = 0;
+	int compile = 0, use_cache = 0, stream = 0, sweep_mb = 0, all = 0, flags = 0, frames = 0, diff = 0;
+	int mfwr = 0, partial = 0, chunk_size = S6PROG_CHUNK_SIZE;
+	struct board * boards;
+	struct s6prog * s;
+	char * filename, * mask = NULL, * geometry = NULL, * output = NULL;
+	
+	cache_dir[0] = '\0';
+	
+	while((opt = getopt_long(argc, argv, "T:n:ackid:xVM:fG:wo:DPs:S:b:pt:h", long_options, NULL)) != -1)
+	{
+		switch(opt)
+		{
+		case 'T':
+			board_transport = optarg;
+			break;
+		case 'n':
+			if(nboards >= MAX_BOARDS)
+			{
+				printf("error: at most %d boards can be programmed at once\n", MAX_BOARDS);
+				return 1;
+			}
+			snprintf(serials[nboards++], S6PROG_SERIAL_SIZE, "%s", optarg);
+			break;
+		case 'a':
+			all = 1;
+			break;
+		case 'c':
+			compile = 1;
+			break;
+		case 'k':
+			use_cache = 1;
+			break;
+		case 'i':
+			stream = 1;
+			break;
+		case 'd':
+			snprintf(cache_dir, sizeof(cache_dir), "%s", optarg);
+			break;
+		case 'x':
+			flags |= S6PROG_IMAGE_TRIM;
+			break;
+		case 'V':
+			board_verify = 1;
+			break;
+		case 'M':
+			board_verify = 1;
+			mask = optarg;
+			break;
+		case 'f':
+			frames = 1;
+			break;
+		case 'G':
+			geometry = optarg;
+			break;
+		case 'w':
+			mfwr = 1;
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		case 'D':
+			diff = 1;
+			break;
+		case 'P':
+			partial = 1;
+			break;
+		case 's':
+			chunk_size = atoi(optarg);
+			board_chunk_size = chunk_size;
+			break;
+		case 'S':
+			sweep_mb = atoi(optarg);
+			break;
+		case 'b':
+			return s6prog_bench_encode(atoi(optarg));
+		case 'p':
+			board_poll = 1;
+			break;
+		case 't':
+			board_timeout_ms = atol(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
 	
-	// run TCK for 128 * 8 cycles
-	for(n = 0; n < 128; n++)
+	if((optind >= argc) && (sweep_mb < 1))
 	{
-		jtag_buf[jtag_buf_i++] = DATA_CLK_BITS;
-		jtag_buf[jtag_buf_i++] = 7;
+		usage(argv[0]);
+		return 1;
 	}
+	filename = argv[optind];
 	
-	jtag_send();
-}
-
-// go to shift-ir state from rti state
-void jtag_rti_to_shift_ir()
-{
-	// RTI -> SHIFT-IR
-	// TMS: 0011
-	jtag_buf[jtag_buf_i++] = MPSSE_WRITE_TMS | MPSSE_LSB | MPSSE_BITMODE | MPSSE_WRITE_NEG;
-	jtag_buf[jtag_buf_i++] = 3;
-	jtag_buf[jtag_buf_i++] = 0x83;
-}
-
-// go to shift-dr state from rti state
-void jtag_rti_to_shift_dr()
-{
-	// RTI -> SHIFT-DR
-	// TMS: 001
-	jtag_buf[jtag_buf_i++] = MPSSE_WRITE_TMS | MPSSE_LSB | MPSSE_BITMODE | MPSSE_WRITE_NEG;
-	jtag_buf[jtag_buf_i++] = 2;
-	jtag_buf[jtag_buf_i++] = 0x81;
-}
-
-void jtag_exit1_ir_to_rti()
-{
-	// EXIT1-IR -> RTI
-	// TMS: 01
-	jtag_buf[jtag_buf_i++] = MPSSE_WRITE_TMS | MPSSE_LSB | MPSSE_BITMODE | MPSSE_WRITE_NEG;
-	jtag_buf[jtag_buf_i++] = 1;
-	jtag_buf[jtag_buf_i++] = 0x81;
-}
-
-void jtag_exit1_dr_to_rti()
-{
-	// EXIT1-DR -> RTI
-	// TMS: 01
-	jtag_buf[jtag_buf_i++] = MPSSE_WRITE_TMS | MPSSE_LSB | MPSSE_BITMODE | MPSSE_WRITE_NEG;
-	jtag_buf[jtag_buf_i++] = 1;
-	jtag_buf[jtag_buf_i++] = 0x81;
-}
-
-// add commands to jtag_buf to shift out 'n' bytes from 'tdi'.
-// if do_read is set then make the command read while shifting out.
-// assumes tap already in shift-dr or shift-ir state.
-void jtag_shift_bytes(unsigned char * tdi, int n, int do_read)
-{
-	int i;
+	// stdin can only be read once, so it is always streamed
+	if((filename != NULL) && (strcmp(filename, "-") == 0))
+		stream = 1;
 	
-	// command byte
-	jtag_buf[jtag_buf_i] = MPSSE_LSB;
-	if(tdi != NULL)
-		jtag_buf[jtag_buf_i] |= MPSSE_DO_WRITE | MPSSE_WRITE_NEG;
-	if(do_read)
-		jtag_buf[jtag_buf_i] |= MPSSE_DO_READ;
-	jtag_buf_i++;
-	
-	// two byte length
-	jtag_buf[jtag_buf_i++] = ((n - 1) & 0xff);
-	jtag_buf[jtag_buf_i++] = ((n - 1) >> 8) & 0xff;
-	
-	// data bytes if writing
-	if(tdi != NULL)
-		for(i = 0; i < n; i++)
-			jtag_buf[jtag_buf_i++] = tdi[i];
-}
-
-// shift 'n' bits of data onto TDI
-// assumes tap already in shift-dr or shift-ir state.
-
-void jtag_shift_bits(unsigned char * tdi, int n, int do_read)
-{
-	// if more than one bits need to be shifted
-	if(n > 1)
+	if(stream && (compile || use_cache))
 	{
-		// command byte
-		jtag_buf[jtag_buf_i] = MPSSE_BITMODE | MPSSE_LSB;
-		if(tdi != NULL)
-			jtag_buf[jtag_buf_i] |= MPSSE_DO_WRITE | MPSSE_WRITE_NEG;
-		if(do_read)
-			jtag_buf[jtag_buf_i] |= MPSSE_DO_READ;
-		jtag_buf_i++;
-		
-		// number of bits
-		jtag_buf[jtag_buf_i++] = (n - 2);
-		
-		// data byte (last byte of buffer)
-		if(tdi != NULL)
-			jtag_buf[jtag_buf_i++] = *tdi & ((1 << (n - 1)) - 1);
+		printf("error: a streamed bitstream can not go through the stream cache\n");
+		return 1;
 	}
-
-	// shift the final bit
-	jtag_buf[jtag_buf_i] = MPSSE_WRITE_TMS | MPSSE_BITMODE | MPSSE_LSB | MPSSE_WRITE_NEG;
-	if(do_read)
-		jtag_buf[jtag_buf_i] |= MPSSE_DO_READ;
-	jtag_buf_i++;
-	
-	// shift one bit
-	jtag_buf[jtag_buf_i++] = 0;
-	
-	// MSB is value to set TDI to
-	// LSB is TMS value (=1)
-	if(tdi != NULL)
-		jtag_buf[jtag_buf_i++] = (*tdi & (1 << (n - 1))) ? 0x81 : 0x01;
-	else
-		jtag_buf[jtag_buf_i++] = 0x01;
-}
-
-// receive bits from ftdi device
-// combines the bits if they were transferred in separate commands
-int jtag_recv_bits(unsigned char * tdo, int n)
-{
-	unsigned char rbuf[2];
 	
-	if((n < 1) || (n > 8))
+	if(stream && ((flags & S6PROG_IMAGE_TRIM) || frames || board_verify || mfwr || (output != NULL)))
+	{
+		printf("error: a streamed bitstream can not be trimmed, rewritten, saved, verified or have its "
+			"frames counted\n");
 		return 1;
+	}
 	
-	if(jtag_recv(rbuf, (n > 1) ? 2 : 1))
+	// a compiled image keeps only its stream, there is nothing to compare
+	if(use_cache && board_verify)
 	{
-		printf("error: jtag_read_bits: could not recv bytes\n");
+		printf("error: a bitstream from the stream cache can not be verified\n");
 		return 1;
 	}
 	
-	// if more than one bits were shifted then we need to add the
-	// final bit received to the correct position in the prior bits.
-	if(n > 1)
+	if((use_cache || compile) && (mfwr || (output != NULL)))
 	{
-		// bits are shifted in from the left (MSB) so if less than 8
-		// bits were shifted then need to shift the bits in the
-		// received byte right by 8 - n bits.
-		*tdo = ((rbuf[1] & 0x80) | (rbuf[0] >> 1)) >> (8 - n);
-	} else
-		// if only 1 bit received
-		*tdo = (rbuf[0] & 0x80) >> 7;
-	
-	return 0;
-}
-
-// read and/or write data register
-// n is length of data in bits.
-// this attempts to send and receive in one transfer if possible
-int jtag_dr_op(unsigned char * tdi, unsigned char * tdo, int n)
-{
-	int bytes_remaining, bits_remaining, chunk_length;
-	int tdi_i, tdo_i;
-	
-	if((tdi == NULL) && (tdo == NULL))
+		printf("error: a bitstream through the stream cache can not be rewritten or saved\n");
 		return 1;
+	}
 	
-	// go to shift dr state
-	jtag_rti_to_shift_dr();
-	
-	// number of whole bytes that need to be shifted out
-	bytes_remaining = (n - 1) / 8;
-	// number of bits that need to be shifted out
-	// this should only ever be between 1 and 8 inclusive
-	bits_remaining  = n - (bytes_remaining * 8);
+	if(mfwr && (geometry == NULL))
+	{
+		printf("error: multi-frame writes need the frame layout of the part, give it with -G\n");
+		return 1;
+	}
 	
-	tdi_i = 0;
-	tdo_i = 0;
-	chunk_length = 0;
+	if(partial && (!diff || (geometry == NULL) || use_cache || stream))
+	{
+		printf("error: partial loads need -D and the frame layout from -G, and the bitstream itself\n");
+		return 1;
+	}
 	
-	while(bytes_remaining > 0)
+	if((compile || use_cache || diff) && (cache_dir[0] == '\0'))
 	{
-		// shift out/in a maximum number bytes at a time
-		chunk_length = (bytes_remaining > JTAG_CHUNK_SIZE) ? JTAG_CHUNK_SIZE : bytes_remaining;
-		
-		//printf("chunk_length %d\n", chunk_length);
-		
-		// shift the chunk through the data register
-		if(tdi != NULL)
-		{
-			jtag_shift_bytes(&tdi[tdi_i], chunk_length, (tdo != NULL));
-			tdi_i += chunk_length;
-		} else
-			jtag_shift_bytes(NULL, chunk_length, (tdo != NULL));
-		
-		bytes_remaining -= chunk_length;
-		
-		// if there is still another chunk to transfer then need to
-		// send this chunk and read in any data before sending the next
-		if(bytes_remaining > 0)
+		if(s6prog_cache_default_dir(cache_dir, sizeof(cache_dir)))
 		{
-			if(jtag_send())
-			{
-				printf("error: jtag_shift_dr: could not send bytes for chunk\n");
-				return 1;
-			}
-			
-			if(tdo != NULL)
-			{
-				if(jtag_recv(&tdo[tdo_i], chunk_length))
-				{
-					printf("error: jtag_shift_dr: could not receive bytes for chunk\n");
-					return 1;
-				}
-				tdo_i += chunk_length;
-			}
+			printf("error: could not determine stream cache directory\n");
+			return 1;
 		}
 	}
 	
-	// shift the remaining bits
-	if(bits_remaining > 0)
+	// the records of the last image loaded are kept with the streams
+	if(diff)
 	{
-		if(tdi != NULL)
-			jtag_shift_bits(&tdi[tdi_i], bits_remaining, (tdo != NULL));
-		else
-			jtag_shift_bits(NULL, bits_remaining, (tdo != NULL));
+		board_diff_dir = cache_dir;
+		board_geometry = partial ? geometry : NULL;
+		flags |= S6PROG_IMAGE_FRAMES;
 	}
 	
-	// back to rti state
-	jtag_exit1_dr_to_rti();
+	if(frames)
+		return frame_report(filename, flags);
 	
-	// send the last chunk
-	if(jtag_send())
+	// rewriting and saving only need the file, not the device
+	if(output != NULL)
 	{
-		printf("error: jtag_shift_dr: could not send bytes for last chunk\n");
-		return 1;
+		board_image = s6prog_image_load(filename);
+		i = (board_image == NULL) || ((flags & S6PROG_IMAGE_TRIM) && s6prog_image_trim(board_image)) ||
+			(mfwr && s6prog_image_mfwr(board_image, geometry)) || s6prog_image_save(board_image, output);
+		return main_exit(i, i ? "could not write the configuration data" : NULL);
 	}
 	
-	// now receive the bytes from the last chunk sent and any bits
-	if(tdo != NULL)
+	// compiling only needs the encoder, not the device
+	if(compile)
 	{
-		// if chunk_length is 0 it means that only bits were sent
-		if(chunk_length > 0)
-		{
-			if(jtag_recv(&tdo[tdo_i], chunk_length))
-			{
-				printf("error: jtag_shift_dr: could not receive bytes for the last chunk\n");
-				return 1;
-			}
-			tdo_i += chunk_length;
-		}
-		
-		if(bits_remaining > 0)
+		board_image = s6prog_image_load_cached(filename, cache_dir, chunk_size, flags | S6PROG_IMAGE_REBUILD);
+		i = (board_image == NULL);
+		s6prog_image_free(board_image);
+		return i;
+	}
+	
+	// find every adapter, or one board per serial number given, or just
+	// the first adapter found
+	if(all)
+	{
+		if((nboards = s6prog_list(board_transport, serials, MAX_BOARDS)) < 0)
+			return 1;
+		if(nboards == 0)
 		{
-			if(jtag_recv_bits(&tdo[tdo_i], bits_remaining))
-			{
-				printf("error: jtag_shift_dr: could not receive bits for the last chunk\n");
-				return 1;
-			}
-			tdo_i++;
+			printf("error: no adapters with serial numbers found\n");
+			return 1;
 		}
 	}
-	
-	return 0;
-}
-
-////////////////////////////////////////////////////////////////////////
-// high level functions
-////////////////////////////////////////////////////////////////////////
-
-#define jtag_dr_write(tdi, n) 		(jtag_dr_op(tdi, NULL, n))
-#define jtag_dr_read(tdo, n)  		(jtag_dr_op(NULL, tdo, n))
-#define jtag_dr_rw(tdi, tdo, n)		(jtag_dr_op(tdi, tdo, n))
-
-// shift in 6 bit instruction
-void jtag_ir_write(unsigned char instruction)
-{
-	jtag_rti_to_shift_ir();
-	jtag_shift_bits(&instruction, 6, 0);
-	jtag_exit1_ir_to_rti();
-}
-
-// sends an invalid command to the ftdi device and checks to see if it
-// replies with the correct sequence.
-int jtag_mpsse_sync()
-{
-	int ret;
-	unsigned char buf[2];
-	// load an invalid instruction
-	jtag_buf[jtag_buf_i++] = 0xaa;
-	jtag_send();
-	ret = jtag_recv(buf, 2);
-	return (ret | (buf[0] != 0xfa) | (buf[1] != 0xaa));
-}
-
-// read jtag idcode
-int jtag_get_idcode(int * idcode)
-{
-	unsigned char buf[4];
-	
-	// shift in IDCODE instruction
-	jtag_ir_write(JTAG_INSTR_IDCODE);
-	
-	if(jtag_dr_read(buf, 32))
-		return 1;
-	
-	*idcode = (buf[3] << 24) | (buf[2] << 16) | (buf[1] << 8) | buf[0];
-
-	return 0;
-}
-
-// swap the bits in the byte 'c' points to
-void bit_swap(unsigned char * c)
-{
-	*c = ((*c & 0xf0) >> 4) | ((*c & 0x0f) << 4);
-	*c = ((*c & 0xcc) >> 2) | ((*c & 0x33) << 2);
-	*c = ((*c & 0xaa) >> 1) | ((*c & 0x55) << 1);
-}
-
-unsigned char * fdata = NULL;
-int flength = 0;
-
-// malloc fdata and read from stdin
-int load_fdata(char * filename)
-{
-	int i;
-	FILE * fin;
-	
-	if(fdata == NULL)
-		fdata = malloc(FDATA_SIZE);
-	if(fdata == NULL)
-		return 1;
-	
-	fin = fopen(filename, "rb");
-	
-	if(fin == NULL)
-		return 1;
-	
-	flength = fread(fdata, 1, FDATA_SIZE, fin);
-	
-	fclose(fin);
-	
-	if((flength < 1) || (flength >= FDATA_SIZE))
-		return 1;
-	
-	for(i = 0; i < flength; i++)
-		bit_swap(&fdata[i]);
-
-	return 0;
-}
-
-////////////////////////////////////////////////////////////////////////
-// main routine and exit function for cleaning up
-////////////////////////////////////////////////////////////////////////
-
-int main_exit(int ret, char * s)
-{
-	if(ret)
-		printf("error: main: %s\n", s);
-	else
-		printf("%s\n", s);
-	
-	if(fdata != NULL)
+	if(nboards == 0)
 	{
-		free(fdata);
-		fdata = NULL;
+		serials[0][0] = '\0';
+		nboards = 1;
 	}
-	jtag_to_tlr();
-	jtag_send();
-	jtag_close();
-	return ret;
-}
-
-int main(int argc, char * argv[])
-{
-	int idcode, i;
-	unsigned char c[2];
 	
-	if(argc < 2)
+	if(sweep_mb > 0)
 	{
-		printf("usage: %s <bin file>\n", argv[0]);
-		return 1;
+		if((s = s6prog_open(board_transport, (serials[0][0] != '\0') ? serials[0] : NULL)) == NULL)
+			return main_exit(1, "chunk sweep failed");
+		i = s6prog_bench_chunk_sweep(s, sweep_mb);
+		s6prog_close(s);
+		return main_exit(i, i ? "chunk sweep failed" : "chunk sweep complete");
 	}
 	
-	// initialize ftdi device for jtag 
-	if(jtag_init())
+	if(stream && (nboards > 1))
 	{
-		printf("error: jtag_init failed\n");
+		printf("error: a streamed bitstream can only program one board\n");
 		return 1;
 	}
 	
-	if(jtag_mpsse_sync())
-		return main_exit(1, "could not sync mpsse controller");
-	
-	printf("testing 1 byte transfer, send 0xaa\n");
-	c[0] = 0xaa;
-	if(ftdi_write_data(&ftdi, c, 1) < 0)
-		return main_exit(1, "ftdi write 1 byte failed");
-	jtag_recv(c, 2);
-	printf("receive 0x%02x 0x%02x\n", c[0], c[1]);
-	
-	
-	// put jtag tap into TLR state
-	jtag_to_tlr();
-	
-	// put jtag tap into RTI state
-	jtag_tlr_to_rti();
-
-	if(jtag_get_idcode(&idcode))
-		return main_exit(1, "could not get idcode");
-	
-	printf("idcode = 0x%08x\n", idcode);
-	
-	// check company code and family sections of idcode
-	if((idcode & 0x001fffff) != 0x00008093)
-		return main_exit(1, "non xilinx fpga device id");
+	if((boards = calloc(nboards, sizeof(struct board))) == NULL)
+		return 1;
+	for(i = 0; i < nboards; i++)
+		memcpy(boards[i].serial, serials[i], S6PROG_SERIAL_SIZE);
 	
-	// load file data
-	if(load_fdata(argv[1]))
+	// open the file to stream, or load file data, or its compiled stream
+	// when using the cache. every board shares it.
+	if(stream)
+	{
+		board_stream_fd = (strcmp(filename, "-") == 0) ? 0 : open(filename, O_RDONLY);
+		if(board_stream_fd < 0)
+		{
+			free(boards);
+			return main_exit(1, "could not open file");
+		}
+	} else if(use_cache)
+	{
+		if((board_image = s6prog_image_load_cached(filename, cache_dir, chunk_size, flags)) == NULL)
+		{
+			free(boards);
+			return main_exit(1, "could not load stream from cache");
+		}
+	} else if(((board_image = s6prog_image_load(filename)) == NULL) ||
+		((flags & S6PROG_IMAGE_TRIM) && s6prog_image_trim(board_image)) ||
+		(mfwr && s6prog_image_mfwr(board_image, geometry)))
+	{
+		free(boards);
 		return main_exit(1, "could not load data from file");
+	}
 	
-	// enable in system configuration
-	jtag_ir_write(JTAG_INSTR_JSHUTDOWN);
-	
-	// spin in RTI waiting for FPGA to shut down
-	for(i = 0; i < JTAG_SHUTDOWN_DELAY; i++)
-		jtag_rti_spin();
-	
-	// load CFG_IN instruction
-	jtag_ir_write(JTAG_INSTR_CFG_IN);
-	
-	// write fdata to data register
-	if(jtag_dr_write(fdata, flength * 8))
-		return main_exit(1, "could not write configuration to data register");
-		
-	printf("sent %d configuration bytes to fpga\n", flength);
-	
-	// disable in system configuration
-	jtag_ir_write(JTAG_INSTR_JSTART);
-	
-	// spin in RTI waiting for FPGA to restart
-	for(i = 0; i < JTAG_STARTUP_DELAY; i++)
-		jtag_rti_spin();
+	if((mask != NULL) && ((board_mask = s6prog_image_load(mask)) == NULL))
+	{
+		free(boards);
+		return main_exit(1, "could not load mask from file");
+	}
 	
-	// put jtag into TLR state
-	jtag_to_tlr();
+	// a single board is programmed from this thread
+	if(nboards == 1)
+	{
+		board_main(&boards[0]);
+		i = boards[0].ret;
+	} else
+		i = board_program_all(boards, nboards);
 	
-	if(jtag_send())
-		return main_exit(1, "could not disable isc");
+	free(boards);
 	
-	return main_exit(0, "configuration complete");
+	// each board has reported its own configuration time
+	if(i)
+		return main_exit(1, "configuration failed");
+	return main_exit(0, NULL);
 }
@@ -0,0 +1,256 @@
+/*
+libs6prog: programs Spartan 6 FPGAs over JTAG using FTDI FT232H
+adapters.
+
+A session (struct s6prog) is one open adapter and the FPGA behind it.
+Sessions are independent of each other, so any number can be driven at
+once from different threads. Calls on the same session are serialized
+by the session's own lock.
+
+An image (struct s6prog_image) is a loaded bitstream, ready to shift.
+It is never modified once loaded and can be programmed into any number
+of sessions at once.
+
+Functions returning int return 0 on success and 1 on error, and print
+errors to stdout.
+*/
+
+#ifndef S6PROG_H
+#define S6PROG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// longest adapter serial number, including the terminator
+#define S6PROG_SERIAL_SIZE (64)
+
+// default and largest bytes per shift command
+#define S6PROG_CHUNK_SIZE (0x10000)
+
+// default limit on polling for shutdown and startup
+#define S6PROG_POLL_TIMEOUT_MS (1000)
+
+// longest text field kept from a .bit file header, with the terminator
+#define S6PROG_FIELD_SIZE (128)
+
+// some of the Spartan 6 configuration registers, see
+// s6prog_register_name() for the rest
+#define S6PROG_REG_CRC (0x00)
+#define S6PROG_REG_CMD (0x05)
+#define S6PROG_REG_CTL (0x06)
+#define S6PROG_REG_STAT (0x08)
+#define S6PROG_REG_IDCODE (0x0e)
+#define S6PROG_REG_BOOTSTS (0x20)
+
+struct s6prog;
+struct s6prog_image;
+struct s6prog_image_cache;
+
+// names of the usb transports (and the emulator) built in, NULL
+// terminated. the first is the default.
+const char * const * s6prog_transports();
+
+// fill 'serials' with the serial numbers of up to 'max' adapters that
+// 'transport' (the default if NULL) can open. returns the number found
+// or -1 on error.
+int s6prog_list(const char * transport, char serials[][S6PROG_SERIAL_SIZE], int max);
+
+// open the adapter with serial number 'serial' (the first found if
+// NULL) through 'transport' (the default if NULL), check the link and
+// that a Spartan 6 is attached. returns NULL on error.
+struct s6prog * s6prog_open(const char * transport, const char * serial);
+
+// reset the tap and close the adapter
+void s6prog_close(struct s6prog * s);
+
+// serial number the session was opened with, empty if none was given
+const char * s6prog_serial(struct s6prog * s);
+
+// bytes per shift command, rounded down to whole usb packets
+int s6prog_set_chunk_size(struct s6prog * s, int size);
+
+// wait for shutdown and startup by polling the DONE status, for at most
+// 'timeout_ms' milliseconds each, instead of fixed delays
+void s6prog_set_poll(struct s6prog * s, int poll, long timeout_ms);
+
+// compare each image programmed with the one last loaded into the same
+// board (by device dna, or else serial number), keeping a record of it
+// in 'dir'. the changed frames are reported and the image is still
+// loaded in full, unless s6prog_set_partial() is also on. NULL turns it
+// off, as it is by default.
+void s6prog_set_diff(struct s6prog * s, const char * dir);
+
+// with s6prog_set_diff() on, read back frames of the FPGA in the frame
+// layout of the geometry file 'geometry' (see bitstream.h) before each
+// image is programmed. if they match the image last loaded, an FPGA
+// still running the same image is left alone and only the frames that
+// changed are written otherwise. frames that are not written keep the
+// LUT RAM, SRL and block RAM contents the running design left in them.
+// NULL turns it off, as it is by default. returns 1 if the file can not
+// be read.
+int s6prog_set_partial(struct s6prog * s, const char * geometry);
+
+// print progress messages, prefixed with the serial number if there is
+// one. on by default.
+void s6prog_set_verbose(struct s6prog * s, int verbose);
+
+// read the JTAG idcode
+int s6prog_idcode(struct s6prog * s, uint32_t * idcode);
+
+// read the 57 bit device DNA through ISC_DNA
+int s6prog_dna(struct s6prog * s, uint64_t * dna);
+
+// read 'n' (at most 31) 16 bit words from configuration register 'reg'
+// through CFG_IN and CFG_OUT. the device can be running.
+int s6prog_read_register(struct s6prog * s, int reg, uint16_t * words, int n);
+
+// name of configuration register 'reg', NULL if there is none
+const char * s6prog_register_name(int reg);
+
+// load 'image' into the FPGA and start it
+int s6prog_program(struct s6prog * s, const struct s6prog_image * image);
+
+// read the frames 'image' writes back out of the FPGA and compare them
+// with it, leaving out the bits set in 'mask' (a .msk file written by
+// bitgen, or NULL to compare every bit). the readback is compared as it
+// arrives and not kept. the image must be loaded with
+// s6prog_image_load(), since a compiled one has no data to compare.
+int s6prog_verify(struct s6prog * s, const struct s6prog_image * image, const struct s6prog_image * mask);
+
+// load the .bin data read from 'fd' into the FPGA and start it. the data
+// is shifted as it is read, a block at a time, so 'fd' can be a pipe and
+// the input can be any size. nothing is cached.
+int s6prog_program_fd(struct s6prog * s, int fd);
+
+// flags for loading images
+//  S6PROG_IMAGE_REBUILD  compile into the stream cache even on a hit
+//  S6PROG_IMAGE_TRIM     drop the padding and NOOP runs the FPGA has no
+//                        use for, see s6prog_image_trim()
+//  S6PROG_IMAGE_FRAMES   hash the frames before the data is released, so
+//                        that the compiled image can be compared with
+//                        s6prog_set_diff(). an image from
+//                        s6prog_image_load() keeps its data and is
+//                        hashed when first compared.
+#define S6PROG_IMAGE_REBUILD (1)
+#define S6PROG_IMAGE_TRIM (2)
+#define S6PROG_IMAGE_FRAMES (4)
+
+// load a .bin file, or a .bit file. the part a .bit file is built for is
+// checked against the device before it is programmed.
+struct s6prog_image * s6prog_image_load(const char * filename);
+
+// drop the dummy words before the sync word, NOOP runs past the spacing
+// the configuration logic needs and anything after the DESYNC command
+// from the configuration data of 'image', printing the bytes saved.
+// call it straight after s6prog_image_load(), before the image is
+// programmed or shared.
+int s6prog_image_trim(struct s6prog_image * image);
+
+// rewrite the configuration data of 'image' to place the frames that
+// repeat by multi-frame writes (MFWR) instead of shifting each of them,
+// printing the bytes it comes to. the frame addresses are worked out
+// from the frame layout of the part in the geometry file 'geometry'
+// (see README.md), which must be the right one for the device. the
+// rewritten data is what gets programmed, the original is kept for
+// s6prog_verify() and comparing. call it after s6prog_image_trim(),
+// before the image is programmed or shared.
+int s6prog_image_mfwr(struct s6prog_image * image, const char * geometry);
+
+// write the configuration data of 'image' as it would be shifted, after
+// trimming and rewriting, to the .bin file 'filename'
+int s6prog_image_save(const struct s6prog_image * image, const char * filename);
+
+// load a .bin file through the stream cache in 'cache_dir': the MPSSE
+// command stream for the configuration shift with 'chunk_size' byte
+// commands is mapped from the cache, and compiled into it first if it
+// is missing or 'flags' has S6PROG_IMAGE_REBUILD. S6PROG_IMAGE_TRIM
+// trims it first. a file not changed since it was compiled is found by
+// its inode, size and times without being read.
+struct s6prog_image * s6prog_image_load_cached(const char * filename, const char * cache_dir,
+	int chunk_size, int flags);
+
+// in memory cache of compiled images, for programming the same files
+// over and over. images are keyed by the hash of the file contents and
+// revalidated by size and mtime, falling back to the hash when those
+// change. the least recently used are dropped to keep the compiled
+// streams within 'budget' bytes. with 'cache_dir', images are compiled
+// through the stream cache there instead of in memory. with
+// S6PROG_IMAGE_TRIM in 'flags' every image is trimmed.
+struct s6prog_image_cache * s6prog_image_cache_new(size_t budget, int chunk_size, const char * cache_dir,
+	int flags);
+void s6prog_image_cache_free(struct s6prog_image_cache * c);
+
+// the image for the file at 'filename', loaded and compiled on a miss.
+// free it with s6prog_image_free() when done, it stays valid even if
+// the cache drops it.
+struct s6prog_image * s6prog_image_cache_get(struct s6prog_image_cache * c, const char * filename);
+
+struct s6prog_image_cache_stats
+{
+	// lookups answered from a valid path, answered after hashing a
+	// changed path, and that had to load and compile the file
+	unsigned long hits;
+	unsigned long revalidations;
+	unsigned long misses;
+	unsigned long evictions;
+	
+	// entries held and the bytes of their streams
+	int entries;
+	size_t bytes;
+};
+
+void s6prog_image_cache_get_stats(struct s6prog_image_cache * c, struct s6prog_image_cache_stats * stats);
+
+// number of configuration bytes in 'image'
+size_t s6prog_image_length(const struct s6prog_image * image);
+
+// what the header of a .bit file says about the image in it. the strings
+// are empty for a .bin file.
+struct s6prog_image_info
+{
+	char design[S6PROG_FIELD_SIZE];
+	char part[S6PROG_FIELD_SIZE];
+	char date[S6PROG_FIELD_SIZE];
+	char time[S6PROG_FIELD_SIZE];
+	
+	// idcode of the part named in the .bit header, or else of the one
+	// the configuration data writes to IDCODE, without the version bits.
+	// 0 if not known.
+	uint32_t idcode;
+};
+
+void s6prog_image_get_info(const struct s6prog_image * image, struct s6prog_image_info * info);
+
+// how the frames of an image compress with multi-frame writes
+struct s6prog_frame_stats
+{
+	// frames written, of them all zero, and repeating an earlier frame
+	size_t frames;
+	size_t zero;
+	size_t repeats;
+	
+	// configuration bytes now, and after s6prog_image_mfwr(), which
+	// does not depend on the frame layout
+	size_t bytes;
+	size_t mfwr_bytes;
+};
+
+// count the frames of a loaded image. returns 1 if it has already been
+// compiled, which drops the data.
+int s6prog_image_frame_stats(const struct s6prog_image * image, struct s6prog_frame_stats * fs);
+
+void s6prog_image_free(struct s6prog_image * image);
+
+// default stream cache directory, $S6PROG_CACHE_DIR or ~/.cache/s6prog
+int s6prog_cache_default_dir(char * dir, int n);
+
+// seconds on the monotonic clock the library times its own steps with
+double s6prog_now_seconds();
+
+// benchmarks: host side encoding of an 'mb' megabyte shift without a
+// device, and the throughput of an 'mb' megabyte shift through an open
+// session for each chunk size
+int s6prog_bench_encode(int mb);
+int s6prog_bench_chunk_sweep(struct s6prog * s, int mb);
+
+#endif
@@ -0,0 +1,801 @@
+/*
+s6progd: keeps FT232H adapters open and set up, and runs jobs on the
+Spartan 6 FPGAs behind them for clients on a local Unix socket. A job
+then only costs its shifts, not the usb open, reset, MPSSE sync and
+link test that every run of s6prog pays for.
+
+Run with a command, the same binary is the client: it sends the command
+to the daemon and prints the reply.
+
+Requests are single lines, each answered by a single line starting with
+"ok" or "error":
+
+ list                          serial numbers of the open adapters
+ stats                         image cache counters
+ program SERIAL FILE           load .bin FILE into the FPGA
+ idcode SERIAL                 read the JTAG idcode
+ dna SERIAL                    read the device DNA
+ readback SERIAL REG [WORDS]   read configuration register REG, by name
+                               (stat, idcode, ...) or number
+
+SERIAL is "-" for the first adapter. Anyone who can connect can run
+jobs, so the socket is only open to the user unless -U says otherwise.
+Adapters are used one job at a time, jobs on different adapters run at
+once. Images are compiled once and kept in an image cache, so
+programming a file again only costs a stat() and the shift.
+*/
+
+#include "s6prog.h"
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#define DAEMON_SOCKET "s6progd.sock"
+#define DAEMON_SOCKET_DIR "/tmp/s6progd-%d"
+#define DAEMON_SOCKET_MODE (0600)
+#define MAX_ADAPTERS (64)
+#define MAX_CLIENTS (64)
+#define LINE_SIZE (4096)
+#define CACHE_DIR_SIZE (4096)
+#define DAEMON_CACHE_MB (256)
+
+////////////////////////////////////////////////////////////////////////
+// adapters
+////////////////////////////////////////////////////////////////////////
+
+struct adapter
+{
+	// serial number, empty for the first adapter found
+	char serial[S6PROG_SERIAL_SIZE];
+	struct s6prog * s;
+};
+
+struct adapter adapters[MAX_ADAPTERS];
+int nadapters = 0;
+
+// compiled images, kept in memory between jobs
+struct s6prog_image_cache * image_cache = NULL;
+
+// find the open adapter with serial number 'serial', "-" for the first
+struct adapter * adapter_find(char * serial)
+{
+	int i;
+	
+	if((serial == NULL) || (nadapters == 0))
+		return NULL;
+	if(strcmp(serial, "-") == 0)
+		return &adapters[0];
+	
+	for(i = 0; i < nadapters; i++)
+		if(strcmp(adapters[i].serial, serial) == 0)
+			return &adapters[i];
+	return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////
+// jobs
+////////////////////////////////////////////////////////////////////////
+
+// format a reply line into 'reply'
+void job_reply(char * reply, const char * format, ...)
+{
+	va_list ap;
+	
+	va_start(ap, format);
+	vsnprintf(reply, LINE_SIZE, format, ap);
+	va_end(ap);
+}
+
+// format an error reply into 'reply', returns 1
+int job_error(char * reply, const char * format, ...)
+{
+	va_list ap;
+	int len;
+	
+	len = snprintf(reply, LINE_SIZE, "error ");
+	va_start(ap, format);
+	vsnprintf(reply + len, LINE_SIZE - len, format, ap);
+	va_end(ap);
+	return 1;
+}
+
+int job_program(struct adapter * a, char * filename, char * reply)
+{
+	struct s6prog_image * image;
+	double t = s6prog_now_seconds();
+	int ret;
+	
+	if(filename == NULL)
+		return job_error(reply, "no file given");
+	
+	if((image = s6prog_image_cache_get(image_cache, filename)) == NULL)
+		return job_error(reply, "could not load %s", filename);
+	
+	ret = s6prog_program(a->s, image);
+	s6prog_image_free(image);
+	
+	if(ret)
+		return job_error(reply, "configuration failed");
+	job_reply(reply, "ok %.3f ms", (s6prog_now_seconds() - t) * 1e3);
+	return 0;
+}
+
+int job_readback(struct adapter * a, char * reg_arg, char * words_arg, char * reply)
+{
+	uint16_t words[31];
+	const char * name;
+	int reg, n, i, len;
+	char * end;
+	
+	if(reg_arg == NULL)
+		return job_error(reply, "no register given");
+	
+	// by number, or by name
+	reg = strtol(reg_arg, &end, 0);
+	if((end == reg_arg) || (*end != '\0'))
+	{
+		for(reg = 0; reg < 0x40; reg++)
+			if(((name = s6prog_register_name(reg)) != NULL) && (strcasecmp(name, reg_arg) == 0))
+				break;
+		if(reg == 0x40)
+			return job_error(reply, "unknown register %s", reg_arg);
+	}
+	
+	// the idcode register is 32 bits, the rest 16 unless asked
+	n = (reg == S6PROG_REG_IDCODE) ? 2 : 1;
+	if(words_arg != NULL)
+		n = atoi(words_arg);
+	if((n < 1) || (n > 31))
+		return job_error(reply, "bad word count");
+	
+	if(s6prog_read_register(a->s, reg, words, n))
+		return job_error(reply, "readback failed");
+	
+	len = snprintf(reply, LINE_SIZE, "ok");
+	for(i = 0; i < n; i++)
+		len += snprintf(reply + len, LINE_SIZE - len, " 0x%04x", words[i]);
+	return 0;
+}
+
+// run the request in 'line' and put the reply in 'reply'
+int job_run(char * line, char * reply)
+{
+	struct s6prog_image_cache_stats stats;
+	char * cmd, * arg[3], * save;
+	struct adapter * a;
+	uint32_t idcode;
+	uint64_t dna;
+	int i, len;
+	
+	if((cmd = strtok_r(line, " \t\r\n", &save)) == NULL)
+		return job_error(reply, "empty request");
+	for(i = 0; i < 3; i++)
+		arg[i] = strtok_r(NULL, " \t\r\n", &save);
+	
+	if(strcmp(cmd, "stats") == 0)
+	{
+		s6prog_image_cache_get_stats(image_cache, &stats);
+		job_reply(reply, "ok hits %lu revalidations %lu misses %lu evictions %lu entries %d bytes %zu",
+			stats.hits, stats.revalidations, stats.misses, stats.evictions, stats.entries, stats.bytes);
+		return 0;
+	}
+	
+	if(strcmp(cmd, "list") == 0)
+	{
+		len = snprintf(reply, LINE_SIZE, "ok");
+		for(i = 0; i < nadapters; i++)
+			len += snprintf(reply + len, LINE_SIZE - len, " %s",
+				(adapters[i].serial[0] != '\0') ? adapters[i].serial : "-");
+		return 0;
+	}
+	
+	if((a = adapter_find(arg[0])) == NULL)
+		return job_error(reply, "no adapter %s", (arg[0] != NULL) ? arg[0] : "given");
+	
+	if(strcmp(cmd, "program") == 0)
+		return job_program(a, arg[1], reply);
+	if(strcmp(cmd, "readback") == 0)
+		return job_readback(a, arg[1], arg[2], reply);
+	
+	if(strcmp(cmd, "idcode") == 0)
+	{
+		if(s6prog_idcode(a->s, &idcode))
+			return job_error(reply, "could not read idcode");
+		job_reply(reply, "ok 0x%08x", idcode);
+	} else if(strcmp(cmd, "dna") == 0)
+	{
+		if(s6prog_dna(a->s, &dna))
+			return job_error(reply, "could not read dna");
+		job_reply(reply, "ok 0x%015llx", (unsigned long long)dna);
+	} else
+		return job_error(reply, "unknown command %s", cmd);
+	
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////
+// clients
+////////////////////////////////////////////////////////////////////////
+
+/*
+ Each client connection is served by a thread of its own. The sockets of
+ the connected clients are kept so that they can be shut down when the
+ daemon stops, which ends their threads.
+*/
+
+pthread_mutex_t client_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t client_cond = PTHREAD_COND_INITIALIZER;
+int client_fds[MAX_CLIENTS];
+int nclients = 0;
+
+volatile sig_atomic_t daemon_stop = 0;
+
+// write all of 'n' bytes to socket 'fd'
+int client_write(int fd, const char * buf, int n)
+{
+	int ret;
+	
+	while(n > 0)
+	{
+		if((ret = write(fd, buf, n)) < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			return 1;
+		}
+		buf += ret;
+		n -= ret;
+	}
+	
+	return 0;
+}
+
+void client_remove(int fd)
+{
+	int i;
+	
+	pthread_mutex_lock(&client_lock);
+	for(i = 0; i < nclients; i++)
+	{
+		if(client_fds[i] == fd)
+		{
+			client_fds[i] = client_fds[--nclients];
+			break;
+		}
+	}
+	pthread_cond_broadcast(&client_cond);
+	pthread_mutex_unlock(&client_lock);
+}
+
+void * client_main(void * arg)
+{
+	int fd = (int)(long)arg;
+	char line[LINE_SIZE], reply[LINE_SIZE + 1];
+	FILE * in;
+	
+	if((in = fdopen(fd, "r")) == NULL)
+	{
+		client_remove(fd);
+		close(fd);
+		return NULL;
+	}
+	
+	while(fgets(line, sizeof(line), in) != NULL)
+	{
+		job_run(line, reply);
+		strcat(reply, "\n");
+		if(client_write(fd, reply, strlen(reply)))
+			break;
+	}
+	
+	client_remove(fd);
+	fclose(in);
+	
+	return NULL;
+}
+
+// start a thread for the client on socket 'fd'
+int client_start(int fd)
+{
+	const char * full = "error too many clients\n";
+	pthread_attr_t attr;
+	pthread_t thread;
+	int ret;
+	
+	pthread_mutex_lock(&client_lock);
+	if(nclients == MAX_CLIENTS)
+	{
+		pthread_mutex_unlock(&client_lock);
+		client_write(fd, full, strlen(full));
+		close(fd);
+		return 1;
+	}
+	client_fds[nclients++] = fd;
+	pthread_mutex_unlock(&client_lock);
+	
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	ret = pthread_create(&thread, &attr, client_main, (void *)(long)fd);
+	pthread_attr_destroy(&attr);
+	
+	if(ret)
+	{
+		printf("error: client_start: could not start thread\n");
+		client_remove(fd);
+		close(fd);
+		return 1;
+	}
+	
+	return 0;
+}
+
+// shut down every client connection and wait for their threads to end
+void client_stop_all()
+{
+	int i;
+	
+	pthread_mutex_lock(&client_lock);
+	for(i = 0; i < nclients; i++)
+		shutdown(client_fds[i], SHUT_RDWR);
+	while(nclients > 0)
+		pthread_cond_wait(&client_cond, &client_lock);
+	pthread_mutex_unlock(&client_lock);
+}
+
+////////////////////////////////////////////////////////////////////////
+// daemon and client
+////////////////////////////////////////////////////////////////////////
+
+// open every adapter and set it up for the jobs
+int daemon_open(char * transport, int poll, long timeout_ms, int chunk_size, char * diff_dir)
+{
+	struct adapter * a;
+	int i;
+	
+	for(i = 0; i < nadapters; i++)
+	{
+		a = &adapters[i];
+		if((a->s = s6prog_open(transport, (a->serial[0] != '\0') ? a->serial : NULL)) == NULL)
+			return 1;
+		s6prog_set_poll(a->s, poll, timeout_ms);
+		if((chunk_size > 0) && s6prog_set_chunk_size(a->s, chunk_size))
+			return 1;
+		s6prog_set_diff(a->s, diff_dir);
+	}
+	
+	return 0;
+}
+
+void daemon_close()
+{
+	int i;
+	
+	for(i = 0; i < nadapters; i++)
+		s6prog_close(adapters[i].s);
+}
+
+void daemon_signal(int sig)
+{
+	daemon_stop = 1;
+}
+
+// fill 'addr' with the address of the socket at 'path'
+int socket_address(struct sockaddr_un * addr, char * path)
+{
+	memset(addr, 0, sizeof(struct sockaddr_un));
+	addr->sun_family = AF_UNIX;
+	if(strlen(path) >= sizeof(addr->sun_path))
+	{
+		printf("error: socket path %s is too long\n", path);
+		return 1;
+	}
+	strcpy(addr->sun_path, path);
+	return 0;
+}
+
+// the default socket path, in $XDG_RUNTIME_DIR which only the user can
+// get into, or else in a directory of the user's own under /tmp, when
+// '*private_dir' is set (see socket_private_dir). returns 1 if it does
+// not fit in 'n' bytes.
+int socket_default_path(char * path, int n, int * private_dir)
+{
+	char * dir = getenv("XDG_RUNTIME_DIR");
+	
+	*private_dir = (dir == NULL) || (dir[0] == '\0');
+	if(!*private_dir)
+		return (snprintf(path, n, "%s/" DAEMON_SOCKET, dir) >= n);
+	return (snprintf(path, n, DAEMON_SOCKET_DIR "/" DAEMON_SOCKET, (int)getuid()) >= n);
+}
+
+// create the directory under /tmp for the default socket, or make sure
+// the one there belongs to the user and nobody else can get into it
+int socket_private_dir()
+{
+	char dir[PATH_MAX];
+	struct stat st;
+	
+	snprintf(dir, sizeof(dir), DAEMON_SOCKET_DIR, (int)getuid());
+	if(mkdir(dir, 0700) && (errno != EEXIST))
+	{
+		printf("error: could not create %s: %s\n", dir, strerror(errno));
+		return 1;
+	}
+	
+	if(lstat(dir, &st) || !S_ISDIR(st.st_mode) || (st.st_uid != getuid()) || (st.st_mode & 077))
+	{
+		printf("error: %s must be a directory only you can access\n", dir);
+		return 1;
+	}
+	
+	return 0;
+}
+
+// serve clients on the socket at 'path', with permissions 'mode', until
+// SIGINT or SIGTERM
+int daemon_main(char * path, int mode)
+{
+	struct sockaddr_un addr;
+	struct sigaction sa;
+	struct stat st;
+	sigset_t block, old;
+	mode_t mask;
+	int fd, cfd, ret = 0;
+	
+	if(socket_address(&addr, path))
+		return 1;
+	
+	// a socket that still accepts connections belongs to a running
+	// daemon, one that refuses them is left from one that died. nothing
+	// else at the path is removed.
+	if(lstat(path, &st) == 0)
+	{
+		if(!S_ISSOCK(st.st_mode))
+		{
+			printf("error: %s is in the way and is not a socket\n", path);
+			return 1;
+		}
+		
+		if((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+			return 1;
+		if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+		{
+			printf("error: a daemon is already listening on %s\n", path);
+			ret = 1;
+		} else if(errno != ECONNREFUSED)
+		{
+			printf("error: could not check %s: %s\n", path, strerror(errno));
+			ret = 1;
+		} else if(unlink(path))
+		{
+			printf("error: could not remove stale socket %s: %s\n", path, strerror(errno));
+			ret = 1;
+		}
+		close(fd);
+		
+		if(ret)
+			return 1;
+	}
+	
+	// the socket is created private and only then opened up to 'mode',
+	// so that nobody can connect in between
+	mask = umask(0077);
+	if(((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) ||
+		bind(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+		chmod(path, mode) ||
+		listen(fd, 16))
+	{
+		printf("error: could not listen on %s: %s\n", path, strerror(errno));
+		if(fd >= 0)
+			close(fd);
+		ret = 1;
+	}
+	umask(mask);
+	
+	if(ret)
+		return 1;
+	
+	// no SA_RESTART, so that accept returns when asked to stop
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = daemon_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+	
+	sigemptyset(&block);
+	sigaddset(&block, SIGINT);
+	sigaddset(&block, SIGTERM);
+	
+	printf("listening on %s with %d adapter%s\n", path, nadapters, (nadapters == 1) ? "" : "s");
+	
+	while(!daemon_stop)
+	{
+		if((cfd = accept(fd, NULL, NULL)) < 0)
+		{
+			if((errno == EINTR) || (errno == ECONNABORTED))
+				continue;
+			printf("error: accept failed: %s\n", strerror(errno));
+			ret = 1;
+			break;
+		}
+		
+		// client threads leave the signals to this one
+		pthread_sigmask(SIG_BLOCK, &block, &old);
+		client_start(cfd);
+		pthread_sigmask(SIG_SETMASK, &old, NULL);
+	}
+	
+	close(fd);
+	unlink(path);
+	client_stop_all();
+	
+	printf("stopped\n");
+	return ret;
+}
+
+// send the request made of 'argv' to the daemon on the socket at
+// 'path' and print its reply
+int client_main_request(char * path, int argc, char * argv[])
+{
+	char line[LINE_SIZE], file[PATH_MAX];
+	struct sockaddr_un addr;
+	int fd, i, len = 0, n;
+	
+	if(socket_address(&addr, path))
+		return 1;
+	
+	for(i = 0; i < argc; i++)
+	{
+		// the daemon has its own working directory, so files are sent
+		// as absolute paths
+		if((i == 2) && (strcmp(argv[0], "program") == 0))
+		{
+			if(realpath(argv[i], file) == NULL)
+			{
+				printf("error: could not find %s\n", argv[i]);
+				return 1;
+			}
+			len += snprintf(line + len, sizeof(line) - len, "%s ", file);
+		} else
+			len += snprintf(line + len, sizeof(line) - len, "%s ", argv[i]);
+		if(len >= (int)sizeof(line))
+		{
+			printf("error: request too long\n");
+			return 1;
+		}
+	}
+	line[len - 1] = '\n';
+	
+	if((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		return 1;
+	if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)))
+	{
+		printf("error: could not connect to %s: %s\n", path, strerror(errno));
+		close(fd);
+		return 1;
+	}
+	
+	if(client_write(fd, line, len))
+	{
+		printf("error: could not send request\n");
+		close(fd);
+		return 1;
+	}
+	
+	// the reply is a single line
+	len = 0;
+	while((len < (int)sizeof(line) - 1) && ((n = read(fd, line + len, sizeof(line) - 1 - len)) > 0))
+	{
+		len += n;
+		if(line[len - 1] == '\n')
+			break;
+	}
+	close(fd);
+	line[len] = '\0';
+	
+	if(len == 0)
+	{
+		printf("error: no reply\n");
+		return 1;
+	}
+	
+	printf("%s", line);
+	return (strncmp(line, "ok", 2) != 0);
+}
+
+int main_exit(int ret)
+{
+	s6prog_image_cache_free(image_cache);
+	image_cache = NULL;
+	return ret;
+}
+
+void usage(char * name)
+{
+	printf("usage: %s [options]                  run the daemon\n", name);
+	printf("       %s [-u SOCKET] COMMAND [ARGS]  send a request to it\n", name);
+	printf("  -u, --socket PATH    socket to listen on or connect to (default\n");
+	printf("                       $S6PROG_SOCKET, $XDG_RUNTIME_DIR/%s or\n", DAEMON_SOCKET);
+	printf("                       " DAEMON_SOCKET_DIR "/%s)\n", (int)getuid(), DAEMON_SOCKET);
+	printf("  -U, --socket-mode M  permissions of the socket, in octal (default %03o)\n", DAEMON_SOCKET_MODE);
+	printf("  -T, --transport NAME usb transport or emulator to use\n");
+	printf("  -n, --serial SERIAL  keep the adapter with this serial number open, give\n");
+	printf("                       more than once for several adapters\n");
+	printf("  -a, --all            keep every adapter found open\n");
+	printf("  -p, --poll           poll the device status instead of fixed delays\n");
+	printf("  -t, --timeout MS     give up polling after MS milliseconds (default %d)\n", S6PROG_POLL_TIMEOUT_MS);
+	printf("  -s, --chunk-size N   bytes per shift command (default and maximum %d)\n", S6PROG_CHUNK_SIZE);
+	printf("  -k, --cache          load images through the stream cache\n");
+	printf("  -d, --cache-dir DIR  stream cache directory\n");
+	printf("  -m, --memory MB      memory for compiled images (default %d)\n", DAEMON_CACHE_MB);
+	printf("  -D, --diff           compare with the image last loaded into each board\n");
+	printf("                       and report the frames that changed\n");
+	printf("  -x, --trim           drop padding and NOOP runs the FPGA does not need\n");
+	printf("commands:\n");
+	printf("  list\n");
+	printf("  stats\n");
+	printf("  program SERIAL FILE\n");
+	printf("  idcode SERIAL\n");
+	printf("  dna SERIAL\n");
+	printf("  readback SERIAL REGISTER [WORDS]\n");
+	printf("SERIAL is - for the first adapter\n");
+}
+
+int main(int argc, char * argv[])
+{
+	static struct option long_options[] = {
+		{"socket",       required_argument, NULL, 'u'},
+		{"socket-mode",  required_argument, NULL, 'U'},
+		{"transport",    required_argument, NULL, 'T'},
+		{"serial",       required_argument, NULL, 'n'},
+		{"all",          no_argument,       NULL, 'a'},
+		{"poll",         no_argument,       NULL, 'p'},
+		{"timeout",      required_argument, NULL, 't'},
+		{"chunk-size",   required_argument, NULL, 's'},
+		{"cache",        no_argument,       NULL, 'k'},
+		{"cache-dir",    required_argument, NULL, 'd'},
+		{"memory",       required_argument, NULL, 'm'},
+		{"trim",         no_argument,       NULL, 'x'},
+		{"diff",         no_argument,       NULL, 'D'},
+		{"help",         no_argument,       NULL, 'h'},
+		{NULL, 0, NULL, 0}
+	};
+	static char serials[MAX_ADAPTERS][S6PROG_SERIAL_SIZE];
+	char * path = getenv("S6PROG_SOCKET"), * end;
+	char * transport = NULL;
+	int i, opt, all = 0, poll = 0, chunk_size = 0, use_cache = 0, flags = 0, diff = 0, ret;
+	int mode = DAEMON_SOCKET_MODE, private_dir = 0;
+	long cache_mb = DAEMON_CACHE_MB;
+	char cache_dir[CACHE_DIR_SIZE], socket_path[PATH_MAX];
+	long timeout_ms = S6PROG_POLL_TIMEOUT_MS;
+	
+	cache_dir[0] = '\0';
+	
+	// stop at the first non-option, which starts a client request. the
+	// options shared with s6prog take the same letters.
+	while((opt = getopt_long(argc, argv, "+u:U:T:n:apt:s:kd:m:xDh", long_options, NULL)) != -1)
+	{
+		switch(opt)
+		{
+		case 'u':
+			path = optarg;
+			break;
+		case 'U':
+			mode = strtol(optarg, &end, 8);
+			if((*end != '\0') || (mode < 0) || (mode > 0777))
+			{
+				printf("error: bad socket mode %s\n", optarg);
+				return 1;
+			}
+			break;
+		case 'T':
+			transport = optarg;
+			break;
+		case 'n':
+			if(nadapters >= MAX_ADAPTERS)
+			{
+				printf("error: at most %d adapters can be kept open\n", MAX_ADAPTERS);
+				return 1;
+			}
+			snprintf(serials[nadapters++], S6PROG_SERIAL_SIZE, "%s", optarg);
+			break;
+		case 'a':
+			all = 1;
+			break;
+		case 'p':
+			poll = 1;
+			break;
+		case 't':
+			timeout_ms = atol(optarg);
+			break;
+		case 's':
+			chunk_size = atoi(optarg);
+			break;
+		case 'k':
+			use_cache = 1;
+			break;
+		case 'm':
+			cache_mb = atol(optarg);
+			break;
+		case 'd':
+			snprintf(cache_dir, sizeof(cache_dir), "%s", optarg);
+			break;
+		case 'x':
+			flags |= S6PROG_IMAGE_TRIM;
+			break;
+		case 'D':
+			diff = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	
+	if(path == NULL)
+	{
+		if(socket_default_path(socket_path, sizeof(socket_path), &private_dir))
+		{
+			printf("error: socket path too long\n");
+			return 1;
+		}
+		path = socket_path;
+	}
+	
+	if(optind < argc)
+		return client_main_request(path, argc - optind, &argv[optind]);
+	
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	
+	if(private_dir && socket_private_dir())
+		return 1;
+	
+	if((use_cache || diff) && (cache_dir[0] == '\0') && s6prog_cache_default_dir(cache_dir, sizeof(cache_dir)))
+	{
+		printf("error: could not determine stream cache directory\n");
+		return 1;
+	}
+	
+	image_cache = s6prog_image_cache_new((size_t)cache_mb * 1024 * 1024,
+		(chunk_size > 0) ? chunk_size : S6PROG_CHUNK_SIZE, use_cache ? cache_dir : NULL,
+		diff ? (flags | S6PROG_IMAGE_FRAMES) : flags);
+	if(image_cache == NULL)
+		return 1;
+	
+	if(all)
+	{
+		if((nadapters = s6prog_list(transport, serials, MAX_ADAPTERS)) < 0)
+			return main_exit(1);
+		if(nadapters == 0)
+		{
+			printf("error: no adapters with serial numbers found\n");
+			return main_exit(1);
+		}
+	}
+	if(nadapters == 0)
+	{
+		serials[0][0] = '\0';
+		nadapters = 1;
+	}
+	
+	for(i = 0; i < nadapters; i++)
+	{
+		memcpy(adapters[i].serial, serials[i], S6PROG_SERIAL_SIZE);
+		adapters[i].s = NULL;
+	}
+	
+	ret = daemon_open(transport, poll, timeout_ms, chunk_size, diff ? cache_dir : NULL) || daemon_main(path, mode);
+	daemon_close();
+	
+	return main_exit(ret);
+}
@@ -0,0 +1,67 @@
+/*
+Selects one of the transports built in by name.
+*/
+
+#include "transport.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <time.h>
+
+const char * transport_names[] = {
+#ifdef HAVE_TRANSPORT_FTDI
+	"ftdi",
+#endif
+#ifdef HAVE_TRANSPORT_LIBUSB
+	"libusb",
+#endif
+	"emu",
+	NULL
+};
+
+double transport_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+struct transport * transport_open(const char * name, const char * serial, unsigned char bitmask)
+{
+	if(name == NULL)
+		name = transport_names[0];
+	
+#ifdef HAVE_TRANSPORT_FTDI
+	if(!strcmp(name, "ftdi"))
+		return transport_ftdi_open(serial, bitmask);
+#endif
+#ifdef HAVE_TRANSPORT_LIBUSB
+	if(!strcmp(name, "libusb"))
+		return transport_libusb_open(serial, bitmask);
+#endif
+	if(!strcmp(name, "emu"))
+		return transport_emu_open(serial, bitmask);
+	
+	printf("error: transport_open: no transport called %s\n", name);
+	return NULL;
+}
+
+int transport_list(const char * name, char serials[][TRANSPORT_SERIAL_SIZE], int max)
+{
+	if(name == NULL)
+		name = transport_names[0];
+	
+#ifdef HAVE_TRANSPORT_FTDI
+	if(!strcmp(name, "ftdi"))
+		return transport_ftdi_list(serials, max);
+#endif
+#ifdef HAVE_TRANSPORT_LIBUSB
+	if(!strcmp(name, "libusb"))
+		return transport_libusb_list(serials, max);
+#endif
+	if(!strcmp(name, "emu"))
+		return transport_emu_list(serials, max);
+	
+	printf("error: transport_list: no transport called %s\n", name);
+	return -1;
+}
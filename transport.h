@@ -0,0 +1,108 @@
+/*
+USB transports between the jtag layer in jtag.c and an FT232H's MPSSE
+engine.
+
+Each transport is an instance of struct transport, returned by its open
+function and released with its close method:
+ * ftdi   - libftdi1 (transport_ftdi.c)
+ * libusb - libusb-1.0 directly (transport_libusb.c)
+ * emu    - in-process MPSSE and Spartan-6 TAP emulator, for measuring
+            and checking the host side without a board (transport_emu.c)
+
+Both usb transports keep several bulk transfers in flight in each
+direction with the queues in usb_bulk.c, they only differ in how the
+device is opened and put in MPSSE mode.
+
+The usb transports are built in when the Makefile lists them in
+TRANSPORTS, the emulator is always built.
+*/
+
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+// longest usb serial number kept, including the terminator
+#define TRANSPORT_SERIAL_SIZE (64)
+
+// most reads a transport can have in flight at once
+#define TRANSPORT_MAX_READS (4)
+
+// an asynchronous read in progress
+struct transport_read;
+
+// one piece of a gathered write. 'ref' is set when 'p' stays valid
+// until the next flush, so the transport may send it without a copy.
+struct transport_iov
+{
+	const unsigned char * p;
+	int length;
+	int ref;
+};
+
+struct transport
+{
+	const char * name;
+	
+	// purge, reset and close the device and free the transport
+	void (*close)(struct transport * t);
+	
+	// usb bulk packet size of the device
+	int (*packet_size)(struct transport * t);
+	
+	// largest usb transfers to use for writes and reads
+	int (*set_chunk_size)(struct transport * t, int write_size, int read_size);
+	
+	// write 'n' bytes, returns the number of bytes written. the write
+	// may still be in flight when it returns.
+	int (*write)(struct transport * t, const unsigned char * buf, int n);
+	
+	// write the 'n' pieces at 'iov' back to back, packed into as few usb
+	// transfers as they fit in. pieces marked 'ref' may be sent from
+	// where they are instead. returns the number of bytes written.
+	// NULL if the transport only writes one buffer at a time.
+	int (*writev)(struct transport * t, const struct transport_iov * iov, int n);
+	
+	// wait until every write has reached the device. returns 1 if any
+	// failed since the last flush. NULL if writes complete before
+	// returning.
+	int (*flush)(struct transport * t);
+	
+	// start reading 'n' bytes into 'buf'. returns NULL on error. up to
+	// TRANSPORT_MAX_READS reads may be in flight at once. they are
+	// filled in the order they were submitted and must be waited for in
+	// that order.
+	struct transport_read * (*read_submit)(struct transport * t, unsigned char * buf, int n);
+	
+	// wait for a read to complete, blocking for at most 'timeout_us'
+	// microseconds before cancelling it. 'r' is released. returns the
+	// number of bytes read, which is less than requested on timeout,
+	// or negative on a usb error.
+	int (*read_wait)(struct transport * t, struct transport_read * r, long timeout_us);
+};
+
+// names of the transports built in, NULL terminated. the first is the
+// default.
+extern const char * transport_names[];
+
+// monotonic time in seconds, the one clock the transports, the jtag
+// layer and the library time their steps and deadlines with
+double transport_now();
+
+// open the device with serial number 'serial' (the first found if NULL)
+// through the transport called 'name' (the default if NULL) and put it
+// in MPSSE mode with 'bitmask' as the output pins. returns NULL on
+// error.
+struct transport * transport_open(const char * name, const char * serial, unsigned char bitmask);
+
+// fill 'serials' with the serial numbers of up to 'max' devices the
+// transport called 'name' can open. returns the number found or -1 on
+// error.
+int transport_list(const char * name, char serials[][TRANSPORT_SERIAL_SIZE], int max);
+
+struct transport * transport_ftdi_open(const char * serial, unsigned char bitmask);
+struct transport * transport_libusb_open(const char * serial, unsigned char bitmask);
+struct transport * transport_emu_open(const char * serial, unsigned char bitmask);
+int transport_ftdi_list(char serials[][TRANSPORT_SERIAL_SIZE], int max);
+int transport_libusb_list(char serials[][TRANSPORT_SERIAL_SIZE], int max);
+int transport_emu_list(char serials[][TRANSPORT_SERIAL_SIZE], int max);
+
+#endif
@@ -0,0 +1,1205 @@
+/*
+In-process emulation of an FT232H MPSSE engine driving the JTAG port of
+a Spartan 6, used to measure and check the host side of s6prog without
+a board attached.
+
+Writes are parsed as MPSSE commands, which may be split anywhere across
+writes. Every TCK edge steps a model of the TAP controller and the
+Spartan 6 instruction and data registers, and the TDO bits that the
+commands read are queued for the read methods exactly as the FT232H
+returns them (without the usb status bytes, which the real transports
+strip). TCK cycles are counted at the configured divisor so that the
+time the shifts would take on the wire can be reported next to the
+host side timings.
+
+The model covers what s6prog uses:
+ * IDCODE, BYPASS and the IR capture status bits (DONE, INIT)
+ * CFG_IN, which reassembles the configuration bytes and looks for the
+   sync word. The bytes can be compared against an expected .bin file.
+ * JSHUTDOWN and JSTART, which clear and set DONE after a few TCK
+   cycles in run-test-idle. DONE only goes high if the configuration
+   data was good, otherwise INIT goes low like a CRC error.
+ * type 1 register reads in CFG_IN, whose words are shifted out of
+   CFG_OUT (STAT and IDCODE hold values, other registers read as 0)
+ * configuration memory: each frame an FDRI write pushes out of the
+   frame buffer is kept at the frame address, which then steps to the
+   next, and in MFW mode (from the MFW command until WCFG) each MFWR
+   write copies the frame last written to the frame address. A read of
+   FDRO shifts a pad frame and then the frames from the frame address
+   out of CFG_OUT, those never written as zeros. Frame addresses follow
+   the layout of a geometry file (see bitstream.h), or without one count
+   up. The memory is kept through JSHUTDOWN, as on the device.
+ * ISC_ENABLE, ISC_DISABLE and ISC_DNA
+
+It is set up through environment variables:
+ * S6PROG_EMU_IDCODE   idcode to report (default 0x04008093, xc6slx45)
+ * S6PROG_EMU_DNA      dna of the first adapter, the others count up
+                       from it (default 0x0123456789abc00)
+ * S6PROG_EMU_EXPECT   .bin file the configuration data must match
+ * S6PROG_EMU_GEOMETRY geometry file with the frame layout of the part
+ * S6PROG_EMU_MEMORY   file the configuration memory and DONE are kept in
+                       from one run to the next, as a board keeps them
+                       while it is powered
+ * S6PROG_EMU_REALTIME if set, writes are held back to the TCK rate
+ * S6PROG_EMU_COUNT    number of adapters to list (default 1), with
+                       serial numbers EMU0000, EMU0001, ...
+*/
+
+#include "transport.h"
+#include "bitstream.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <time.h>
+
+#define EMU_PACKET_SIZE (512)
+#define EMU_IDCODE (0x04008093)
+#define EMU_STARTUP_CYCLES (12)
+#define EMU_SHUTDOWN_CYCLES (12)
+#define EMU_DNA (0x0123456789abc00ULL)
+#define EMU_DNA_BITS (57)
+#define EMU_READBACK_WORDS (32)
+#define EMU_FRAME_BYTES (130)
+#define EMU_MEM_SIZE (1024)
+#define EMU_MEMORY_MAGIC "S6EMUME1"
+
+#define EMU_WRITE_NEG (0x01)
+#define EMU_BITMODE (0x02)
+#define EMU_LSB (0x08)
+#define EMU_DO_WRITE (0x10)
+#define EMU_DO_READ (0x20)
+#define EMU_WRITE_TMS (0x40)
+
+#define EMU_INSTR_CFG_OUT (0x04)
+#define EMU_INSTR_CFG_IN (0x05)
+#define EMU_INSTR_IDCODE (0x09)
+#define EMU_INSTR_JSTART (0x0c)
+#define EMU_INSTR_JSHUTDOWN (0x0d)
+#define EMU_INSTR_ISC_ENABLE (0x10)
+#define EMU_INSTR_ISC_DISABLE (0x16)
+#define EMU_INSTR_ISC_DNA (0x30)
+
+// configuration registers and commands the packet processor knows
+#define EMU_REG_FAR_MAJ (0x01)
+#define EMU_REG_FAR_MIN (0x02)
+#define EMU_REG_FDRI (0x03)
+#define EMU_REG_FDRO (0x04)
+#define EMU_REG_CMD (0x05)
+#define EMU_REG_STAT (0x08)
+#define EMU_REG_IDCODE (0x0e)
+#define EMU_REG_MFWR (0x1b)
+#define EMU_CMD_WCFG (0x01)
+#define EMU_CMD_MFW (0x02)
+#define EMU_CMD_DESYNC (0x0d)
+
+// tap controller states
+enum
+{
+	TLR, RTI,
+	SELECT_DR, CAPTURE_DR, SHIFT_DR, EXIT1_DR, PAUSE_DR, EXIT2_DR, UPDATE_DR,
+	SELECT_IR, CAPTURE_IR, SHIFT_IR, EXIT1_IR, PAUSE_IR, EXIT2_IR, UPDATE_IR
+};
+
+// next tap state for TMS = 0 and TMS = 1
+static const unsigned char emu_next[16][2] = {
+	[TLR]        = {RTI,        TLR},
+	[RTI]        = {RTI,        SELECT_DR},
+	[SELECT_DR]  = {CAPTURE_DR, SELECT_IR},
+	[CAPTURE_DR] = {SHIFT_DR,   EXIT1_DR},
+	[SHIFT_DR]   = {SHIFT_DR,   EXIT1_DR},
+	[EXIT1_DR]   = {PAUSE_DR,   UPDATE_DR},
+	[PAUSE_DR]   = {PAUSE_DR,   EXIT2_DR},
+	[EXIT2_DR]   = {SHIFT_DR,   UPDATE_DR},
+	[UPDATE_DR]  = {RTI,        SELECT_DR},
+	[SELECT_IR]  = {CAPTURE_IR, TLR},
+	[CAPTURE_IR] = {SHIFT_IR,   EXIT1_IR},
+	[SHIFT_IR]   = {SHIFT_IR,   EXIT1_IR},
+	[EXIT1_IR]   = {PAUSE_IR,   UPDATE_IR},
+	[PAUSE_IR]   = {PAUSE_IR,   EXIT2_IR},
+	[EXIT2_IR]   = {SHIFT_IR,   UPDATE_IR},
+	[UPDATE_IR]  = {RTI,        SELECT_DR},
+};
+
+// a frame of configuration memory and its address
+struct emu_frame
+{
+	uint32_t far;
+	unsigned char * data;
+};
+
+struct emu
+{
+	struct transport t;
+	char serial[TRANSPORT_SERIAL_SIZE];
+	
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	
+	// command being parsed, and payload bytes still to come for a
+	// byte shift that writes
+	unsigned char cmd[3];
+	int cmd_len;
+	int cmd_need;
+	long data_left;
+	
+	// mpsse state
+	int tms;
+	int divisor;
+	int div5;
+	
+	// tap and device state
+	int state;
+	int ir;
+	unsigned char ir_shift;
+	uint64_t dr;
+	int dr_len;
+	uint32_t idcode;
+	uint64_t dna;
+	int done;
+	int init;
+	int isc;
+	long rti_cycles;
+	unsigned long long cycles;
+	
+	// configuration data shifted in through CFG_IN
+	unsigned char cfg_byte;
+	int cfg_bits;
+	long cfg_bytes;
+	uint32_t cfg_window;
+	int synced;
+	long mismatch;
+	unsigned char * expect;
+	long expect_length;
+	
+	// packet processor, which takes 16 bit words after the sync word
+	int pkt_synced;
+	int pkt_half;
+	unsigned char pkt_hi;
+	int pkt_op;
+	int pkt_reg;
+	int pkt_count;
+	long pkt_skip;
+	long pkt_word;
+	uint32_t far;
+	
+	// register words read by type 1 packets, waiting for CFG_OUT
+	uint16_t rdbk[EMU_READBACK_WORDS];
+	int rdbk_n;
+	int rdbk_bit;
+	
+	// configuration memory, an open addressed table of the frames
+	// written, kept at most half full, and the layout of the part
+	struct emu_frame * mem;
+	size_t mem_size;
+	size_t mem_used;
+	struct bit_geometry geometry;
+	int has_geometry;
+	const char * memory;
+	
+	// an FDRI write in progress: the frame being shifted in and the one
+	// before it, which the next pushes out. 'last' is the frame last
+	// written, which MFWR copies in MFW mode.
+	int fdri;
+	unsigned char fill[EMU_FRAME_BYTES];
+	int fill_len;
+	unsigned char held[EMU_FRAME_BYTES];
+	int has_held;
+	unsigned char * last;
+	int mfw;
+	
+	// an FDRO read waiting for CFG_OUT: the address of the frame being
+	// read and its data (NULL for zeros), the bit reached in it, whether
+	// it is still the pad frame, and the bits left of the read
+	uint32_t fdro_far;
+	const unsigned char * fdro;
+	long fdro_pos;
+	int fdro_pad;
+	long fdro_bits;
+	
+	// TDO bytes waiting to be read
+	unsigned char * out;
+	size_t out_len;
+	size_t out_off;
+	size_t out_size;
+	
+	int realtime;
+	double start;
+	
+	// bit reversed bytes
+	unsigned char reverse[256];
+};
+
+struct transport_read
+{
+	unsigned char * buf;
+	int n;
+};
+
+static double emu_tck_hz(struct emu * e)
+{
+	return (e->div5 ? 12e6 : 60e6) / ((e->divisor + 1) * 2);
+}
+
+static void emu_out(struct emu * e, unsigned char b)
+{
+	unsigned char * p;
+	
+	if(e->out_len == e->out_size)
+	{
+		// drop what has been read before growing
+		if(e->out_off > 0)
+		{
+			memmove(e->out, &e->out[e->out_off], e->out_len - e->out_off);
+			e->out_len -= e->out_off;
+			e->out_off = 0;
+		}
+		if(e->out_len == e->out_size)
+		{
+			if((p = realloc(e->out, e->out_size * 2)) == NULL)
+				return;
+			e->out = p;
+			e->out_size *= 2;
+		}
+	}
+	e->out[e->out_len++] = b;
+}
+
+// the configuration is good if the sync word was seen and, when an
+// expected file was given, every byte matched it
+static int emu_cfg_ok(struct emu * e)
+{
+	if(!e->synced || (e->mismatch >= 0))
+		return 0;
+	return (e->expect == NULL) || (e->cfg_bytes == e->expect_length);
+}
+
+static void emu_cfg_reset(struct emu * e)
+{
+	e->cfg_byte = 0;
+	e->cfg_bits = 0;
+	e->cfg_bytes = 0;
+	e->cfg_window = 0;
+	e->synced = 0;
+	e->mismatch = -1;
+	e->pkt_synced = 0;
+	e->rdbk_n = 0;
+	e->fdri = 0;
+	e->mfw = 0;
+	e->fdro_bits = 0;
+}
+
+static const struct bit_geometry * emu_geometry(struct emu * e)
+{
+	return e->has_geometry ? &e->geometry : NULL;
+}
+
+// the slot in 'mem' of 'size' slots holding frame address 'far', or the
+// free one it would go in
+static size_t emu_mem_slot(const struct emu_frame * mem, size_t size, uint32_t far)
+{
+	size_t k;
+	
+	for(k = ((far ^ (far >> 16)) * 2654435761u) & (size - 1); mem[k].data != NULL; k = (k + 1) & (size - 1))
+		if(mem[k].far == far)
+			break;
+	
+	return k;
+}
+
+// the frame at address 'far', or if 'create' is set a new one for it
+// when there is none. NULL if there is none, or no memory for it.
+static unsigned char * emu_mem_frame(struct emu * e, uint32_t far, int create)
+{
+	struct emu_frame * mem;
+	size_t i, k, size;
+	
+	if(e->mem_size > 0)
+	{
+		k = emu_mem_slot(e->mem, e->mem_size, far);
+		if((e->mem[k].data != NULL) || !create)
+			return e->mem[k].data;
+	} else if(!create)
+		return NULL;
+	
+	if(2 * (e->mem_used + 1) > e->mem_size)
+	{
+		size = (e->mem_size > 0) ? e->mem_size * 2 : EMU_MEM_SIZE;
+		if((mem = calloc(size, sizeof(struct emu_frame))) == NULL)
+			return NULL;
+		for(i = 0; i < e->mem_size; i++)
+			if(e->mem[i].data != NULL)
+				mem[emu_mem_slot(mem, size, e->mem[i].far)] = e->mem[i];
+		free(e->mem);
+		e->mem = mem;
+		e->mem_size = size;
+	}
+	
+	k = emu_mem_slot(e->mem, e->mem_size, far);
+	if((e->mem[k].data = calloc(1, EMU_FRAME_BYTES)) == NULL)
+		return NULL;
+	e->mem[k].far = far;
+	e->mem_used++;
+	return e->mem[k].data;
+}
+
+// write 'frame' to the frame address
+static void emu_frame_write(struct emu * e, const unsigned char * frame)
+{
+	unsigned char * p;
+	
+	if((p = emu_mem_frame(e, e->far, 1)) == NULL)
+		return;
+	memmove(p, frame, EMU_FRAME_BYTES);
+	e->last = p;
+}
+
+// a word of FDRI data. each whole frame pushes the one before it out to
+// the frame address, which steps on to the next.
+static void emu_fdri_word(struct emu * e, uint16_t w)
+{
+	e->fill[e->fill_len++] = w >> 8;
+	e->fill[e->fill_len++] = w;
+	if(e->fill_len < EMU_FRAME_BYTES)
+		return;
+	
+	if(e->has_held)
+	{
+		emu_frame_write(e, e->held);
+		e->far = bit_far_next(emu_geometry(e), e->far);
+	}
+	memcpy(e->held, e->fill, EMU_FRAME_BYTES);
+	e->has_held = 1;
+	e->fill_len = 0;
+}
+
+// start a write of 'n' words to FDRI, or a read of 'n' words from FDRO
+static void emu_frames(struct emu * e, long n)
+{
+	if((e->pkt_op == 2) && (e->pkt_reg == EMU_REG_FDRI))
+	{
+		e->fdri = 1;
+		e->fill_len = 0;
+		e->has_held = 0;
+	} else if((e->pkt_op == 1) && (e->pkt_reg == EMU_REG_FDRO))
+	{
+		// the first frame read out is a pad frame
+		e->fdro_far = e->far;
+		e->fdro = NULL;
+		e->fdro_pos = 0;
+		e->fdro_pad = 1;
+		e->fdro_bits = n * 16;
+	}
+}
+
+// move an FDRO read on to the next frame once one has been shifted out
+static void emu_fdro_next(struct emu * e)
+{
+	if(e->fdro_pos < EMU_FRAME_BYTES * 8)
+		return;
+	
+	if(!e->fdro_pad)
+		e->fdro_far = bit_far_next(emu_geometry(e), e->fdro_far);
+	e->fdro_pad = 0;
+	e->fdro = emu_mem_frame(e, e->fdro_far, 0);
+	e->fdro_pos = 0;
+}
+
+// the next bit of an FDRO read, msb first
+static int emu_fdro_bit(struct emu * e)
+{
+	int bit = 0;
+	
+	emu_fdro_next(e);
+	if(e->fdro != NULL)
+		bit = (e->fdro[e->fdro_pos >> 3] >> (7 - (e->fdro_pos & 7))) & 1;
+	e->fdro_pos++;
+	e->fdro_bits--;
+	return bit;
+}
+
+// queue 'n' words of register 'reg' for CFG_OUT
+static void emu_readback(struct emu * e, int reg, int n)
+{
+	uint16_t w[2] = {0, 0};
+	int i;
+	
+	if(reg == EMU_REG_STAT)
+	{
+		// DONE, INIT_B and, once started, GHIGH_B, GWE and GTS_CFG_B
+		w[0] = (e->done << 13) | (e->init << 12) | (e->done ? 0x0038 : 0);
+	} else if(reg == EMU_REG_IDCODE)
+	{
+		w[0] = e->idcode >> 16;
+		w[1] = e->idcode;
+	}
+	
+	for(i = 0; (i < n) && (e->rdbk_n < EMU_READBACK_WORDS); i++)
+		e->rdbk[e->rdbk_n++] = (i < 2) ? w[i] : 0;
+	e->rdbk_bit = 0;
+}
+
+// one 16 bit word for the packet processor
+static void emu_cfg_word(struct emu * e, uint16_t w)
+{
+	// word count of a type 2 packet
+	if(e->pkt_count > 0)
+	{
+		e->pkt_skip = (e->pkt_skip << 16) | w;
+		if(--e->pkt_count > 0)
+			return;
+		emu_frames(e, e->pkt_skip);
+		if(e->pkt_op != 2)
+			e->pkt_skip = 0;
+		return;
+	}
+	
+	// register data
+	if(e->pkt_skip > 0)
+	{
+		if((e->pkt_reg == EMU_REG_CMD) && (w == EMU_CMD_DESYNC))
+			e->pkt_synced = 0;
+		else if((e->pkt_reg == EMU_REG_CMD) && ((w == EMU_CMD_WCFG) || (w == EMU_CMD_MFW)))
+			e->mfw = (w == EMU_CMD_MFW);
+		else if((e->pkt_reg == EMU_REG_FAR_MAJ) && (e->pkt_word == 0))
+			e->far = (e->far & 0xffff) | ((uint32_t)w << 16);
+		else if(((e->pkt_reg == EMU_REG_FAR_MAJ) && (e->pkt_word == 1)) ||
+			((e->pkt_reg == EMU_REG_FAR_MIN) && (e->pkt_word == 0)))
+			e->far = (e->far & 0xffff0000) | w;
+		else if((e->pkt_reg == EMU_REG_FDRI) && e->fdri)
+			emu_fdri_word(e, w);
+		e->pkt_word++;
+		
+		// the last frame of a write only pushes the one before it out,
+		// and an MFWR write copies once its words are in
+		if(--e->pkt_skip > 0)
+			return;
+		e->fdri = 0;
+		if((e->pkt_reg == EMU_REG_MFWR) && e->mfw && (e->last != NULL))
+			emu_frame_write(e, e->last);
+		return;
+	}
+	
+	e->pkt_op = (w >> 11) & 3;
+	e->pkt_word = 0;
+	switch(w >> 13)
+	{
+	case 1:
+		e->pkt_reg = (w >> 5) & 0x3f;
+		if((e->pkt_op == 1) && (e->pkt_reg == EMU_REG_FDRO))
+			emu_frames(e, w & 0x1f);
+		else if(e->pkt_op == 1)
+			emu_readback(e, e->pkt_reg, w & 0x1f);
+		else if(e->pkt_op == 2)
+		{
+			e->pkt_skip = w & 0x1f;
+			if(e->pkt_skip > 0)
+				emu_frames(e, e->pkt_skip);
+		}
+		break;
+	case 2:
+		// with no register it goes to that of the type 1 packet before
+		if((w >> 5) & 0x3f)
+			e->pkt_reg = (w >> 5) & 0x3f;
+		e->pkt_skip = 0;
+		e->pkt_count = 2;
+		break;
+	}
+}
+
+// a byte of CFG_IN data. until the device has started it is
+// configuration data, after that only register accesses are expected.
+static void emu_cfg_data(struct emu * e, unsigned char b)
+{
+	if(e->pkt_synced)
+	{
+		if(e->pkt_half)
+			emu_cfg_word(e, (e->pkt_hi << 8) | b);
+		e->pkt_hi = b;
+		e->pkt_half ^= 1;
+	}
+	
+	e->cfg_window = (e->cfg_window << 8) | b;
+	if(e->cfg_window == 0xaa995566)
+	{
+		e->pkt_synced = 1;
+		e->pkt_half = 0;
+		e->pkt_count = 0;
+		e->pkt_skip = 0;
+	}
+	
+	if(e->done)
+		return;
+	
+	if(e->pkt_synced)
+		e->synced = 1;
+	
+	if((e->expect != NULL) && (e->mismatch < 0) &&
+		((e->cfg_bytes >= e->expect_length) || (e->expect[e->cfg_bytes] != b)))
+		e->mismatch = e->cfg_bytes;
+	
+	e->cfg_bytes++;
+}
+
+// 'n' TCK cycles in run-test-idle run the startup and shutdown sequences
+static void emu_rti(struct emu * e, long n)
+{
+	long before = e->rti_cycles;
+	
+	e->rti_cycles += n;
+	
+	if(e->ir == EMU_INSTR_JSTART)
+	{
+		if((before < EMU_STARTUP_CYCLES) && (e->rti_cycles >= EMU_STARTUP_CYCLES))
+		{
+			if(emu_cfg_ok(e))
+				e->done = 1;
+			else if(e->synced)
+				e->init = 0;
+		}
+	} else if(e->ir == EMU_INSTR_JSHUTDOWN)
+	{
+		if((before < EMU_SHUTDOWN_CYCLES) && (e->rti_cycles >= EMU_SHUTDOWN_CYCLES))
+		{
+			e->done = 0;
+			e->init = 1;
+			emu_cfg_reset(e);
+		}
+	}
+}
+
+// one TCK cycle, returns the TDO bit sampled on its rising edge
+static int emu_clock(struct emu * e, int tms, int tdi)
+{
+	int i, tdo = 0;
+	
+	e->cycles++;
+	
+	switch(e->state)
+	{
+	case RTI:
+		emu_rti(e, 1);
+		break;
+	case CAPTURE_IR:
+		e->ir_shift = 0x01 | (e->isc << 3) | (e->init << 4) | (e->done << 5);
+		break;
+	case SHIFT_IR:
+		tdo = e->ir_shift & 1;
+		e->ir_shift = (e->ir_shift >> 1) | (tdi << 5);
+		break;
+	case CAPTURE_DR:
+		if(e->ir == EMU_INSTR_IDCODE)
+		{
+			e->dr = e->idcode;
+			e->dr_len = 32;
+		} else if((e->ir == EMU_INSTR_ISC_DNA) && e->isc)
+		{
+			// shifted out msb first
+			e->dr = 0;
+			for(i = 0; i < EMU_DNA_BITS; i++)
+				e->dr |= ((e->dna >> i) & 1) << (EMU_DNA_BITS - 1 - i);
+			e->dr_len = EMU_DNA_BITS;
+		} else {
+			e->dr = 0;
+			e->dr_len = 1;
+		}
+		break;
+	case SHIFT_DR:
+		if(e->ir == EMU_INSTR_CFG_IN)
+		{
+			// configuration data is taken msb first
+			e->cfg_byte = (e->cfg_byte << 1) | tdi;
+			if(++e->cfg_bits == 8)
+			{
+				emu_cfg_data(e, e->cfg_byte);
+				e->cfg_bits = 0;
+			}
+		} else if(e->ir == EMU_INSTR_CFG_OUT)
+		{
+			// register words are shifted out msb first
+			if(e->rdbk_n > 0)
+			{
+				tdo = (e->rdbk[0] >> (15 - e->rdbk_bit)) & 1;
+				if(++e->rdbk_bit == 16)
+				{
+					memmove(e->rdbk, e->rdbk + 1, --e->rdbk_n * sizeof(uint16_t));
+					e->rdbk_bit = 0;
+				}
+			} else if(e->fdro_bits > 0)
+				tdo = emu_fdro_bit(e);
+		} else {
+			tdo = e->dr & 1;
+			e->dr = (e->dr >> 1) | ((uint64_t)tdi << (e->dr_len - 1));
+		}
+		break;
+	}
+	
+	e->state = emu_next[e->state][tms];
+	
+	switch(e->state)
+	{
+	case TLR:
+		e->ir = EMU_INSTR_IDCODE;
+		break;
+	case UPDATE_IR:
+		e->ir = e->ir_shift & 0x3f;
+		e->rti_cycles = 0;
+		if(e->ir == EMU_INSTR_ISC_ENABLE)
+			e->isc = 1;
+		else if(e->ir == EMU_INSTR_ISC_DISABLE)
+			e->isc = 0;
+		break;
+	}
+	
+	return tdo;
+}
+
+// 'n' TCK cycles without data, as DATA_CLK_BITS and DATA_CLK_BYTES give
+static void emu_idle(struct emu * e, long n)
+{
+	if((e->state == RTI) && !e->tms)
+	{
+		e->cycles += n;
+		emu_rti(e, n);
+		return;
+	}
+	
+	while(n-- > 0)
+		emu_clock(e, e->tms, 0);
+}
+
+// shift one byte of a byte mode command
+static void emu_shift_byte(struct emu * e, unsigned char op, unsigned char b)
+{
+	unsigned char acc = 0;
+	int i, tdo;
+	
+	// whole bytes of configuration data without reads, and whole bytes
+	// through a one bit register, skip the bit by bit model
+	if((e->state == SHIFT_DR) && !e->tms)
+	{
+		if((e->ir == EMU_INSTR_CFG_IN) && !(op & EMU_DO_READ) && (e->cfg_bits == 0))
+		{
+			emu_cfg_data(e, (op & EMU_LSB) ? e->reverse[b] : b);
+			e->cycles += 8;
+			return;
+		}
+		
+		// and whole bytes of frame readback
+		if((e->ir == EMU_INSTR_CFG_OUT) && (e->rdbk_n == 0) && (e->fdro_bits >= 8) && !(e->fdro_pos & 7))
+		{
+			emu_fdro_next(e);
+			if(e->fdro != NULL)
+				acc = (op & EMU_LSB) ? e->reverse[e->fdro[e->fdro_pos >> 3]] : e->fdro[e->fdro_pos >> 3];
+			e->fdro_pos += 8;
+			e->fdro_bits -= 8;
+			if(op & EMU_DO_READ)
+				emu_out(e, acc);
+			e->cycles += 8;
+			return;
+		}
+		
+		if((e->ir != EMU_INSTR_CFG_IN) && (e->ir != EMU_INSTR_CFG_OUT) && (e->dr_len == 1))
+		{
+			if(op & EMU_LSB)
+			{
+				acc = (b << 1) | (e->dr & 1);
+				e->dr = b >> 7;
+			} else {
+				acc = ((e->dr & 1) << 7) | (b >> 1);
+				e->dr = b & 1;
+			}
+			if(op & EMU_DO_READ)
+				emu_out(e, acc);
+			e->cycles += 8;
+			return;
+		}
+	}
+	
+	for(i = 0; i < 8; i++)
+	{
+		if(op & EMU_LSB)
+		{
+			tdo = emu_clock(e, e->tms, (b >> i) & 1);
+			acc = (acc >> 1) | (tdo << 7);
+		} else {
+			tdo = emu_clock(e, e->tms, (b >> (7 - i)) & 1);
+			acc = (acc << 1) | tdo;
+		}
+	}
+	
+	if(op & EMU_DO_READ)
+		emu_out(e, acc);
+}
+
+// bytes in the command header for opcode 'op'
+static int emu_cmd_length(unsigned char op)
+{
+	if(op & 0x80)
+	{
+		switch(op)
+		{
+		case 0x80:	// SET_BITS_LOW
+		case 0x82:	// SET_BITS_HIGH
+		case 0x86:	// TCK_DIVISOR
+		case 0x8f:	// DATA_CLK_BYTES
+			return 3;
+		case 0x8e:	// DATA_CLK_BITS
+			return 2;
+		default:
+			return 1;
+		}
+	}
+	
+	if((op & EMU_BITMODE) && !(op & (EMU_WRITE_TMS | EMU_DO_WRITE)))
+		return 2;
+	return 3;
+}
+
+static void emu_execute(struct emu * e)
+{
+	unsigned char op = e->cmd[0], acc = 0;
+	int i, n, tdi, tdo;
+	
+	if(op & 0x80)
+	{
+		switch(op)
+		{
+		case 0x80:	// SET_BITS_LOW, TMS is ADBUS3
+			e->tms = (e->cmd[1] >> 3) & 1;
+			break;
+		case 0x81:	// GET_BITS_LOW
+		case 0x83:	// GET_BITS_HIGH
+			emu_out(e, 0);
+			break;
+		case 0x86:	// TCK_DIVISOR
+			e->divisor = e->cmd[1] | (e->cmd[2] << 8);
+			break;
+		case 0x8a:	// CLK_DIV_5_DISABLE
+			e->div5 = 0;
+			break;
+		case 0x8b:	// CLK_DIV_5_ENABLE
+			e->div5 = 1;
+			break;
+		case 0x8e:	// DATA_CLK_BITS
+			emu_idle(e, e->cmd[1] + 1);
+			break;
+		case 0x8f:	// DATA_CLK_BYTES
+			emu_idle(e, ((e->cmd[1] | (e->cmd[2] << 8)) + 1) * 8L);
+			break;
+		case 0x82:	// SET_BITS_HIGH
+		case 0x84:	// loopback on
+		case 0x85:	// loopback off
+		case 0x87:	// SEND_IMMEDIATE
+		case 0x8c:	// 3 phase clocking on
+		case 0x8d:	// 3 phase clocking off
+		case 0x96:	// adaptive clocking on
+		case 0x97:	// adaptive clocking off
+			break;
+		default:
+			// bad command
+			emu_out(e, 0xfa);
+			emu_out(e, op);
+			break;
+		}
+		return;
+	}
+	
+	// TMS bits are sent lsb first, bit 7 holds TDI for all of them
+	if(op & EMU_WRITE_TMS)
+	{
+		n = (e->cmd[1] & 0x07) + 1;
+		tdi = e->cmd[2] >> 7;
+		for(i = 0; i < n; i++)
+		{
+			e->tms = (e->cmd[2] >> i) & 1;
+			tdo = emu_clock(e, e->tms, tdi);
+			acc = (acc >> 1) | (tdo << 7);
+		}
+		if(op & EMU_DO_READ)
+			emu_out(e, acc);
+		return;
+	}
+	
+	if(op & EMU_BITMODE)
+	{
+		n = (e->cmd[1] & 0x07) + 1;
+		for(i = 0; i < n; i++)
+		{
+			if(op & EMU_LSB)
+			{
+				tdi = (op & EMU_DO_WRITE) ? (e->cmd[2] >> i) & 1 : 0;
+				tdo = emu_clock(e, e->tms, tdi);
+				acc = (acc >> 1) | (tdo << 7);
+			} else {
+				tdi = (op & EMU_DO_WRITE) ? (e->cmd[2] >> (7 - i)) & 1 : 0;
+				tdo = emu_clock(e, e->tms, tdi);
+				acc = (acc << 1) | tdo;
+			}
+		}
+		if(op & EMU_DO_READ)
+			emu_out(e, acc);
+		return;
+	}
+	
+	// byte mode, the payload follows the header when writing
+	n = (e->cmd[1] | (e->cmd[2] << 8)) + 1;
+	if(op & EMU_DO_WRITE)
+		e->data_left = n;
+	else
+		for(i = 0; i < n; i++)
+			emu_shift_byte(e, op, 0);
+}
+
+static void emu_parse(struct emu * e, const unsigned char * buf, int n)
+{
+	while(n > 0)
+	{
+		if(e->data_left > 0)
+		{
+			emu_shift_byte(e, e->cmd[0], *buf++);
+			n--;
+			e->data_left--;
+			continue;
+		}
+		
+		e->cmd[e->cmd_len++] = *buf++;
+		n--;
+		if(e->cmd_len == 1)
+			e->cmd_need = emu_cmd_length(e->cmd[0]);
+		if(e->cmd_len < e->cmd_need)
+			continue;
+		
+		emu_execute(e);
+		e->cmd_len = 0;
+	}
+}
+
+// keep the configuration memory in 'filename' for the next run: DONE,
+// then each frame after its big endian address
+static void emu_memory_save(struct emu * e, const char * filename)
+{
+	unsigned char rec[4];
+	size_t i;
+	FILE * f;
+	int ret;
+	
+	if((f = fopen(filename, "wb")) == NULL)
+	{
+		printf("error: emu_memory_save: could not open %s\n", filename);
+		return;
+	}
+	
+	ret = (fwrite(EMU_MEMORY_MAGIC, 8, 1, f) != 1) || (fputc(e->done, f) == EOF);
+	for(i = 0; !ret && (i < e->mem_size); i++)
+	{
+		if(e->mem[i].data == NULL)
+			continue;
+		rec[0] = e->mem[i].far >> 24;
+		rec[1] = e->mem[i].far >> 16;
+		rec[2] = e->mem[i].far >> 8;
+		rec[3] = e->mem[i].far;
+		ret = (fwrite(rec, 4, 1, f) != 1) || (fwrite(e->mem[i].data, EMU_FRAME_BYTES, 1, f) != 1);
+	}
+	
+	if((fclose(f) != 0) || ret)
+		printf("error: emu_memory_save: could not write %s\n", filename);
+}
+
+// read the configuration memory kept by emu_memory_save, if there is
+// any yet
+static int emu_memory_load(struct emu * e, const char * filename)
+{
+	unsigned char rec[4 + EMU_FRAME_BYTES], * p;
+	char magic[8];
+	FILE * f;
+	int done, ret = 0;
+	
+	if((f = fopen(filename, "rb")) == NULL)
+		return 0;
+	
+	if((fread(magic, 8, 1, f) != 1) || (memcmp(magic, EMU_MEMORY_MAGIC, 8) != 0) || ((done = fgetc(f)) == EOF))
+		ret = 1;
+	while(!ret && (fread(rec, sizeof(rec), 1, f) == 1))
+	{
+		if((p = emu_mem_frame(e, ((uint32_t)rec[0] << 24) | (rec[1] << 16) | (rec[2] << 8) | rec[3], 1)) == NULL)
+			ret = 1;
+		else
+			memcpy(p, &rec[4], EMU_FRAME_BYTES);
+	}
+	fclose(f);
+	
+	if(ret)
+		printf("error: emu_memory_load: bad memory file %s\n", filename);
+	else
+		e->done = (done != 0);
+	return ret;
+}
+
+static void emu_close(struct transport * t)
+{
+	struct emu * e = (struct emu *)t;
+	size_t i;
+	
+	printf("emu %s: %llu TCK cycles, %.3f ms at %.3f MHz\n", e->serial, e->cycles,
+		e->cycles * 1e3 / emu_tck_hz(e), emu_tck_hz(e) * 1e-6);
+	if(e->cfg_bytes > 0)
+	{
+		printf("emu %s: %ld configuration bytes, sync word %s", e->serial, e->cfg_bytes,
+			e->synced ? "found" : "not found");
+		if(e->expect == NULL)
+			printf("\n");
+		else if(e->mismatch >= 0)
+			printf(", mismatch at byte %ld\n", e->mismatch);
+		else if(e->cfg_bytes != e->expect_length)
+			printf(", %ld of %ld expected bytes\n", e->cfg_bytes, e->expect_length);
+		else
+			printf(", matches expected data\n");
+	}
+	
+	if(e->memory != NULL)
+		emu_memory_save(e, e->memory);
+	
+	pthread_mutex_destroy(&e->lock);
+	pthread_cond_destroy(&e->cond);
+	for(i = 0; i < e->mem_size; i++)
+		free(e->mem[i].data);
+	free(e->mem);
+	free(e->expect);
+	free(e->out);
+	free(e);
+}
+
+static int emu_packet_size(struct transport * t)
+{
+	return EMU_PACKET_SIZE;
+}
+
+static int emu_set_chunk_size(struct transport * t, int write_size, int read_size)
+{
+	return 0;
+}
+
+static int emu_writev(struct transport * t, const struct transport_iov * iov, int n)
+{
+	struct emu * e = (struct emu *)t;
+	struct timespec ts;
+	double wait;
+	int i, length = 0;
+	
+	pthread_mutex_lock(&e->lock);
+	for(i = 0; i < n; i++)
+	{
+		emu_parse(e, iov[i].p, iov[i].length);
+		length += iov[i].length;
+	}
+	wait = e->start + e->cycles / emu_tck_hz(e) - transport_now();
+	pthread_cond_broadcast(&e->cond);
+	pthread_mutex_unlock(&e->lock);
+	
+	// hold the write back until the wire would have finished it
+	if(e->realtime && (wait > 0))
+	{
+		ts.tv_sec = (time_t)wait;
+		ts.tv_nsec = (long)((wait - ts.tv_sec) * 1e9);
+		nanosleep(&ts, NULL);
+	}
+	
+	return length;
+}
+
+static int emu_write(struct transport * t, const unsigned char * buf, int n)
+{
+	struct transport_iov iov = {buf, n, 0};
+	
+	return emu_writev(t, &iov, 1);
+}
+
+static struct transport_read * emu_read_submit(struct transport * t, unsigned char * buf, int n)
+{
+	struct transport_read * r;
+	
+	if((r = malloc(sizeof(struct transport_read))) == NULL)
+		return NULL;
+	r->buf = buf;
+	r->n = n;
+	return r;
+}
+
+static int emu_read_wait(struct transport * t, struct transport_read * r, long timeout_us)
+{
+	struct emu * e = (struct emu *)t;
+	struct timespec ts;
+	int n;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	ts.tv_sec += timeout_us / 1000000;
+	ts.tv_nsec += (timeout_us % 1000000) * 1000;
+	if(ts.tv_nsec >= 1000000000)
+	{
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+	
+	pthread_mutex_lock(&e->lock);
+	while(e->out_len - e->out_off < (size_t)r->n)
+		if(pthread_cond_timedwait(&e->cond, &e->lock, &ts) == ETIMEDOUT)
+			break;
+	
+	n = e->out_len - e->out_off;
+	if(n > r->n)
+		n = r->n;
+	memcpy(r->buf, &e->out[e->out_off], n);
+	e->out_off += n;
+	if(e->out_off == e->out_len)
+		e->out_off = e->out_len = 0;
+	pthread_mutex_unlock(&e->lock);
+	
+	free(r);
+	return n;
+}
+
+// read the expected configuration data for S6PROG_EMU_EXPECT
+static int emu_load_expect(struct emu * e, char * filename)
+{
+	FILE * f;
+	long length;
+	
+	if((f = fopen(filename, "rb")) == NULL)
+	{
+		printf("error: emu_load_expect: could not open %s\n", filename);
+		return 1;
+	}
+	
+	fseek(f, 0, SEEK_END);
+	length = ftell(f);
+	rewind(f);
+	
+	if((length < 0) || ((e->expect = malloc(length + 1)) == NULL) ||
+		(fread(e->expect, 1, length, f) != (size_t)length))
+	{
+		printf("error: emu_load_expect: could not read %s\n", filename);
+		fclose(f);
+		return 1;
+	}
+	
+	fclose(f);
+	e->expect_length = length;
+	return 0;
+}
+
+// number of emulated adapters
+static int emu_count()
+{
+	char * s = getenv("S6PROG_EMU_COUNT");
+	return (s != NULL) ? atoi(s) : 1;
+}
+
+int transport_emu_list(char serials[][TRANSPORT_SERIAL_SIZE], int max)
+{
+	int i;
+	
+	for(i = 0; (i < emu_count()) && (i < max); i++)
+		snprintf(serials[i], TRANSPORT_SERIAL_SIZE, "EMU%04d", i);
+	
+	return i;
+}
+
+struct transport * transport_emu_open(const char * serial, unsigned char bitmask)
+{
+	pthread_condattr_t attr;
+	struct emu * e;
+	char * s;
+	int i;
+	
+	if((serial != NULL) && ((sscanf(serial, "EMU%d", &i) != 1) || (i < 0) || (i >= emu_count())))
+	{
+		printf("error: could not open emulated device %s\n", serial);
+		return NULL;
+	}
+	
+	if((e = calloc(1, sizeof(struct emu))) == NULL)
+	{
+		printf("error: transport_emu_open: out of memory\n");
+		return NULL;
+	}
+	
+	for(i = 0; i < 256; i++)
+		e->reverse[i] = ((i & 0x01) << 7) | ((i & 0x02) << 5) | ((i & 0x04) << 3) | ((i & 0x08) << 1) |
+			((i & 0x10) >> 1) | ((i & 0x20) >> 3) | ((i & 0x40) >> 5) | ((i & 0x80) >> 7);
+	
+	e->t.name = "emu";
+	snprintf(e->serial, sizeof(e->serial), "%s", (serial != NULL) ? serial : "EMU0000");
+	e->t.close = emu_close;
+	e->t.packet_size = emu_packet_size;
+	e->t.set_chunk_size = emu_set_chunk_size;
+	e->t.write = emu_write;
+	e->t.writev = emu_writev;
+	e->t.read_submit = emu_read_submit;
+	e->t.read_wait = emu_read_wait;
+	
+	pthread_mutex_init(&e->lock, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&e->cond, &attr);
+	pthread_condattr_destroy(&attr);
+	
+	e->out_size = 4096;
+	if((e->out = malloc(e->out_size)) == NULL)
+	{
+		printf("error: transport_emu_open: out of memory\n");
+		emu_close(&e->t);
+		return NULL;
+	}
+	
+	// power up with the tap in reset and the device unconfigured
+	e->state = TLR;
+	e->ir = EMU_INSTR_IDCODE;
+	e->tms = 1;
+	e->init = 1;
+	e->idcode = EMU_IDCODE;
+	e->dna = EMU_DNA;
+	emu_cfg_reset(e);
+	
+	if((s = getenv("S6PROG_EMU_IDCODE")) != NULL)
+		e->idcode = strtoul(s, NULL, 0);
+	if((s = getenv("S6PROG_EMU_DNA")) != NULL)
+		e->dna = strtoull(s, NULL, 0);
+	if(serial != NULL)
+		e->dna += atoi(serial + 3);
+	e->dna &= (1ULL << EMU_DNA_BITS) - 1;
+	
+	if(((s = getenv("S6PROG_EMU_EXPECT")) != NULL) && emu_load_expect(e, s))
+	{
+		emu_close(&e->t);
+		return NULL;
+	}
+	
+	if((s = getenv("S6PROG_EMU_GEOMETRY")) != NULL)
+	{
+		if(bit_geometry_load(s, &e->geometry))
+		{
+			emu_close(&e->t);
+			return NULL;
+		}
+		e->has_geometry = 1;
+	}
+	
+	if((s = getenv("S6PROG_EMU_MEMORY")) != NULL)
+	{
+		if(emu_memory_load(e, s))
+		{
+			emu_close(&e->t);
+			return NULL;
+		}
+		e->memory = s;
+	}
+	
+	e->realtime = (getenv("S6PROG_EMU_REALTIME") != NULL);
+	e->start = transport_now();
+	
+	return &e->t;
+}
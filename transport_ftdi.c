@@ -0,0 +1,171 @@
+/*
+USB transport using libftdi1.
+
+libftdi opens, resets and configures the device. Reads and writes then
+go through the bulk transfer queues in usb_bulk.c on the libusb handle
+libftdi opened, so that several transfers are in flight in each
+direction. ftdi_write_data is synchronous, and the completion of
+ftdi_write_data_submit and ftdi_read_data_submit can only be waited for
+with ftdi_transfer_data_done, which polls libusb without sleeping and
+has no deadline. Only the public fields of struct ftdi_context are
+relied on. Needs libftdi 1.5 or later for ftdi_tcioflush.
+*/
+
+#include "transport.h"
+#include "usb_bulk.h"
+
+#include <ftdi.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+
+struct ftdi_transport
+{
+	struct transport t;
+	struct ftdi_context ftdi;
+	struct usb_bulk bulk;
+};
+
+static void ftdi_transport_close(struct transport * t)
+{
+	struct ftdi_transport * f = (struct ftdi_transport *)t;
+	
+	if(f->bulk.dev != NULL)
+		usb_bulk_flush(&f->bulk);
+	ftdi_tcioflush(&f->ftdi);
+	ftdi_usb_reset(&f->ftdi);
+	usb_bulk_free(&f->bulk);
+	ftdi_usb_close(&f->ftdi);
+	ftdi_deinit(&f->ftdi);
+	free(f);
+}
+
+static int ftdi_transport_packet_size(struct transport * t)
+{
+	return ((struct ftdi_transport *)t)->ftdi.max_packet_size;
+}
+
+// must not be called with a read in flight. writes always go out in
+// USB_BULK_URB_SIZE transfers, whatever 'write_size' is.
+static int ftdi_transport_set_chunk_size(struct transport * t, int write_size, int read_size)
+{
+	return usb_bulk_set_read_size(&((struct ftdi_transport *)t)->bulk, read_size);
+}
+
+static int ftdi_transport_write(struct transport * t, const unsigned char * buf, int n)
+{
+	return usb_bulk_write(&((struct ftdi_transport *)t)->bulk, buf, n);
+}
+
+static int ftdi_transport_writev(struct transport * t, const struct transport_iov * iov, int n)
+{
+	return usb_bulk_writev(&((struct ftdi_transport *)t)->bulk, iov, n);
+}
+
+static int ftdi_transport_flush(struct transport * t)
+{
+	return usb_bulk_flush(&((struct ftdi_transport *)t)->bulk);
+}
+
+static struct transport_read * ftdi_transport_read_submit(struct transport * t, unsigned char * buf, int n)
+{
+	return usb_bulk_read_submit(&((struct ftdi_transport *)t)->bulk, buf, n);
+}
+
+static int ftdi_transport_read_wait(struct transport * t, struct transport_read * r, long timeout_us)
+{
+	return usb_bulk_read_wait(&((struct ftdi_transport *)t)->bulk, r, timeout_us);
+}
+
+struct transport * transport_ftdi_open(const char * serial, unsigned char bitmask)
+{
+	struct ftdi_transport * f;
+	int ret;
+	
+	if((f = calloc(1, sizeof(struct ftdi_transport))) == NULL)
+	{
+		printf("error: transport_ftdi_open: out of memory\n");
+		return NULL;
+	}
+	
+	f->t.name = "ftdi";
+	f->t.close = ftdi_transport_close;
+	f->t.packet_size = ftdi_transport_packet_size;
+	f->t.set_chunk_size = ftdi_transport_set_chunk_size;
+	f->t.write = ftdi_transport_write;
+	f->t.writev = ftdi_transport_writev;
+	f->t.flush = ftdi_transport_flush;
+	f->t.read_submit = ftdi_transport_read_submit;
+	f->t.read_wait = ftdi_transport_read_wait;
+	
+	// initialize ftdi data structure and open the ftdi device with
+	// VID:PID = 0403:6014 and the given serial number, if any
+	ftdi_init(&f->ftdi);
+	if(ftdi_usb_open_desc(&f->ftdi, 0x0403, 0x6014, NULL, serial) < 0)
+	{
+		printf("error: could not open ftdi device\n");
+		ftdi_deinit(&f->ftdi);
+		free(f);
+		return NULL;
+	}
+	
+	// reset ftdi device
+	ret = ftdi_usb_reset(&f->ftdi);
+	
+	// use interface A
+	//ret += ftdi_set_interface(&f->ftdi, INTERFACE_A);
+	
+	// 1ms latency timer
+	ret += ftdi_set_latency_timer(&f->ftdi, 1);
+	
+	// purge buffers
+	ret += ftdi_tcioflush(&f->ftdi);
+	
+	// set bit mode to MPSSE
+	ret += ftdi_set_bitmode(&f->ftdi, 0x00, 0x00);
+	ret += ftdi_set_bitmode(&f->ftdi, bitmask, BITMODE_MPSSE);
+	
+	// libftdi names the endpoints from the device's side, so out_ep is
+	// the host's IN endpoint
+	if(usb_bulk_init(&f->bulk, f->ftdi.usb_ctx, f->ftdi.usb_dev, f->ftdi.out_ep, f->ftdi.in_ep,
+		f->ftdi.max_packet_size) || usb_bulk_set_read_size(&f->bulk, f->ftdi.readbuffer_chunksize))
+		ret = -1;
+	
+	if(ret < 0)
+	{
+		printf("error: transport_ftdi_open: ftdi device config failed\n");
+		ftdi_transport_close(&f->t);
+		return NULL;
+	}
+	
+	return &f->t;
+}
+
+int transport_ftdi_list(char serials[][TRANSPORT_SERIAL_SIZE], int max)
+{
+	struct ftdi_context ftdi;
+	struct ftdi_device_list * list, * d;
+	int n = 0;
+	
+	ftdi_init(&ftdi);
+	if(ftdi_usb_find_all(&ftdi, &list, 0x0403, 0x6014) < 0)
+	{
+		printf("error: transport_ftdi_list: could not list devices\n");
+		ftdi_deinit(&ftdi);
+		return -1;
+	}
+	
+	for(d = list; (d != NULL) && (n < max); d = d->next)
+	{
+		// adapters without a serial number cannot be told apart
+		if(ftdi_usb_get_strings(&ftdi, d->dev, NULL, 0, NULL, 0,
+			serials[n], TRANSPORT_SERIAL_SIZE) < 0 || (serials[n][0] == '\0'))
+			continue;
+		n++;
+	}
+	
+	ftdi_list_free(&list);
+	ftdi_deinit(&ftdi);
+	
+	return n;
+}
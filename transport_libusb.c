@@ -0,0 +1,250 @@
+/*
+USB transport talking to the FT232H directly through libusb-1.0.
+
+The FTDI vendor requests needed to reset the device and enter MPSSE
+mode are issued by hand. Reads and writes go through the bulk transfer
+queues in usb_bulk.c, which keep several transfers in flight in each
+direction so that the device's 1 KB fifos never run dry during long
+shifts.
+*/
+
+#include "transport.h"
+#include "usb_bulk.h"
+
+#include <libusb.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#define TRANSPORT_TIMEOUT_MS (5000)
+
+#define FTDI_VID (0x0403)
+#define FTDI_PID (0x6014)
+#define FTDI_INTERFACE (0)
+#define FTDI_INDEX (1)		// interface A
+#define FTDI_EP_IN (0x81)
+#define FTDI_EP_OUT (0x02)
+
+#define SIO_RESET_REQUEST (0x00)
+#define SIO_SET_LATENCY_TIMER_REQUEST (0x09)
+#define SIO_SET_BITMODE_REQUEST (0x0b)
+#define SIO_RESET_SIO (0)
+#define SIO_RESET_PURGE_RX (1)
+#define SIO_RESET_PURGE_TX (2)
+#define BITMODE_RESET (0x00)
+#define BITMODE_MPSSE (0x02)
+
+struct libusb_transport
+{
+	struct transport t;
+	
+	libusb_context * ctx;
+	libusb_device_handle * dev;
+	struct usb_bulk bulk;
+};
+
+static int transport_control(struct libusb_transport * u, int request, int value)
+{
+	return libusb_control_transfer(u->dev,
+		LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE | LIBUSB_ENDPOINT_OUT,
+		request, value, FTDI_INDEX, NULL, 0, TRANSPORT_TIMEOUT_MS);
+}
+
+static int libusb_transport_packet_size(struct transport * t)
+{
+	return ((struct libusb_transport *)t)->bulk.packet;
+}
+
+// must not be called with a read in flight. writes always go out in
+// USB_BULK_URB_SIZE transfers, whatever 'write_size' is.
+static int libusb_transport_set_chunk_size(struct transport * t, int write_size, int read_size)
+{
+	return usb_bulk_set_read_size(&((struct libusb_transport *)t)->bulk, read_size);
+}
+
+static int libusb_transport_write(struct transport * t, const unsigned char * buf, int n)
+{
+	return usb_bulk_write(&((struct libusb_transport *)t)->bulk, buf, n);
+}
+
+static int libusb_transport_writev(struct transport * t, const struct transport_iov * iov, int n)
+{
+	return usb_bulk_writev(&((struct libusb_transport *)t)->bulk, iov, n);
+}
+
+static int libusb_transport_flush(struct transport * t)
+{
+	return usb_bulk_flush(&((struct libusb_transport *)t)->bulk);
+}
+
+static struct transport_read * libusb_transport_read_submit(struct transport * t, unsigned char * buf, int n)
+{
+	return usb_bulk_read_submit(&((struct libusb_transport *)t)->bulk, buf, n);
+}
+
+static int libusb_transport_read_wait(struct transport * t, struct transport_read * r, long timeout_us)
+{
+	return usb_bulk_read_wait(&((struct libusb_transport *)t)->bulk, r, timeout_us);
+}
+
+static void libusb_transport_close(struct transport * t)
+{
+	struct libusb_transport * u = (struct libusb_transport *)t;
+	
+	if(u->dev != NULL)
+	{
+		if(u->bulk.dev != NULL)
+			usb_bulk_flush(&u->bulk);
+		transport_control(u, SIO_RESET_REQUEST, SIO_RESET_PURGE_RX);
+		transport_control(u, SIO_RESET_REQUEST, SIO_RESET_PURGE_TX);
+		transport_control(u, SIO_RESET_REQUEST, SIO_RESET_SIO);
+		usb_bulk_free(&u->bulk);
+		libusb_release_interface(u->dev, FTDI_INTERFACE);
+		libusb_close(u->dev);
+	}
+	
+	if(u->ctx != NULL)
+		libusb_exit(u->ctx);
+	free(u);
+}
+
+// open the FT232H whose serial number is 'serial', or if 'serials' is
+// not NULL list the serial numbers of up to 'max' of them into it
+// instead. '*n' is set to the number listed.
+static libusb_device_handle * transport_scan(libusb_context * ctx, const char * serial,
+	char serials[][TRANSPORT_SERIAL_SIZE], int max, int * n)
+{
+	struct libusb_device_descriptor desc;
+	libusb_device_handle * dev, * found = NULL;
+	libusb_device ** list;
+	char s[TRANSPORT_SERIAL_SIZE];
+	ssize_t count, i;
+	
+	*n = 0;
+	if((count = libusb_get_device_list(ctx, &list)) < 0)
+		return NULL;
+	
+	for(i = 0; (i < count) && (found == NULL) && ((serials == NULL) || (*n < max)); i++)
+	{
+		if(libusb_get_device_descriptor(list[i], &desc) ||
+			(desc.idVendor != FTDI_VID) || (desc.idProduct != FTDI_PID))
+			continue;
+		
+		if(libusb_open(list[i], &dev))
+			continue;
+		
+		if(libusb_get_string_descriptor_ascii(dev, desc.iSerialNumber, (unsigned char *)s, sizeof(s)) < 0)
+			s[0] = '\0';
+		
+		if(serials != NULL)
+		{
+			// adapters without a serial number cannot be told apart
+			if(s[0] != '\0')
+				strcpy(serials[(*n)++], s);
+			libusb_close(dev);
+		} else if(!strcmp(s, serial))
+			found = dev;
+		else
+			libusb_close(dev);
+	}
+	
+	libusb_free_device_list(list, 1);
+	
+	return found;
+}
+
+int transport_libusb_list(char serials[][TRANSPORT_SERIAL_SIZE], int max)
+{
+	libusb_context * ctx;
+	int n;
+	
+	if(libusb_init(&ctx) < 0)
+	{
+		printf("error: transport_libusb_list: could not initialize libusb\n");
+		return -1;
+	}
+	
+	transport_scan(ctx, NULL, serials, max, &n);
+	libusb_exit(ctx);
+	
+	return n;
+}
+
+struct transport * transport_libusb_open(const char * serial, unsigned char bitmask)
+{
+	struct libusb_transport * u;
+	int ret, packet, i;
+	
+	if((u = calloc(1, sizeof(struct libusb_transport))) == NULL)
+	{
+		printf("error: transport_libusb_open: out of memory\n");
+		return NULL;
+	}
+	
+	u->t.name = "libusb";
+	u->t.close = libusb_transport_close;
+	u->t.packet_size = libusb_transport_packet_size;
+	u->t.set_chunk_size = libusb_transport_set_chunk_size;
+	u->t.write = libusb_transport_write;
+	u->t.writev = libusb_transport_writev;
+	u->t.flush = libusb_transport_flush;
+	u->t.read_submit = libusb_transport_read_submit;
+	u->t.read_wait = libusb_transport_read_wait;
+	
+	if(libusb_init(&u->ctx) < 0)
+	{
+		printf("error: transport_libusb_open: could not initialize libusb\n");
+		free(u);
+		return NULL;
+	}
+	
+	if(serial == NULL)
+		u->dev = libusb_open_device_with_vid_pid(u->ctx, FTDI_VID, FTDI_PID);
+	else
+		u->dev = transport_scan(u->ctx, serial, NULL, 0, &i);
+	
+	if(u->dev == NULL)
+	{
+		printf("error: could not open ftdi device\n");
+		libusb_transport_close(&u->t);
+		return NULL;
+	}
+	
+	libusb_set_auto_detach_kernel_driver(u->dev, 1);
+	if(libusb_claim_interface(u->dev, FTDI_INTERFACE) < 0)
+	{
+		printf("error: transport_libusb_open: could not claim interface\n");
+		libusb_close(u->dev);
+		u->dev = NULL;
+		libusb_transport_close(&u->t);
+		return NULL;
+	}
+	
+	if((packet = libusb_get_max_packet_size(libusb_get_device(u->dev), FTDI_EP_IN)) <= USB_BULK_STATUS_BYTES)
+		packet = 512;
+	
+	if(usb_bulk_init(&u->bulk, u->ctx, u->dev, FTDI_EP_IN, FTDI_EP_OUT, packet))
+	{
+		printf("error: transport_libusb_open: could not allocate transfers\n");
+		libusb_transport_close(&u->t);
+		return NULL;
+	}
+	
+	// reset, 1ms latency timer, purge buffers and set bit mode to MPSSE
+	ret = transport_control(u, SIO_RESET_REQUEST, SIO_RESET_SIO);
+	ret |= transport_control(u, SIO_SET_LATENCY_TIMER_REQUEST, 1);
+	ret |= transport_control(u, SIO_RESET_REQUEST, SIO_RESET_PURGE_RX);
+	ret |= transport_control(u, SIO_RESET_REQUEST, SIO_RESET_PURGE_TX);
+	ret |= transport_control(u, SIO_SET_BITMODE_REQUEST, BITMODE_RESET << 8);
+	ret |= transport_control(u, SIO_SET_BITMODE_REQUEST, (BITMODE_MPSSE << 8) | bitmask);
+	
+	if((ret < 0) || usb_bulk_set_read_size(&u->bulk, USB_BULK_URB_SIZE))
+	{
+		printf("error: transport_libusb_open: ftdi device config failed\n");
+		libusb_transport_close(&u->t);
+		return NULL;
+	}
+	
+	return &u->t;
+}
@@ -0,0 +1,476 @@
+/*
+Bulk transfer queues shared by the usb transports. See usb_bulk.h.
+*/
+
+#include "usb_bulk.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+struct transport_read
+{
+	struct usb_bulk * b;
+	struct transport_read * next;
+	struct libusb_transfer * transfer;
+	unsigned char * tbuf;
+	
+	unsigned char * buf;
+	int size;
+	int offset;
+	int error;
+	int used;
+	int queued;
+	int busy;
+	int cancelling;
+};
+
+// handle usb events for at most 'ms' milliseconds
+static int usb_bulk_events(struct usb_bulk * b, long ms)
+{
+	struct timeval tv;
+	
+	tv.tv_sec = ms / 1000;
+	tv.tv_usec = (ms % 1000) * 1000;
+	return libusb_handle_events_timeout_completed(b->ctx, &tv, NULL);
+}
+
+int usb_bulk_init(struct usb_bulk * b, libusb_context * ctx, libusb_device_handle * dev,
+	unsigned char ep_in, unsigned char ep_out, int packet)
+{
+	int i, ret = 0;
+	
+	b->ctx = ctx;
+	b->dev = dev;
+	b->ep_in = ep_in;
+	b->ep_out = ep_out;
+	b->packet = packet;
+	pthread_mutex_init(&b->lock, NULL);
+	
+	for(i = 0; i < USB_BULK_OUT_URBS; i++)
+	{
+		if(((b->out[i].transfer = libusb_alloc_transfer(0)) == NULL) ||
+			((b->out[i].buf = malloc(USB_BULK_URB_SIZE)) == NULL))
+			ret = 1;
+	}
+	
+	if((b->reads = calloc(TRANSPORT_MAX_READS, sizeof(struct transport_read))) == NULL)
+		return 1;
+	for(i = 0; i < TRANSPORT_MAX_READS; i++)
+	{
+		b->reads[i].b = b;
+		if((b->reads[i].transfer = libusb_alloc_transfer(0)) == NULL)
+			ret = 1;
+	}
+	
+	return ret;
+}
+
+void usb_bulk_free(struct usb_bulk * b)
+{
+	int i;
+	
+	if(b->dev == NULL)
+		return;
+	
+	for(i = 0; i < USB_BULK_OUT_URBS; i++)
+	{
+		if(b->out[i].transfer != NULL)
+			libusb_free_transfer(b->out[i].transfer);
+		free(b->out[i].buf);
+	}
+	
+	if(b->reads != NULL)
+		for(i = 0; i < TRANSPORT_MAX_READS; i++)
+		{
+			if(b->reads[i].transfer != NULL)
+				libusb_free_transfer(b->reads[i].transfer);
+			free(b->reads[i].tbuf);
+		}
+	free(b->reads);
+	free(b->residue);
+	
+	pthread_mutex_destroy(&b->lock);
+	b->dev = NULL;
+}
+
+int usb_bulk_set_read_size(struct usb_bulk * b, int size)
+{
+	int i;
+	
+	// whole packets per IN transfer
+	size += b->packet - 1;
+	size -= size % b->packet;
+	
+	for(i = 0; i < TRANSPORT_MAX_READS; i++)
+	{
+		free(b->reads[i].tbuf);
+		if((b->reads[i].tbuf = malloc(size)) == NULL)
+			return 1;
+	}
+	
+	// the residue grows when it has to, this is enough for a read's
+	// worth of data past the end of the one before
+	free(b->residue);
+	b->residue_off = 0;
+	b->residue_len = 0;
+	b->in_error = 0;
+	if((b->residue = malloc(size)) == NULL)
+		return 1;
+	b->residue_size = size;
+	
+	b->read_size = size;
+	
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////
+// writes
+////////////////////////////////////////////////////////////////////////
+
+static void write_cb(struct libusb_transfer * t)
+{
+	struct usb_bulk_out * o = t->user_data;
+	
+	if((t->status != LIBUSB_TRANSFER_COMPLETED) || (t->actual_length != t->length))
+		*o->error = 1;
+	o->busy = 0;
+}
+
+// wait for the OUT transfer 'o' to come back
+static int out_wait(struct usb_bulk * b, struct usb_bulk_out * o)
+{
+	while(o->busy)
+		if(usb_bulk_events(b, USB_BULK_EVENT_MS) < 0)
+		{
+			b->out_error = 1;
+			return 1;
+		}
+	
+	return 0;
+}
+
+// submit the next OUT transfer for the 'n' bytes at 'buf', which is
+// either its own buffer or data sent in place. it must already be free.
+static int out_start(struct usb_bulk * b, const unsigned char * buf, int n)
+{
+	struct usb_bulk_out * o = &b->out[b->out_next];
+	
+	// libusb takes a non const buffer but does not write to OUT ones
+	libusb_fill_bulk_transfer(o->transfer, b->dev, b->ep_out, (unsigned char *)buf, n,
+		write_cb, o, USB_BULK_TIMEOUT_MS);
+	o->error = &b->out_error;
+	b->out_next = (b->out_next + 1) % USB_BULK_OUT_URBS;
+	
+	// the callback can run on another thread as soon as it is submitted
+	atomic_store(&o->busy, 1);
+	if(libusb_submit_transfer(o->transfer) < 0)
+	{
+		atomic_store(&o->busy, 0);
+		b->out_error = 1;
+		return 1;
+	}
+	
+	return 0;
+}
+
+// submit the current OUT transfer, if anything is in it
+static int out_submit(struct usb_bulk * b)
+{
+	int n = b->out_fill;
+	
+	if(n == 0)
+		return 0;
+	
+	b->out_fill = 0;
+	return out_start(b, b->out[b->out_next].buf, n);
+}
+
+// send 'n' bytes at 'buf' in a transfer of their own, without copying
+// them, after the bytes already queued. 'buf' must stay valid until
+// flush.
+static int out_ref(struct usb_bulk * b, const unsigned char * buf, int n)
+{
+	if(out_submit(b) || out_wait(b, &b->out[b->out_next]))
+		return 1;
+	
+	return out_start(b, buf, n);
+}
+
+// queue 'n' bytes at 'buf' behind the ones already in the current OUT
+// transfer, submitting it whenever it fills up. only the transfer
+// about to be reused is waited for.
+static int out_put(struct usb_bulk * b, const unsigned char * buf, int n)
+{
+	struct usb_bulk_out * o;
+	int l;
+	
+	while(n > 0)
+	{
+		o = &b->out[b->out_next];
+		if((b->out_fill == 0) && out_wait(b, o))
+			return 1;
+		
+		l = (n > USB_BULK_URB_SIZE - b->out_fill) ? (USB_BULK_URB_SIZE - b->out_fill) : n;
+		memcpy(&o->buf[b->out_fill], buf, l);
+		b->out_fill += l;
+		buf += l;
+		n -= l;
+		
+		if(b->out_fill == USB_BULK_URB_SIZE)
+			if(out_submit(b))
+				return 1;
+	}
+	
+	return 0;
+}
+
+// copies the data into USB_BULK_URB_SIZE transfers and returns once
+// they are submitted. a failed transfer is reported by a later write or
+// by flush.
+int usb_bulk_write(struct usb_bulk * b, const unsigned char * buf, int n)
+{
+	if(out_put(b, buf, n) || out_submit(b) || b->out_error)
+		return -1;
+	
+	return n;
+}
+
+// same as usb_bulk_write, with the pieces gathered back to back into
+// the transfers. pieces marked 'ref' go out in place, in transfers of
+// their own, and only the bytes between them are copied.
+int usb_bulk_writev(struct usb_bulk * b, const struct transport_iov * iov, int n)
+{
+	int i, length = 0;
+	
+	for(i = 0; i < n; i++)
+	{
+		if(iov[i].ref ? out_ref(b, iov[i].p, iov[i].length) : out_put(b, iov[i].p, iov[i].length))
+			return -1;
+		length += iov[i].length;
+	}
+	
+	if(out_submit(b) || b->out_error)
+		return -1;
+	
+	return length;
+}
+
+// wait for every OUT transfer to complete
+int usb_bulk_flush(struct usb_bulk * b)
+{
+	int i;
+	
+	for(i = 0; i < USB_BULK_OUT_URBS; i++)
+		out_wait(b, &b->out[i]);
+	
+	return atomic_exchange(&b->out_error, 0);
+}
+
+////////////////////////////////////////////////////////////////////////
+// reads
+////////////////////////////////////////////////////////////////////////
+
+// keep 'n' bytes that no read is waiting for yet, with the lock held
+static void residue_put(struct usb_bulk * b, const unsigned char * p, int n)
+{
+	unsigned char * q;
+	int size;
+	
+	// drop what has been read before growing
+	if((b->residue_len + n > b->residue_size) && (b->residue_off > 0))
+	{
+		memmove(b->residue, &b->residue[b->residue_off], b->residue_len - b->residue_off);
+		b->residue_len -= b->residue_off;
+		b->residue_off = 0;
+	}
+	
+	if(b->residue_len + n > b->residue_size)
+	{
+		for(size = b->residue_size * 2; size < b->residue_len + n; size *= 2)
+			;
+		if((q = realloc(b->residue, size)) == NULL)
+		{
+			b->in_error = 1;
+			return;
+		}
+		b->residue = q;
+		b->residue_size = size;
+	}
+	
+	memcpy(&b->residue[b->residue_len], p, n);
+	b->residue_len += n;
+}
+
+// hand the payload of received packets to the queued reads, oldest
+// first, with the lock held
+static void read_take(struct usb_bulk * b, const unsigned char * p, int len)
+{
+	struct transport_read * r;
+	const unsigned char * d;
+	int l, c;
+	
+	for(; len > 0; p += b->packet, len -= b->packet)
+	{
+		l = ((len > b->packet) ? b->packet : len) - USB_BULK_STATUS_BYTES;
+		d = &p[USB_BULK_STATUS_BYTES];
+		
+		while((l > 0) && (b->head != NULL))
+		{
+			r = b->head;
+			c = r->size - r->offset;
+			if(c > l)
+				c = l;
+			memcpy(&r->buf[r->offset], d, c);
+			r->offset += c;
+			d += c;
+			l -= c;
+			
+			if(r->offset == r->size)
+			{
+				r->queued = 0;
+				b->head = r->next;
+				if(b->head == NULL)
+					b->tail = NULL;
+			}
+		}
+		
+		if(l > 0)
+			residue_put(b, d, l);
+	}
+}
+
+// take 'r' off the queue, with the lock held
+static void read_unqueue(struct usb_bulk * b, struct transport_read * r)
+{
+	struct transport_read ** p;
+	
+	if(!r->queued)
+		return;
+	
+	for(p = &b->head; *p != r; p = &(*p)->next)
+		;
+	*p = r->next;
+	
+	for(b->tail = b->head; (b->tail != NULL) && (b->tail->next != NULL); b->tail = b->tail->next)
+		;
+	r->queued = 0;
+}
+
+static void read_cb(struct libusb_transfer * t)
+{
+	struct transport_read * r = t->user_data;
+	struct usb_bulk * b = r->b;
+	
+	pthread_mutex_lock(&b->lock);
+	r->busy = 0;
+	
+	// cancelled and timed out transfers can still carry data
+	if((t->status == LIBUSB_TRANSFER_COMPLETED) ||
+		(t->status == LIBUSB_TRANSFER_CANCELLED) ||
+		(t->status == LIBUSB_TRANSFER_TIMED_OUT))
+		read_take(b, t->buffer, t->actual_length);
+	else
+		r->error = 1;
+	
+	// keep the transfer going until this read has all of its bytes
+	if(r->queued && !r->error && !r->cancelling)
+	{
+		if(libusb_submit_transfer(t) < 0)
+			r->error = 1;
+		else
+			r->busy = 1;
+	}
+	
+	pthread_mutex_unlock(&b->lock);
+}
+
+// reads are filled in the order they are submitted and must be waited
+// for in that order, so the slots are used round robin
+struct transport_read * usb_bulk_read_submit(struct usb_bulk * b, unsigned char * buf, int n)
+{
+	struct transport_read * r;
+	
+	pthread_mutex_lock(&b->lock);
+	
+	r = &b->reads[b->read_next];
+	if(r->used || b->in_error)
+	{
+		pthread_mutex_unlock(&b->lock);
+		return NULL;
+	}
+	b->read_next = (b->read_next + 1) % TRANSPORT_MAX_READS;
+	
+	r->used = 1;
+	r->buf = buf;
+	r->size = n;
+	r->error = 0;
+	r->cancelling = 0;
+	r->next = NULL;
+	
+	// bytes left over from the reads before come first. there are only
+	// any when no read is queued.
+	r->offset = (b->residue_len - b->residue_off < n) ? (b->residue_len - b->residue_off) : n;
+	memcpy(buf, &b->residue[b->residue_off], r->offset);
+	b->residue_off += r->offset;
+	if(b->residue_off == b->residue_len)
+		b->residue_off = b->residue_len = 0;
+	
+	if(r->offset < n)
+	{
+		r->queued = 1;
+		if(b->tail != NULL)
+			b->tail->next = r;
+		else
+			b->head = r;
+		b->tail = r;
+		
+		libusb_fill_bulk_transfer(r->transfer, b->dev, b->ep_in, r->tbuf, b->read_size,
+			read_cb, r, 0);
+		if(libusb_submit_transfer(r->transfer) < 0)
+			r->error = 1;
+		else
+			r->busy = 1;
+	}
+	
+	pthread_mutex_unlock(&b->lock);
+	
+	return r;
+}
+
+int usb_bulk_read_wait(struct usb_bulk * b, struct transport_read * r, long timeout_us)
+{
+	double deadline = transport_now() + timeout_us * 1e-6;
+	long left;
+	int ret = 0;
+	
+	pthread_mutex_lock(&b->lock);
+	for(;;)
+	{
+		// once the read is complete, has failed or is out of time its
+		// transfer is cancelled, and it is done when that has come back
+		left = (long)((deadline - transport_now()) * 1e3);
+		if((!r->queued || r->error || (left <= 0)) && !r->cancelling)
+		{
+			r->cancelling = 1;
+			if(r->busy)
+				libusb_cancel_transfer(r->transfer);
+		}
+		if(r->cancelling && !r->busy)
+			break;
+		pthread_mutex_unlock(&b->lock);
+		
+		ret = usb_bulk_events(b, ((left <= 0) || (left > USB_BULK_EVENT_MS)) ? USB_BULK_EVENT_MS : left);
+		
+		pthread_mutex_lock(&b->lock);
+		if(ret < 0)
+			r->error = 1;
+	}
+	
+	read_unqueue(b, r);
+	ret = r->error ? -1 : r->offset;
+	r->used = 0;
+	
+	pthread_mutex_unlock(&b->lock);
+	
+	return ret;
+}
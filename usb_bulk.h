@@ -0,0 +1,107 @@
+/*
+Bulk transfer queues on an FT232H's libusb device handle, shared by the
+usb transports: transport_libusb.c opens the device itself and
+transport_ftdi.c lets libftdi open and configure it.
+
+Writes are copied into USB_BULK_OUT_URBS transfers of USB_BULK_URB_SIZE
+bytes, used in turn, and return once they are submitted so that several
+stay queued between calls. Only flush waits for them to complete. The
+pieces of a gathered write that the caller keeps valid until the flush,
+the large shifts jtag_add_ref queues, take the next transfer in the turn
+themselves and are sent from where they are without being copied.
+
+Every read has a transfer and buffer of its own, and up to
+TRANSPORT_MAX_READS reads can be queued on the IN endpoint at once, so
+the device's fifo is drained while the next chunks are still being
+shifted. Whichever transfer completes, its payload goes to the oldest
+read still short of data, then to the one after it, and bytes that no
+read is waiting for yet are kept in a residue buffer for the next one.
+Every IN packet starts with two modem status bytes which are stripped.
+
+Transfer callbacks run on whichever thread is handling libusb events,
+the jtag sender thread while it writes or the caller while it waits for
+a read. The OUT transfer flags are atomic and the reads are only
+touched under the queue's lock.
+*/
+
+#ifndef USB_BULK_H
+#define USB_BULK_H
+
+#include "transport.h"
+
+#include <libusb.h>
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define USB_BULK_OUT_URBS (4)
+#define USB_BULK_URB_SIZE (16384)
+#define USB_BULK_TIMEOUT_MS (5000)
+#define USB_BULK_EVENT_MS (100)
+#define USB_BULK_STATUS_BYTES (2)
+
+struct usb_bulk_out
+{
+	struct libusb_transfer * transfer;
+	unsigned char * buf;
+	atomic_int busy;
+	atomic_int * error;
+};
+
+struct usb_bulk
+{
+	libusb_context * ctx;
+	libusb_device_handle * dev;
+	unsigned char ep_in;
+	unsigned char ep_out;
+	int packet;
+	
+	// OUT transfers are used in turn, out_next is the one being filled
+	struct usb_bulk_out out[USB_BULK_OUT_URBS];
+	int out_next;
+	int out_fill;
+	atomic_int out_error;
+	
+	// held by the read callbacks and by read_submit and read_wait
+	pthread_mutex_t lock;
+	
+	// TRANSPORT_MAX_READS reads, used in turn, each with a transfer of
+	// read_size bytes. the ones still short of data are queued from
+	// head to tail in the order they were submitted.
+	struct transport_read * reads;
+	int read_next;
+	int read_size;
+	struct transport_read * head;
+	struct transport_read * tail;
+	
+	// bytes received beyond the end of the last read. in_error is set
+	// if some could not be kept.
+	unsigned char * residue;
+	int residue_off;
+	int residue_len;
+	int residue_size;
+	int in_error;
+};
+
+// set up the queues for endpoints 'ep_in' and 'ep_out' of 'dev', whose
+// bulk packets are 'packet' bytes. returns 1 on error, 'b' must still
+// be released with usb_bulk_free.
+int usb_bulk_init(struct usb_bulk * b, libusb_context * ctx, libusb_device_handle * dev,
+	unsigned char ep_in, unsigned char ep_out, int packet);
+
+// release the transfers and buffers. no read may be in flight and the
+// writes must have been flushed.
+void usb_bulk_free(struct usb_bulk * b);
+
+// size the IN transfers for reads of up to 'size' bytes of packets,
+// status bytes included. must not be called with a read in flight.
+int usb_bulk_set_read_size(struct usb_bulk * b, int size);
+
+// the transport methods of the same names
+int usb_bulk_write(struct usb_bulk * b, const unsigned char * buf, int n);
+int usb_bulk_writev(struct usb_bulk * b, const struct transport_iov * iov, int n);
+int usb_bulk_flush(struct usb_bulk * b);
+struct transport_read * usb_bulk_read_submit(struct usb_bulk * b, unsigned char * buf, int n);
+int usb_bulk_read_wait(struct usb_bulk * b, struct transport_read * r, long timeout_us);
+
+#endif